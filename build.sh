@@ -5,9 +5,15 @@ mkdir -p build
 # gcc src/witout_nn/timestwo.c -o build/timestwo -O0 -g
 # gcc src/witout_nn/logicgates.c -o build/logicgates -O0 -g -lm
 # gcc src/witout_nn/logicgates_xor.c -o build/logicgates_xor -O0 -g -lm
-gcc src/logicgates_xor_nn.c -o build/logicgates_xor_nn -O0 -g -Wall -Wextra -lm
+gcc src/logicgates_xor_nn.c -o build/logicgates_xor_nn -O0 -g -Wall -Wextra -pthread -lm
 
-# gcc src/test_nn_mat.c -o build/test_nn_mat -O0 -g -Wall -Wextra -lm
+gcc src/test_nn_mat.c -o build/test_nn_mat -O0 -g -Wall -Wextra -pthread -lm
+
+gcc src/bench_nn.c -o build/bench_nn -O3 -march=native -Wall -Wextra -pthread -lm
+
+gcc src/serve_nn.c -o build/serve_nn -O3 -march=native -Wall -Wextra -pthread -lm
+
+gcc src/quantize_nn.c -o build/quantize_nn -O3 -march=native -Wall -Wextra -pthread -lm
 
 
 if [[ -n $1 ]] && [[ "${1}" = "run" ]]
@@ -22,3 +28,9 @@ if [[ -n $1 ]] && [[ "${1}" = "test" ]]
 then
   build/test_nn_mat
 fi
+
+if [[ -n $1 ]] && [[ "${1}" = "bench" ]]
+then
+  shift
+  build/bench_nn "$@"
+fi
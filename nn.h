@@ -5,29 +5,99 @@
 #ifndef NN_H
 #define NN_H
 
-#include <math.h>   // expf
-#include <stddef.h> // size_t
-#include <stdio.h>  // printf
-#include <string.h> // strlen
+#include <math.h>    // expf
+#include <pthread.h> // pthread_create
+#include <stddef.h>  // size_t
+#include <stdint.h>  // uint64_t
+#include <stdio.h>   // printf
+#include <string.h>  // strlen
+#include <time.h>    // clock_gettime
+
+#include <fcntl.h>    // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // close
 
 #ifndef NN_MALLOC
 #include <stdlib.h>
 #define NN_MALLOC malloc
 #endif // NN_MALLOC
 
+#ifndef NN_FREE
+#include <stdlib.h>
+#define NN_FREE free
+#endif // NN_FREE
+
+// alignment of parameter, gradient and scratch blocks, and of model blobs
+#define NN_ALIGNMENT 64
+
+#ifndef NN_ALIGNED_ALLOC
+#include <stdlib.h>
+// size is a multiple of NN_ALIGNMENT; released with NN_FREE
+#define NN_ALIGNED_ALLOC(size) aligned_alloc(NN_ALIGNMENT, size)
+#endif // NN_ALIGNED_ALLOC
+
 #ifndef NN_ASSERT
 #include <assert.h>
 #define NN_ASSERT assert
 #endif // NN_ASSERT
 
+// GEMM blocking: MR x NR register tile, KC x NR panels of b stay in L1,
+// MC x KC blocks of a stay in L2, KC x NC panels of b stay in L3.
+#ifndef NN_GEMM_MR
+#define NN_GEMM_MR 4
+#endif // NN_GEMM_MR
+#ifndef NN_GEMM_NR
+#define NN_GEMM_NR 8
+#endif // NN_GEMM_NR
+#ifndef NN_GEMM_MC
+#define NN_GEMM_MC 128
+#endif // NN_GEMM_MC
+#ifndef NN_GEMM_KC
+#define NN_GEMM_KC 256
+#endif // NN_GEMM_KC
+#ifndef NN_GEMM_NC
+#define NN_GEMM_NC 2048
+#endif // NN_GEMM_NC
+
+// Largest number of samples pushed through the network in one batched pass;
+// bigger (mini-)batches are processed in chunks of this size.
+#ifndef NN_MAX_BATCH
+#define NN_MAX_BATCH 256
+#endif // NN_MAX_BATCH
+
+// Compile with -DNN_PROFILE to time the forward pass, backprop and update of
+// every layer, see nn_profile_print.
+#ifndef NN_PROFILE_MAX_LAYERS
+#define NN_PROFILE_MAX_LAYERS 64
+#endif // NN_PROFILE_MAX_LAYERS
+#ifndef NN_PROFILE_MAX_EVENTS
+#define NN_PROFILE_MAX_EVENTS (1 << 18) // trace events kept after a reset
+#endif // NN_PROFILE_MAX_EVENTS
+
 // --------------------------------------------------------------
 
 #define ARRAY_LEN(arr) sizeof(arr) / sizeof(arr[0])
 
+typedef struct {
+  // xoshiro256** state; create it with nn_rng_seed, it must not be all zero
+  uint64_t s[4];
+} NN_Rng;
+
+NN_Rng nn_rng_seed(uint64_t seed);
+NN_Rng nn_rng_stream(uint64_t seed, size_t stream);
+void nn_rng_jump(NN_Rng *rng);
+uint64_t nn_rng_next(NN_Rng *rng);
+float nn_rng_float(NN_Rng *rng);
+size_t nn_rng_below(NN_Rng *rng, size_t n);
+void nn_seed(uint64_t seed);
+
 float rand_float();
 void shuffle_array(size_t *array, size_t n);
+void shuffle_array_rng(size_t *array, size_t n, NN_Rng *rng);
 float squared_error(float y_pred, float y_true);
 float squared_error_derivative(float y_pred, float y_true);
+float cross_entropy(float log_p_pred, float y_true);
 float sigmoid(float x);
 float sigmoid_derivative(float x);
 float relu(float x);
@@ -41,10 +111,16 @@ typedef enum {
   SIGMOID = 1,
   RELU = 2,
   LEAKY_RELU = 3,
+  SOFTMAX = 4, // output layer only, trained with cross-entropy loss
 } Sigma;
 
+#define NN_LEAKY_SLOPE 0.001f // slope of LEAKY_RELU for x <= 0
+
 float sigma(float x, Sigma f);
 float sigma_derivative(float x, Sigma f);
+void sigma_array(float *a, const float *z, size_t n, Sigma f);
+void sigma_derivative_mul_array(float *e, const float *z, size_t n, Sigma f);
+const char *nn_simd_name(void);
 
 // --------------------------------------------------------------
 
@@ -58,26 +134,55 @@ typedef struct {
 #define MAT_AT(mat, row, col) mat.p_data[(row) * (mat).stride + (col)]
 
 Matrix mat_alloc(size_t num_rows, size_t num_cols);
+void mat_free(Matrix m);
 void mat_print(Matrix m, const char *name, size_t offset_left);
 #define MAT_PRINT(m) mat_print(m, #m, 0)
 
 void mat_fill(Matrix m, float x);
 void mat_rand(Matrix m, float min, float max);
+void mat_rand_rng(Matrix m, float min, float max, NN_Rng *rng);
 Matrix mat_row(Matrix m, size_t row);
+Matrix mat_rows(Matrix m, size_t row, size_t n);
 void mat_copy(Matrix dst, Matrix m);
 // void mat_trp(Matrix m);
 void mat_add_num(Matrix m, float x);
 void mat_add_mat(Matrix a, Matrix b);
 void mat_mul_num(Matrix m, float x);
 void mat_mul_mat(Matrix dst, Matrix a, Matrix b);
+void mat_gemm(Matrix dst, Matrix a, int trp_a, Matrix b, int trp_b,
+              int accumulate);
+void mat_dense(Matrix act, Matrix z, Matrix x, Matrix w, Matrix b, Sigma f);
 void mat_sigmoid(Matrix m);
 
 // --------------------------------------------------------------
 
+typedef enum {
+  // Implemented layer kinds
+  NN_DENSE = 0, // a = sigma(a_prev * W + b)
+} NN_LayerKind;
+
+typedef struct {
+  // Describes one layer for nn_create_layers; layer 0 is the input layer,
+  // of which only dim is used.
+  size_t dim;        // number of neurons
+  Sigma act;         // activation function
+  NN_LayerKind kind; // NN_DENSE
+} NN_Layer;
+
 typedef struct {
   // The input layer (index 0 of the arrays) does not use weights, biases,
-  // weight_grads or bias_grads. These elements still get allocated because
-  // it makes indexing these arrays by layer more coherent.
+  // weight_grads or bias_grads. These elements are empty 0x0 matrices
+  // because it makes indexing these arrays by layer more coherent.
+  // weighted_sums, activations and errors hold one row per sample of the
+  // current batch (1 row unless grown with nn_reserve_batch).
+  //
+  // Memory lives in a few aligned blocks:
+  //  - params:  [w1 | b1 | w2 | b2 | ...], each padded to NN_ALIGNMENT,
+  //             the same layout as the weights of a model file
+  //  - grads:   same layout as params, followed by the loss vectors
+  //  - scratch: activations, weighted_sums and errors; starts at
+  //             activations[0].p_data
+  //  - the layer arrays and descriptors, which start at weighted_sums
   size_t n_layers;
   Matrix *weighted_sums; // array of Vectors; z = w*a_prev + b
   Matrix *activations;   // array of Vectors; a = sigma(z)
@@ -89,28 +194,136 @@ typedef struct {
   Matrix loss_step;      // Vector
   Matrix loss_batch;     // Vector
   Matrix loss_epoch;     // Vector
-  Sigma s_hidden;        // activation function
-  Sigma s_output;        // activation function
+  NN_Layer *layers;      // dim, activation and kind of each layer
+  float *params;         // all weights and biases
+  float *grads;          // all weight and bias gradients
+  size_t n_params;       // floats in params and grads, including padding
+  void *map_base;        // file mapping holding params (nn_mmap) or NULL
+  size_t map_size;
 } NN;
 
+// Element type of the weights stored in a model file
+typedef enum {
+  NN_F32 = 0,  // float weights, NN.params layout
+  NN_I8 = 1,   // int8 weights, NN_QLayer layout
+  NN_F16 = 2,  // IEEE half weights, float biases
+  NN_BF16 = 3, // bfloat16 weights, float biases
+} NN_DType;
+
+typedef struct {
+  // Int8 weights of one layer, quantized per output channel:
+  //   w[i][j] ~= q[j][i] * w_scale[j]   and   a[i] ~= q_a[i] * a_scale
+  // so  z[j] = a_scale * w_scale[j] * sum_i q_a[i] * q[j][i] + b[j]
+  // q is stored transposed, one zero padded row of k_stride per channel.
+  int8_t *q;
+  size_t k_stride; // dim_in rounded up to NN_ALIGNMENT
+  float *w_scale;  // dim_out
+  float a_scale;   // scale of the layer inputs, from calibration
+  int32_t *w_sum;  // sum_i q[j][i] per channel, for u8 x s8 kernels
+} NN_QLayer;
+
+typedef struct {
+  // Inference-only network: weights and biases, no gradients, errors, losses
+  // or activations. It is never written to after creation, so any number of
+  // threads can predict with one model, each through its own NN_InferCtx.
+  size_t n_layers;
+  NN_DType dtype;
+  Matrix *weights;     // array of Matrices, same layout as NN.weights;
+                       // not NN_F32: p_data is NULL, only the dims are set
+  Matrix *biases;      // array of Vectors
+  NN_QLayer *qlayers;  // NN_I8: int8 weights and scales, else NULL
+  uint16_t **weights_h; // NN_F16, NN_BF16: 16-bit weights, else NULL
+  NN_Layer *layers;    // dim, activation and kind of each layer
+  float *params;       // all weights and biases, see NN_DType
+  size_t data_size;    // bytes of params, including padding
+  size_t max_dim;      // widest hidden layer
+  size_t max_k;        // NN_I8: widest k_stride
+  int owns_params;     // params are freed with the model
+  void *map_base;      // file mapping holding params (nn_infer_mmap) or NULL
+  size_t map_size;
+} NN_Infer;
+
+typedef struct {
+  // Per-thread execution state of nn_predict: two ping-pong buffers for the
+  // hidden activations of up to max_batch samples, and the quantized inputs
+  // of the current layer for NN_I8 models.
+  float *buffers[2];
+  int8_t *qbuffer;
+  size_t max_dim;
+  size_t max_k;
+  size_t max_batch; // rows per pass; nn_predict splits larger inputs
+} NN_InferCtx;
+
 typedef enum {
   EGD = 1, // Epoch (Batch) Gradient Descent
   BGD = 2, // (Mini) Batch Gradient Descent
   SGD = 3, // Stochastic Gradient Descent
 } GD_Type;
 
+typedef enum {
+  OPT_SGD = 0,      // w -= lr * g
+  OPT_MOMENTUM = 1, // v = mu * v + g; w -= lr * v
+  OPT_NESTEROV = 2, // v = mu * v + g; w -= lr * (g + mu * v)
+  OPT_ADAM = 3,     // Adam, weight decay added to the gradient (L2)
+  OPT_ADAMW = 4,    // Adam with decoupled weight decay
+} Opt_Type;
+
+typedef struct {
+  // nn_opt_defaults(type) fills in the defaults noted next to the fields;
+  // every field is used as given, so momentum = 0 or beta1 = 0 are valid
+  Opt_Type type;
+  float momentum;     // OPT_MOMENTUM, OPT_NESTEROV; 0.9
+  float beta1;        // OPT_ADAM(W); 0.9
+  float beta2;        // OPT_ADAM(W); 0.999
+  float eps;          // OPT_ADAM(W); 1e-8
+  float weight_decay; // all optimizers; 0 = no weight decay
+} OptParams;
+
+typedef struct {
+  // The state buffers have the layout of NN.params, so every update is one
+  // flat pass over params, grads and state.
+  OptParams p;
+  size_t n_params;
+  size_t t;  // number of steps taken
+  float *m;  // velocity or first moment
+  float *v;  // second moment
+} Optimizer;
+
 typedef struct {
   float lr;
   size_t epochs;
   size_t batch_size;
   GD_Type gd_type;
+  size_t n_threads; // data-parallel workers for EGD/BGD; 0 or 1 = no threads
+  OptParams opt;    // optimizer, see nn_opt_defaults; zeroed = plain SGD
+  uint64_t seed;    // seed of the sample shuffling stream
+  const char *telemetry;    // shared memory name (e.g. "/nn"), NULL = off
+  float telemetry_interval; // least seconds between two snapshots
+  const char *checkpoint;   // checkpoint file, NULL = off
+  size_t checkpoint_every;  // epochs between checkpoints; 0 = at the end
+  int resume;               // continue from the checkpoint file, if any
+  Matrix val_x;             // validation inputs, no rows = no validation
+  Matrix val_y;             // validation targets
+  size_t val_every;         // epochs between evaluations; 0 = every epoch
+  size_t patience; // evaluations without improvement before stopping early;
+                   // 0 = never stop early
+  int keep_best;   // end with the params of the lowest validation loss
 } TrainParams;
 
+// File formats of streamed datasets
+typedef enum {
+  DS_BINARY = 0, // raw float32 records, no header
+  DS_CSV = 1,    // one comma separated record per line
+} DS_Format;
+
+typedef struct DataStream DataStream;
+
 #define NN_X_IN(nn) (nn).activations[0]
 #define NN_Y_OUT(nn) (nn).activations[(nn).n_layers - 1]
 
 NN nn_create(size_t *layer_dims, size_t n_layers, Sigma s_hidden,
              Sigma s_output);
+NN nn_create_layers(const NN_Layer *layers, size_t n_layers);
 void nn_print(NN nn, const char *name);
 #define NN_PRINT(nn) nn_print(nn, #nn)
 #define NN_PRINT_WEIGHTS(nn) nn_print_weights(nn, #nn)
@@ -118,16 +331,123 @@ void nn_print(NN nn, const char *name);
 #define NN_PRINT_GRADS(nn) nn_print_grads(nn, #nn)
 #define NN_PRINT_LOSS(nn, gd_type) nn_print_loss(nn, gd_type)
 
+void nn_free(NN nn);
+NN nn_clone_scratch(NN nn, size_t max_batch);
+void nn_free_scratch(NN nn);
 void nn_rand(NN m, const float min, const float max);
+void nn_reserve_batch(NN nn, size_t max_batch);
 void nn_set_input_layer_activations(NN nn, Matrix x, size_t s);
+void nn_set_input_layer_activations_batch(NN nn, Matrix x,
+                                          const size_t *samples, size_t n);
 void nn_forward(NN nn, const Matrix x, const Matrix y, const size_t s);
+void nn_forward_batch(NN nn, const Matrix x, const Matrix y,
+                      const size_t *samples, size_t n);
+float nn_evaluate(NN nn, const Matrix x, const Matrix y);
 void nn_update_losses(NN nn, const Matrix y, const size_t s);
+void nn_update_losses_batch(NN nn, const Matrix y, const size_t *samples,
+                            size_t n);
 void nn_clear_errors(NN nn);
 void nn_set_error_at_output_layer(NN nn, const Matrix y, const size_t s);
+void nn_set_error_at_output_layer_batch(NN nn, const Matrix y,
+                                        const size_t *samples, size_t n);
 void nn_backprop(NN nn, const Matrix y, const size_t s);
+void nn_backprop_batch(NN nn, const Matrix y, const size_t *samples,
+                       size_t n);
 void nn_update_weights(NN nn, const float lr, size_t n);
+void nn_train_loop(NN nn, Matrix x, Matrix y, TrainParams p);
+
+DataStream *ds_open(const char *file_path, DS_Format format, size_t x_cols,
+                    size_t y_cols, size_t chunk_rows);
+size_t ds_next_chunk(DataStream *ds, Matrix *x, Matrix *y);
+void ds_rewind(DataStream *ds);
+size_t ds_error(DataStream *ds);
+void ds_close(DataStream *ds);
+void nn_train_stream(NN nn, DataStream *ds, TrainParams p);
+OptParams nn_opt_defaults(Opt_Type type);
+Optimizer nn_opt_create(NN nn, OptParams p);
+void nn_opt_free(Optimizer opt);
+void nn_opt_step(NN nn, Optimizer *opt, float lr, size_t n);
+
+#define NN_MODEL_MAGIC "NNMODEL"
+#define NN_MODEL_VERSION 2
+
+typedef struct {
+  char magic[8];        // NN_MODEL_MAGIC
+  uint32_t version;     // NN_MODEL_VERSION
+  uint32_t dtype;       // NN_DType of the weights
+  uint64_t n_layers;    // including the input layer
+  uint64_t data_offset; // start of the weights, multiple of NN_ALIGNMENT
+  uint64_t data_size;   // bytes of weights including padding
+  uint64_t checksum;    // nn__checksum of the weight bytes
+} NN_ModelHeader;
+
 void nn_save(NN nn, const char *file_path);
 NN nn_load(const char *file_path);
+NN nn_mmap(const char *file_path);
+void nn_save_text(NN nn, const char *file_path);
+NN nn_load_text(const char *file_path);
+
+#define NN_CHECKPOINT_MAGIC "NNCHKPT"
+
+typedef struct {
+  // Training state besides the params that a resumed run needs to continue
+  // exactly where the checkpointed one stopped.
+  size_t epoch;       // epochs done
+  NN_Rng rng;         // sample shuffling stream
+  Optimizer opt;      // step count and state
+  size_t *sample_map; // shuffled sample order, NULL = none
+  size_t n_samples;
+  float best_loss;    // early stopping: lowest validation loss so far,
+  size_t best_epoch;  // the epochs done at best_loss,
+  size_t n_worse;     // evaluations since best_loss
+  float *best_params; // params at best_loss, NULL = none
+} NN_Checkpoint;
+
+// both return 0 on success and -1 if the checkpoint could not be written,
+// or there is no checkpoint file to load; a file that does not fit nn or
+// *c fails NN_ASSERT
+int nn_checkpoint_save(const char *file_path, NN nn, NN_Checkpoint c);
+int nn_checkpoint_load(const char *file_path, NN nn, NN_Checkpoint *c);
+
+NN_Infer nn_infer_create(NN nn);
+NN_Infer nn_infer_mmap(const char *file_path);
+void nn_infer_free(NN_Infer m);
+NN_InferCtx nn_infer_ctx_create(NN_Infer m, size_t max_batch);
+void nn_infer_ctx_free(NN_InferCtx ctx);
+void nn_predict(NN_Infer m, NN_InferCtx ctx, Matrix x, Matrix y_pred);
+void nn_calibrate(NN nn, Matrix x, float *a_max);
+NN_Infer nn_quantize(NN nn, const float *a_max);
+NN_Infer nn_infer_convert(NN nn, NN_DType dtype);
+void nn_infer_save(NN_Infer m, const char *file_path);
+
+#define NN_TELEMETRY_MAGIC "NNTELEM"
+
+typedef struct {
+  // A channel of training snapshots (params, epoch and loss) in POSIX
+  // shared memory. The trainer publishes without ever waiting for readers,
+  // readers copy the newest complete snapshot.
+  void *shm;        // mapped channel, NULL if not open
+  size_t shm_size;
+  size_t n_layers;  // including the input layer
+  NN_Layer *layers; // layers of the published network
+  int owner;        // created by nn_telemetry_create
+  uint64_t id;      // inode of the shared memory object
+  char name[64];
+} NN_Telemetry;
+
+NN_Telemetry nn_telemetry_create(const char *name, NN nn);
+void nn_telemetry_publish(NN_Telemetry t, NN nn, size_t epoch, float loss);
+NN_Telemetry nn_telemetry_open(const char *name);
+int nn_telemetry_read(NN_Telemetry t, NN nn, uint64_t *seq, size_t *epoch,
+                      float *loss);
+int nn_telemetry_closed(NN_Telemetry t);
+void nn_telemetry_close(NN_Telemetry t);
+
+#ifdef NN_PROFILE
+void nn_profile_reset(void);
+void nn_profile_print(NN nn);
+void nn_profile_trace(const char *file_path);
+#endif // NN_PROFILE
 
 #endif // NN_H
 
@@ -140,24 +460,125 @@ NN nn_load(const char *file_path);
 
 #ifdef NN_IMPLEMENTATION
 
-float rand_float(void) { return (float)rand() / (float)RAND_MAX; }
+/**************************************************************
+ * Random numbers: xoshiro256** (Blackman, Vigna), seeded by  *
+ * splitmix64. Each NN_Rng is an independent stream with its  *
+ * own state; nn_rng_jump advances a stream by 2^128 draws,   *
+ * so nn_rng_stream(seed, k) for k = 0, 1, ... never overlap. *
+ * rand_float, mat_rand, nn_rand and shuffle_array draw from  *
+ * a default stream, seeded with nn_seed (0 if never called). *
+ **************************************************************/
 
-void shuffle_array(size_t *array, size_t n) {
-  if (n > RAND_MAX / 10) {
-    NN_ASSERT(0 && "n must be much smaller than RAND_MAX!");
+static uint64_t nn__rotl(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t nn__splitmix64(uint64_t *x) {
+  uint64_t z = (*x += 0x9e3779b97f4a7c15u);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+  return z ^ (z >> 31);
+}
+
+NN_Rng nn_rng_seed(uint64_t seed) {
+  // splitmix64 never yields four zeros in a row, so the state is valid
+  NN_Rng rng;
+  for (size_t i = 0; i < 4; ++i) {
+    rng.s[i] = nn__splitmix64(&seed);
+  }
+  return rng;
+}
+
+uint64_t nn_rng_next(NN_Rng *rng) {
+  uint64_t *s = rng->s;
+  const uint64_t result = nn__rotl(s[1] * 5, 7) * 9;
+  const uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = nn__rotl(s[3], 45);
+  return result;
+}
+
+void nn_rng_jump(NN_Rng *rng) {
+  // equivalent to 2^128 calls of nn_rng_next
+  static const uint64_t jump[4] = {0x180ec6d33cfd0abau, 0xd5a61266f0c9392cu,
+                                   0xa9582618e03fc9aau, 0x39abdc4529b1661cu};
+  uint64_t s[4] = {0};
+  for (size_t i = 0; i < 4; ++i) {
+    for (int b = 0; b < 64; ++b) {
+      if (jump[i] & (uint64_t)1 << b) {
+        for (size_t k = 0; k < 4; ++k) {
+          s[k] ^= rng->s[k];
+        }
+      }
+      nn_rng_next(rng);
+    }
+  }
+  memcpy(rng->s, s, sizeof(s));
+}
+
+NN_Rng nn_rng_stream(uint64_t seed, size_t stream) {
+  // stream k of a seed, e.g. one per worker thread
+  NN_Rng rng = nn_rng_seed(seed);
+  for (size_t k = 0; k < stream; ++k) {
+    nn_rng_jump(&rng);
   }
+  return rng;
+}
+
+float nn_rng_float(NN_Rng *rng) {
+  // uniform in [0, 1): the top 24 bits fill the float mantissa exactly
+  return (nn_rng_next(rng) >> 40) * 0x1.0p-24f;
+}
 
-  if (n > 1) {
-    size_t i;
-    for (i = 0; i < n - 1; i++) {
-      size_t j = i + rand() / (RAND_MAX / (n - i) + 1);
-      size_t t = array[j];
-      array[j] = array[i];
-      array[i] = t;
+size_t nn_rng_below(NN_Rng *rng, size_t n) {
+  // uniform in [0, n) without modulo bias: reject the 2^64 mod n lowest
+  // values, which is rarely more than one draw
+  NN_ASSERT(n > 0);
+  const uint64_t threshold = -(uint64_t)n % n;
+  for (;;) {
+    const uint64_t r = nn_rng_next(rng);
+    if (r >= threshold) {
+      return r % n;
     }
   }
 }
 
+static NN_Rng nn__rng;
+static int nn__rng_seeded = 0;
+
+// the default stream, not safe to share between threads
+static NN_Rng *nn__default_rng(void) {
+  if (!nn__rng_seeded) {
+    nn_seed(0);
+  }
+  return &nn__rng;
+}
+
+void nn_seed(uint64_t seed) {
+  nn__rng = nn_rng_seed(seed);
+  nn__rng_seeded = 1;
+}
+
+float rand_float(void) { return nn_rng_float(nn__default_rng()); }
+
+void shuffle_array(size_t *array, size_t n) {
+  shuffle_array_rng(array, n, nn__default_rng());
+}
+
+void shuffle_array_rng(size_t *array, size_t n, NN_Rng *rng) {
+  // Fisher-Yates
+  for (size_t i = 0; i + 1 < n; ++i) {
+    size_t j = i + nn_rng_below(rng, n - i);
+    size_t t = array[j];
+    array[j] = array[i];
+    array[i] = t;
+  }
+}
+
 float squared_error(float y_pred, float y_true) {
   float d = y_pred - y_true;
   return 0.5 * d * d;
@@ -167,9 +588,16 @@ float squared_error_derivative(float y_pred, float y_true) {
   return y_pred - y_true;
 }
 
+float cross_entropy(float log_p_pred, float y_true) {
+  return -y_true * log_p_pred;
+}
+
 float sigmoid(float x) { return 1.f / (1.f + expf(-x)); }
 
-float sigmoid_derivative(float x) { return sigmoid(x) * (1 - sigmoid(x)); }
+float sigmoid_derivative(float x) {
+  float s = sigmoid(x);
+  return s * (1 - s);
+}
 
 float relu(float x) {
   if (x > 0) {
@@ -191,7 +619,7 @@ float leaky_relu(float x) {
   if (x > 0) {
     return x;
   } else {
-    return 0.001f * x;
+    return NN_LEAKY_SLOPE * x;
   }
 }
 
@@ -199,7 +627,7 @@ float leaky_relu_derivative(float x) {
   if (x > 0) {
     return 1.f;
   } else {
-    return 0.001f;
+    return NN_LEAKY_SLOPE;
   }
 }
 
@@ -213,6 +641,8 @@ float sigma(float x, Sigma f) {
     return relu(x);
   case LEAKY_RELU:
     return leaky_relu(x);
+  case SOFTMAX:
+    NN_ASSERT(0 && "ERROR: softmax needs the whole row, use sigma_array");
   default:
     NN_ASSERT(0 && "Unreachable");
   }
@@ -228,11 +658,523 @@ float sigma_derivative(float x, Sigma f) {
     return relu_derivative(x);
   case LEAKY_RELU:
     return leaky_relu_derivative(x);
+  case SOFTMAX:
+    NN_ASSERT(0 && "ERROR: softmax needs the whole row, use sigma_array");
+  default:
+    NN_ASSERT(0 && "Unreachable");
+  }
+}
+
+/**************************************************************
+ * Whole-array activation kernels                             *
+ * sigma_array:                a[i] = sigma(z[i])             *
+ * sigma_derivative_mul_array: e[i] *= sigma'(z[i])           *
+ * SOFTMAX normalizes over all n elements of a row and has no *
+ * elementwise derivative: its Jacobian is folded into the    *
+ * cross-entropy error p - y, so its derivative is a no-op.   *
+ * The best SSE2/AVX2/AVX-512 variant is picked once at       *
+ * runtime via CPUID; define NN_NO_SIMD to force scalar code. *
+ * Every variant is specialized for each activation, so a     *
+ * layer looks up its kernel once (nn__sigma_kernel) and the  *
+ * calls per row do not switch on the activation.             *
+ **************************************************************/
+
+// a specialized kernel: dst[i] = sigma(z[i]) or dst[i] *= sigma'(z[i])
+typedef void (*NN_ActKernel)(float *dst, const float *z, size_t n);
+
+#define NN__SIGMA_COUNT (SOFTMAX + 1)
+
+// Instantiates the kernels of one instruction set for every activation,
+// and a table of each indexed by Sigma. ATTR is the target attribute. The
+// generic kernels are always inlined, so the switch on f folds away.
+#define NN__ACT_KERNEL(NAME, ATTR, ACT, F)                                    \
+  ATTR static void nn__sigma_##ACT##_##NAME(float *a, const float *z,         \
+                                            size_t n) {                       \
+    nn__sigma_array_##NAME(a, z, n, F);                                       \
+  }                                                                           \
+  ATTR static void nn__sigma_derivative_##ACT##_##NAME(                       \
+      float *e, const float *z, size_t n) {                                   \
+    nn__sigma_derivative_mul_array_##NAME(e, z, n, F);                        \
+  }
+#define NN__ACT_KERNELS(NAME, ATTR)                                           \
+  NN__ACT_KERNEL(NAME, ATTR, identity, IDENTITY)                              \
+  NN__ACT_KERNEL(NAME, ATTR, sigmoid, SIGMOID)                                \
+  NN__ACT_KERNEL(NAME, ATTR, relu, RELU)                                      \
+  NN__ACT_KERNEL(NAME, ATTR, leaky_relu, LEAKY_RELU)                          \
+  NN__ACT_KERNEL(NAME, ATTR, softmax, SOFTMAX)                                \
+  static const NN_ActKernel nn__sigma_kernels_##NAME[NN__SIGMA_COUNT] = {     \
+      nn__sigma_identity_##NAME, nn__sigma_sigmoid_##NAME,                    \
+      nn__sigma_relu_##NAME, nn__sigma_leaky_relu_##NAME,                     \
+      nn__sigma_softmax_##NAME};                                              \
+  static const NN_ActKernel                                                   \
+      nn__sigma_derivative_kernels_##NAME[NN__SIGMA_COUNT] = {                \
+          nn__sigma_derivative_identity_##NAME,                               \
+          nn__sigma_derivative_sigmoid_##NAME,                                \
+          nn__sigma_derivative_relu_##NAME,                                   \
+          nn__sigma_derivative_leaky_relu_##NAME,                             \
+          nn__sigma_derivative_softmax_##NAME};
+
+// largest of z[0..n)
+static inline float nn__max_array(const float *z, size_t n) {
+  float m = -INFINITY;
+  for (size_t i = 0; i < n; ++i) {
+    m = z[i] > m ? z[i] : m;
+  }
+  return m;
+}
+
+// Finishes a softmax whose a[0..i0) already hold exp(z - m), m = max z:
+// exponentiates the rest and divides the row by the sum. Subtracting m
+// keeps every exp in (0, 1], so large z cannot overflow. a may alias z.
+static inline void nn__softmax_finish(float *a, const float *z, size_t i0,
+                                      size_t n, float m) {
+  for (size_t i = i0; i < n; ++i) {
+    a[i] = expf(z[i] - m);
+  }
+  float sum = 0.f;
+  for (size_t i = 0; i < n; ++i) {
+    sum += a[i];
+  }
+  const float inv = 1.f / sum;
+  for (size_t i = 0; i < n; ++i) {
+    a[i] *= inv;
+  }
+}
+
+__attribute__((always_inline)) static inline void
+nn__sigma_array_scalar(float *a, const float *z, size_t n, Sigma f) {
+  switch (f) {
+  case IDENTITY:
+    memmove(a, z, n * sizeof(*a));
+    break;
+  case SIGMOID:
+    for (size_t i = 0; i < n; ++i) {
+      a[i] = sigmoid(z[i]);
+    }
+    break;
+  case RELU:
+    for (size_t i = 0; i < n; ++i) {
+      a[i] = relu(z[i]);
+    }
+    break;
+  case LEAKY_RELU:
+    for (size_t i = 0; i < n; ++i) {
+      a[i] = leaky_relu(z[i]);
+    }
+    break;
+  case SOFTMAX:
+    nn__softmax_finish(a, z, 0, n, nn__max_array(z, n));
+    break;
+  default:
+    NN_ASSERT(0 && "Unreachable");
+  }
+}
+
+__attribute__((always_inline)) static inline void
+nn__sigma_derivative_mul_array_scalar(float *e, const float *z, size_t n,
+                                      Sigma f) {
+  switch (f) {
+  case IDENTITY:
+  case SOFTMAX:
+    break;
+  case SIGMOID:
+    for (size_t i = 0; i < n; ++i) {
+      e[i] *= sigmoid_derivative(z[i]);
+    }
+    break;
+  case RELU:
+    for (size_t i = 0; i < n; ++i) {
+      e[i] *= relu_derivative(z[i]);
+    }
+    break;
+  case LEAKY_RELU:
+    for (size_t i = 0; i < n; ++i) {
+      e[i] *= leaky_relu_derivative(z[i]);
+    }
+    break;
   default:
     NN_ASSERT(0 && "Unreachable");
   }
 }
 
+NN__ACT_KERNELS(scalar, )
+
+/**************************************************************
+ * Int8 dot products of four input rows with one weight row   *
+ * dots[r] = sum_i a[r][i] * w[i],  k a multiple of 64        *
+ * w_sum = sum_i w[i] lets the VNNI kernel (u8 x s8) shift    *
+ * the inputs to unsigned and subtract 128 * w_sum again.     *
+ **************************************************************/
+
+static void nn__dot4_i8_scalar(int32_t *dots, const int8_t *const *a,
+                               const int8_t *w, size_t k, int32_t w_sum) {
+  (void)w_sum;
+  for (size_t r = 0; r < 4; ++r) {
+    int32_t dot = 0;
+    for (size_t i = 0; i < k; ++i) {
+      dot += (int32_t)a[r][i] * (int32_t)w[i];
+    }
+    dots[r] = dot;
+  }
+}
+
+/**************************************************************
+ * Half precision conversions, round to nearest even          *
+ * f16:  1 sign, 5 exponent (bias 15), 10 mantissa bits       *
+ * bf16: the upper 16 bits of a float                         *
+ **************************************************************/
+
+static float nn__f16_to_f32(uint16_t h) {
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t man = h & 0x3ff;
+  uint32_t u;
+  if (exp == 0x1f) { // inf, quiet nan (as F16C does)
+    u = sign | 0x7f800000 | (man << 13) | (man ? 0x400000 : 0);
+  } else if (exp != 0) {
+    u = sign | ((exp + 112) << 23) | (man << 13);
+  } else if (man == 0) {
+    u = sign;
+  } else { // subnormal, normalize the mantissa
+    exp = 113;
+    while (!(man & 0x400)) {
+      man <<= 1;
+      exp--;
+    }
+    u = sign | (exp << 23) | ((man & 0x3ff) << 13);
+  }
+  float f;
+  memcpy(&f, &u, sizeof(f));
+  return f;
+}
+
+static uint16_t nn__f32_to_f16(float f) {
+  uint32_t u;
+  memcpy(&u, &f, sizeof(u));
+  const uint16_t sign = (u >> 16) & 0x8000;
+  const uint32_t abs = u & 0x7fffffff;
+  if (abs >= 0x7f800000) { // inf, quiet nan keeping the top payload bits
+    return sign | 0x7c00 |
+           (abs > 0x7f800000 ? 0x200 | ((abs >> 13) & 0x3ff) : 0);
+  }
+  if (abs >= 0x477ff000) { // rounds to 65520 or more
+    return sign | 0x7c00;
+  }
+  if (abs < 0x38800000) { // below 2^-14: subnormal in units of 2^-24
+    return sign | (uint16_t)lrintf(fabsf(f) * 16777216.f);
+  }
+  const uint32_t r = abs + 0xfff + ((abs >> 13) & 1);
+  return sign | (uint16_t)((r >> 13) - (112 << 10));
+}
+
+static float nn__bf16_to_f32(uint16_t h) {
+  uint32_t u = (uint32_t)h << 16;
+  float f;
+  memcpy(&f, &u, sizeof(f));
+  return f;
+}
+
+static uint16_t nn__f32_to_bf16(float f) {
+  uint32_t u;
+  memcpy(&u, &f, sizeof(u));
+  if ((u & 0x7fffffff) > 0x7f800000) { // keep nan a (quiet) nan
+    return (u >> 16) | 0x40;
+  }
+  return (u + 0x7fff + ((u >> 16) & 1)) >> 16;
+}
+
+static void nn__f16_to_f32_array_scalar(float *dst, const uint16_t *src,
+                                        size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    dst[i] = nn__f16_to_f32(src[i]);
+  }
+}
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NN_NO_SIMD)
+#define NN_X86_SIMD
+#include <immintrin.h>
+
+// exp(x) for |x| < 88: 2^n * p(r) with x = n*ln2 + r (Cephes polynomial),
+// MADD(a, b, c) = a * b + c evaluates p in Horner form. Like expf, NaN stays
+// NaN (min/max return their second operand for NaN), and x beyond the
+// clamp range overflows to inf or underflows to 0.
+#define NN__EXP_PS(V, PS, EPI, CAST, MADD, GT, SEL, x)                        \
+  do {                                                                        \
+    const __typeof__(x) hi_ = V##_set1_##PS(88.3762626647949f);               \
+    const __typeof__(x) lo_ = V##_set1_##PS(-87.3365478515625f);              \
+    const __typeof__(x) x0_ = x;                                              \
+    x = V##_max_##PS(lo_, V##_min_##PS(hi_, x));                              \
+    EPI n_ = V##_cvtps_epi32(V##_mul_##PS(x, V##_set1_##PS(1.44269504f)));    \
+    __typeof__(x) fn_ = V##_cvtepi32_##PS(n_);                                \
+    x = V##_sub_##PS(x, V##_mul_##PS(fn_, V##_set1_##PS(0.693359375f)));      \
+    x = V##_sub_##PS(x, V##_mul_##PS(fn_, V##_set1_##PS(-2.12194440e-4f)));   \
+    __typeof__(x) p_ = V##_set1_##PS(1.9875691500e-4f);                       \
+    p_ = MADD(p_, x, V##_set1_##PS(1.3981999507e-3f));                        \
+    p_ = MADD(p_, x, V##_set1_##PS(8.3334519073e-3f));                        \
+    p_ = MADD(p_, x, V##_set1_##PS(4.1665795894e-2f));                        \
+    p_ = MADD(p_, x, V##_set1_##PS(1.6666665459e-1f));                        \
+    p_ = MADD(p_, x, V##_set1_##PS(5.0000001201e-1f));                        \
+    p_ = MADD(V##_mul_##PS(p_, x), x, x);                                     \
+    p_ = V##_add_##PS(p_, V##_set1_##PS(1.f));                                \
+    n_ = V##_slli_epi32(V##_add_epi32(n_, V##_set1_epi32(127)), 23);          \
+    x = V##_mul_##PS(p_, CAST(n_));                                           \
+    x = SEL(GT(x0_, hi_), V##_set1_##PS(INFINITY), x);                        \
+    x = SEL(GT(lo_, x0_), V##_setzero_##PS(), x);                             \
+  } while (0)
+
+// One kernel pair per instruction set. W is the vector width in floats,
+// V the intrinsic prefix, CAST reinterprets integer lanes as floats.
+#define NN__SIGMA_KERNELS(NAME, TARGET, W, V, PS, VEC, EPI, CAST, GT, SEL,    \
+                          MADD)                                               \
+  __attribute__((target(TARGET), always_inline)) static inline void          \
+      nn__sigma_array_##NAME(float *a, const float *z, size_t n, Sigma f) {   \
+    const VEC zero = V##_setzero_##PS();                                      \
+    const VEC one = V##_set1_##PS(1.f);                                       \
+    const VEC slope = V##_set1_##PS(NN_LEAKY_SLOPE);                          \
+    size_t i = 0;                                                             \
+    switch (f) {                                                              \
+    case IDENTITY:                                                            \
+      memmove(a, z, n * sizeof(*a));                                          \
+      return;                                                                 \
+    case SIGMOID:                                                             \
+      for (; i + W <= n; i += W) {                                            \
+        VEC x = V##_sub_##PS(zero, V##_loadu_##PS(z + i));                    \
+        NN__EXP_PS(V, PS, EPI, CAST, MADD, GT, SEL, x);                       \
+        V##_storeu_##PS(a + i, V##_div_##PS(one, V##_add_##PS(one, x)));      \
+      }                                                                       \
+      break;                                                                  \
+    case RELU:                                                                \
+      for (; i + W <= n; i += W) {                                            \
+        V##_storeu_##PS(a + i, V##_max_##PS(V##_loadu_##PS(z + i), zero));   \
+      }                                                                       \
+      break;                                                                  \
+    case LEAKY_RELU:                                                          \
+      for (; i + W <= n; i += W) {                                            \
+        VEC x = V##_loadu_##PS(z + i);                                        \
+        VEC neg = V##_mul_##PS(x, slope);                                     \
+        V##_storeu_##PS(a + i, SEL(GT(x, zero), x, neg));                     \
+      }                                                                       \
+      break;                                                                  \
+    case SOFTMAX: {                                                           \
+      const float m = nn__max_array(z, n);                                    \
+      const VEC vm = V##_set1_##PS(m);                                        \
+      for (; i + W <= n; i += W) {                                            \
+        VEC x = V##_sub_##PS(V##_loadu_##PS(z + i), vm);                      \
+        NN__EXP_PS(V, PS, EPI, CAST, MADD, GT, SEL, x);                       \
+        V##_storeu_##PS(a + i, x);                                            \
+      }                                                                       \
+      nn__softmax_finish(a, z, i, n, m);                                      \
+      return;                                                                 \
+    }                                                                         \
+    default:                                                                  \
+      NN_ASSERT(0 && "Unreachable");                                          \
+    }                                                                         \
+    nn__sigma_array_scalar(a + i, z + i, n - i, f);                           \
+  }                                                                           \
+                                                                              \
+  __attribute__((target(TARGET), always_inline)) static inline void          \
+      nn__sigma_derivative_mul_array_##NAME(float *e, const float *z,         \
+                                            size_t n, Sigma f) {              \
+    const VEC zero = V##_setzero_##PS();                                      \
+    const VEC one = V##_set1_##PS(1.f);                                       \
+    const VEC slope = V##_set1_##PS(NN_LEAKY_SLOPE);                          \
+    size_t i = 0;                                                             \
+    switch (f) {                                                              \
+    case IDENTITY:                                                            \
+    case SOFTMAX:                                                             \
+      return;                                                                 \
+    case SIGMOID:                                                             \
+      for (; i + W <= n; i += W) {                                            \
+        VEC x = V##_sub_##PS(zero, V##_loadu_##PS(z + i));                    \
+        NN__EXP_PS(V, PS, EPI, CAST, MADD, GT, SEL, x);                       \
+        VEC s = V##_div_##PS(one, V##_add_##PS(one, x));                      \
+        VEC d = V##_mul_##PS(s, V##_sub_##PS(one, s));                        \
+        V##_storeu_##PS(e + i, V##_mul_##PS(V##_loadu_##PS(e + i), d));       \
+      }                                                                       \
+      break;                                                                  \
+    case RELU:                                                                \
+      for (; i + W <= n; i += W) {                                            \
+        VEC d = SEL(GT(V##_loadu_##PS(z + i), zero), one, zero);              \
+        V##_storeu_##PS(e + i, V##_mul_##PS(V##_loadu_##PS(e + i), d));       \
+      }                                                                       \
+      break;                                                                  \
+    case LEAKY_RELU:                                                          \
+      for (; i + W <= n; i += W) {                                            \
+        VEC d = SEL(GT(V##_loadu_##PS(z + i), zero), one, slope);             \
+        V##_storeu_##PS(e + i, V##_mul_##PS(V##_loadu_##PS(e + i), d));       \
+      }                                                                       \
+      break;                                                                  \
+    default:                                                                  \
+      NN_ASSERT(0 && "Unreachable");                                          \
+    }                                                                         \
+    nn__sigma_derivative_mul_array_scalar(e + i, z + i, n - i, f);            \
+  }                                                                           \
+                                                                              \
+  NN__ACT_KERNELS(NAME, __attribute__((target(TARGET))))
+
+// mask compares and selects (mask ? x : y) for each instruction set
+#define NN__GT_SSE(x, y) _mm_cmpgt_ps(x, y)
+#define NN__SEL_SSE(m, x, y) _mm_or_ps(_mm_and_ps(m, x), _mm_andnot_ps(m, y))
+#define NN__GT_AVX2(x, y) _mm256_cmp_ps(x, y, _CMP_GT_OQ)
+#define NN__SEL_AVX2(m, x, y) _mm256_blendv_ps(y, x, m)
+#define NN__GT_AVX512(x, y) _mm512_cmp_ps_mask(x, y, _CMP_GT_OQ)
+#define NN__SEL_AVX512(m, x, y) _mm512_mask_blend_ps(m, y, x)
+#define NN__MADD_SSE(a, b, c) _mm_add_ps(_mm_mul_ps(a, b), c)
+#define NN__MADD_AVX2(a, b, c) _mm256_fmadd_ps(a, b, c)
+#define NN__MADD_AVX512(a, b, c) _mm512_fmadd_ps(a, b, c)
+
+NN__SIGMA_KERNELS(sse2, "sse2", 4, _mm, ps, __m128, __m128i, _mm_castsi128_ps,
+                  NN__GT_SSE, NN__SEL_SSE, NN__MADD_SSE)
+NN__SIGMA_KERNELS(avx2, "avx2,fma", 8, _mm256, ps, __m256, __m256i,
+                  _mm256_castsi256_ps, NN__GT_AVX2, NN__SEL_AVX2,
+                  NN__MADD_AVX2)
+NN__SIGMA_KERNELS(avx512, "avx512f", 16, _mm512, ps, __m512, __m512i,
+                  _mm512_castsi512_ps, NN__GT_AVX512, NN__SEL_AVX512,
+                  NN__MADD_AVX512)
+
+__attribute__((target("avx2"))) static int32_t
+nn__hsum_epi32_avx2(__m256i v) {
+  __m128i x = _mm_add_epi32(_mm256_castsi256_si128(v),
+                            _mm256_extracti128_si256(v, 1));
+  x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+  x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(x);
+}
+
+// sign-extend 16 int8 to int16, pairwise multiply-add into int32 lanes
+__attribute__((target("avx2"))) static void
+nn__dot4_i8_avx2(int32_t *dots, const int8_t *const *a, const int8_t *w,
+                 size_t k, int32_t w_sum) {
+  (void)w_sum;
+  __m256i acc[4] = {_mm256_setzero_si256(), _mm256_setzero_si256(),
+                    _mm256_setzero_si256(), _mm256_setzero_si256()};
+  for (size_t i = 0; i < k; i += 16) {
+    __m256i wv =
+        _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(w + i)));
+    for (size_t r = 0; r < 4; ++r) {
+      __m256i av =
+          _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(a[r] + i)));
+      acc[r] = _mm256_add_epi32(acc[r], _mm256_madd_epi16(av, wv));
+    }
+  }
+  for (size_t r = 0; r < 4; ++r) {
+    dots[r] = nn__hsum_epi32_avx2(acc[r]);
+  }
+}
+
+// vpdpbusd multiplies u8 by s8: (a + 128) . w = a . w + 128 * w_sum
+__attribute__((target("avx512f,avx512bw,avx512vnni"))) static void
+nn__dot4_i8_avx512vnni(int32_t *dots, const int8_t *const *a,
+                       const int8_t *w, size_t k, int32_t w_sum) {
+  const __m512i flip = _mm512_set1_epi8((char)0x80);
+  __m512i acc[4] = {_mm512_setzero_si512(), _mm512_setzero_si512(),
+                    _mm512_setzero_si512(), _mm512_setzero_si512()};
+  for (size_t i = 0; i < k; i += 64) {
+    __m512i wv = _mm512_loadu_si512(w + i);
+    for (size_t r = 0; r < 4; ++r) {
+      __m512i av = _mm512_xor_si512(_mm512_loadu_si512(a[r] + i), flip);
+      acc[r] = _mm512_dpbusd_epi32(acc[r], av, wv);
+    }
+  }
+  for (size_t r = 0; r < 4; ++r) {
+    dots[r] = _mm512_reduce_add_epi32(acc[r]) - 128 * w_sum;
+  }
+}
+
+__attribute__((target("avx,f16c"))) static void
+nn__f16_to_f32_array_f16c(float *dst, const uint16_t *src, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i h = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+  }
+  nn__f16_to_f32_array_scalar(dst + i, src + i, n - i);
+}
+
+#endif // x86 SIMD
+
+static const NN_ActKernel *nn__sigma_kernels;
+static const NN_ActKernel *nn__sigma_derivative_kernels;
+typedef void (*NN_Dot4I8Kernel)(int32_t *dots, const int8_t *const *a,
+                                const int8_t *w, size_t k, int32_t w_sum);
+static NN_Dot4I8Kernel nn__dot4_i8_kernel;
+typedef void (*NN_F16Kernel)(float *dst, const uint16_t *src, size_t n);
+static NN_F16Kernel nn__f16_to_f32_array_kernel;
+static const char *nn__simd_name;
+static pthread_once_t nn__simd_once = PTHREAD_ONCE_INIT;
+
+static void nn__simd_init(void) {
+  nn__sigma_kernels = nn__sigma_kernels_scalar;
+  nn__sigma_derivative_kernels = nn__sigma_derivative_kernels_scalar;
+  nn__simd_name = "scalar";
+  nn__dot4_i8_kernel = nn__dot4_i8_scalar;
+  nn__f16_to_f32_array_kernel = nn__f16_to_f32_array_scalar;
+#ifdef NN_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("f16c") && __builtin_cpu_supports("avx")) {
+    nn__f16_to_f32_array_kernel = nn__f16_to_f32_array_f16c;
+  }
+  if (__builtin_cpu_supports("avx512vnni") &&
+      __builtin_cpu_supports("avx512bw")) {
+    nn__dot4_i8_kernel = nn__dot4_i8_avx512vnni;
+  } else if (__builtin_cpu_supports("avx2")) {
+    nn__dot4_i8_kernel = nn__dot4_i8_avx2;
+  }
+  if (__builtin_cpu_supports("avx512f")) {
+    nn__sigma_kernels = nn__sigma_kernels_avx512;
+    nn__sigma_derivative_kernels = nn__sigma_derivative_kernels_avx512;
+    nn__simd_name = "avx512";
+  } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    nn__sigma_kernels = nn__sigma_kernels_avx2;
+    nn__sigma_derivative_kernels = nn__sigma_derivative_kernels_avx2;
+    nn__simd_name = "avx2";
+  } else {
+    nn__sigma_kernels = nn__sigma_kernels_sse2;
+    nn__sigma_derivative_kernels = nn__sigma_derivative_kernels_sse2;
+    nn__simd_name = "sse2";
+  }
+#endif // NN_X86_SIMD
+}
+
+const char *nn_simd_name(void) {
+  pthread_once(&nn__simd_once, nn__simd_init);
+  return nn__simd_name;
+}
+
+// the kernels of activation f, looked up once per layer
+static NN_ActKernel nn__sigma_kernel(Sigma f) {
+  pthread_once(&nn__simd_once, nn__simd_init);
+  NN_ASSERT(f < NN__SIGMA_COUNT && "Unreachable");
+  return nn__sigma_kernels[f];
+}
+
+static NN_ActKernel nn__sigma_derivative_kernel(Sigma f) {
+  pthread_once(&nn__simd_once, nn__simd_init);
+  NN_ASSERT(f < NN__SIGMA_COUNT && "Unreachable");
+  return nn__sigma_derivative_kernels[f];
+}
+
+void sigma_array(float *a, const float *z, size_t n, Sigma f) {
+  nn__sigma_kernel(f)(a, z, n);
+}
+
+void sigma_derivative_mul_array(float *e, const float *z, size_t n, Sigma f) {
+  nn__sigma_derivative_kernel(f)(e, z, n);
+}
+
+// dst[i] = float(src[i]) for NN_F16 or NN_BF16 elements
+static void nn__half_to_f32_array(float *dst, const uint16_t *src, size_t n,
+                                  NN_DType type) {
+  if (type == NN_F16) {
+    pthread_once(&nn__simd_once, nn__simd_init);
+    nn__f16_to_f32_array_kernel(dst, src, n);
+  } else {
+    for (size_t i = 0; i < n; ++i) {
+      dst[i] = nn__bf16_to_f32(src[i]);
+    }
+  }
+}
+
 // --------------------------------------------------------------
 
 Matrix mat_alloc(size_t num_rows, size_t num_cols) {
@@ -245,6 +1187,8 @@ Matrix mat_alloc(size_t num_rows, size_t num_cols) {
   return m;
 }
 
+void mat_free(Matrix m) { NN_FREE(m.p_data); }
+
 void mat_print(Matrix m, const char *name, size_t offset_left) {
   printf("%*s%s=[", (int)offset_left, "", name);
   for (size_t row = 0; row < m.num_rows; ++row) {
@@ -270,9 +1214,13 @@ void mat_fill(Matrix m, float x) {
 }
 
 void mat_rand(Matrix m, float min, float max) {
+  mat_rand_rng(m, min, max, nn__default_rng());
+}
+
+void mat_rand_rng(Matrix m, float min, float max, NN_Rng *rng) {
   for (size_t row = 0; row < m.num_rows; ++row) {
     for (size_t col = 0; col < m.num_cols; ++col) {
-      MAT_AT(m, row, col) = rand_float() * (max - min) + min;
+      MAT_AT(m, row, col) = nn_rng_float(rng) * (max - min) + min;
     }
   }
 }
@@ -286,6 +1234,16 @@ Matrix mat_row(Matrix m, size_t row) {
   };
 }
 
+Matrix mat_rows(Matrix m, size_t row, size_t n) {
+  NN_ASSERT(row + n <= m.num_rows);
+  return (Matrix){
+      .num_rows = n,
+      .num_cols = m.num_cols,
+      .stride = m.stride,
+      .p_data = &MAT_AT(m, row, 0),
+  };
+}
+
 void mat_copy(Matrix dst, Matrix m) {
   NN_ASSERT(dst.num_rows == m.num_rows);
   NN_ASSERT(dst.num_cols == m.num_cols);
@@ -322,95 +1280,539 @@ void mat_mul_num(Matrix m, float x) {
   }
 }
 
-void mat_mul_mat(Matrix dst, Matrix a, Matrix b) {
-  NN_ASSERT(a.num_cols == b.num_rows);
-  size_t inner_dim = a.num_cols;
+/**************************************************************
+ * GEMM: C = A * B (+ C)                                      *
+ * Every operand is addressed through a row and a column      *
+ * stride, so strided views and transposes need no copies.    *
+ * A and B are packed into contiguous MR/NR panels, then a    *
+ * register-blocked MR x NR micro-kernel runs over them.      *
+ * B may hold NN_F16/NN_BF16 elements, which are converted to *
+ * float while packing; all arithmetic is float.              *
+ * An optional epilogue turns C into a dense layer:           *
+ *   C = A * B + bias,  act = sigma(C)                        *
+ * The bias is added when the last k-block is stored, i.e. to *
+ * the complete sum, and sigma runs on each mc x nc block of  *
+ * C right after it, while the block is still in cache.       *
+ **************************************************************/
 
-  NN_ASSERT(dst.num_rows == a.num_rows);
-  NN_ASSERT(dst.num_cols == b.num_cols);
-  for (size_t row = 0; row < dst.num_rows; ++row) {
-    for (size_t col = 0; col < dst.num_cols; ++col) {
-      MAT_AT(dst, row, col) = 0;
-      for (size_t i = 0; i < inner_dim; ++i) {
-        MAT_AT(dst, row, col) += (MAT_AT(a, row, i) * MAT_AT(b, i, col));
+typedef struct {
+  const float *bias;  // N floats added to every row of C, or NULL
+  NN_ActKernel sigma; // activation applied after the bias
+  float *act;         // act = f(C) and C keeps z, or NULL for C = f(C)
+  size_t rs_act;      // row stride of act
+  int whole_rows;     // sigma needs all N columns of a row (SOFTMAX)
+} NN_GemmEpilogue;
+
+// pack a mc x kc block of A into panels of NN_GEMM_MR rows, k-major
+static void nn__gemm_pack_a(float *dst, const float *a, size_t rsa, size_t csa,
+                            size_t mc, size_t kc) {
+  for (size_t i = 0; i < mc; i += NN_GEMM_MR) {
+    size_t mr = mc - i < NN_GEMM_MR ? mc - i : NN_GEMM_MR;
+    for (size_t k = 0; k < kc; ++k) {
+      for (size_t ii = 0; ii < NN_GEMM_MR; ++ii) {
+        *dst++ = ii < mr ? a[(i + ii) * rsa + k * csa] : 0.f;
       }
     }
   }
 }
 
-void mat_sigmoid(Matrix m) {
-  for (size_t row = 0; row < m.num_rows; ++row) {
-    for (size_t col = 0; col < m.num_cols; ++col) {
-      MAT_AT(m, row, col) = sigmoid(MAT_AT(m, row, col));
+// pack a kc x nc block of B into panels of NN_GEMM_NR columns, k-major
+static void nn__gemm_pack_b(float *dst, const float *b, size_t rsb, size_t csb,
+                            size_t kc, size_t nc) {
+  for (size_t j = 0; j < nc; j += NN_GEMM_NR) {
+    size_t nr = nc - j < NN_GEMM_NR ? nc - j : NN_GEMM_NR;
+    for (size_t k = 0; k < kc; ++k) {
+      const float *b_k = b + k * rsb + j * csb;
+      if (nr == NN_GEMM_NR && csb == 1) {
+        for (size_t jj = 0; jj < NN_GEMM_NR; ++jj) {
+          *dst++ = b_k[jj];
+        }
+      } else {
+        for (size_t jj = 0; jj < NN_GEMM_NR; ++jj) {
+          *dst++ = jj < nr ? b_k[jj * csb] : 0.f;
+        }
+      }
     }
   }
 }
 
-// --------------------------------------------------------------
-
-// TODO: nn_ functions don't use mat_ functions. change nn_ ? remove mat_ ?
-
-NN nn_create(size_t *layer_dims, size_t n_layers, Sigma s_hidden,
-             Sigma s_output) {
-  NN_ASSERT(n_layers > 0);
+// pack a kc x nc block of row-contiguous 16-bit B like nn__gemm_pack_b,
+// converting one row of B at a time into row (nc rounded up to NR floats)
+static void nn__gemm_pack_b16(float *dst, const uint16_t *b, NN_DType b_type,
+                              size_t rsb, size_t kc, size_t nc, float *row) {
+  const size_t nc_pad = (nc + NN_GEMM_NR - 1) / NN_GEMM_NR * NN_GEMM_NR;
+  memset(row + nc, 0, (nc_pad - nc) * sizeof(*row));
+  for (size_t k = 0; k < kc; ++k) {
+    nn__half_to_f32_array(row, b + k * rsb, nc, b_type);
+    for (size_t j = 0; j < nc; j += NN_GEMM_NR) {
+      memcpy(dst + j * kc + k * NN_GEMM_NR, row + j,
+             NN_GEMM_NR * sizeof(*row));
+    }
+  }
+}
 
-  // init NN struct
-  NN nn;
-  nn.n_layers = n_layers;
-  nn.s_hidden = s_hidden;
-  nn.s_output = s_output;
-
-  // malloc arrays to hold matrices
-  nn.weighted_sums = NN_MALLOC(n_layers * sizeof(*nn.weighted_sums));
-  NN_ASSERT(nn.weighted_sums != NULL);
-  nn.activations = NN_MALLOC(n_layers * sizeof(*nn.activations));
-  NN_ASSERT(nn.activations != NULL);
-  nn.weights = NN_MALLOC(n_layers * sizeof(*nn.weights));
-  NN_ASSERT(nn.weights != NULL);
-  nn.weight_grads = NN_MALLOC(n_layers * sizeof(*nn.weight_grads));
-  NN_ASSERT(nn.weight_grads != NULL);
-  nn.biases = NN_MALLOC(n_layers * sizeof(*nn.biases));
-  NN_ASSERT(nn.biases != NULL);
-  nn.bias_grads = NN_MALLOC(n_layers * sizeof(*nn.bias_grads));
-  NN_ASSERT(nn.bias_grads != NULL);
-  nn.errors = NN_MALLOC(n_layers * sizeof(*nn.errors));
-  NN_ASSERT(nn.errors != NULL);
-
-  // malloc matrices in the arrays
-  for (size_t i = 0; i < n_layers; ++i) {
-    // Vectors
-    nn.activations[i] = mat_alloc(1, layer_dims[i]);
-    if (i == 0) {
-      // input layer does not need any of these matrices/vectors, but same
-      // length arrays make indexing by layer much simpler and coherent.
-      Matrix dummy = mat_alloc(0, 0);
-      nn.weighted_sums[i] = dummy;
-      nn.weights[i] = dummy;
-      nn.weight_grads[i] = dummy;
-      nn.biases[i] = dummy;
-      nn.bias_grads[i] = dummy;
-      nn.errors[i] = dummy;
+// c[mr x nr] (+)= a_panel * b_panel, then + bias[j] if given
+static void nn__gemm_micro_kernel(size_t kc, const float *a, const float *b,
+                                  float *c, size_t rsc, size_t mr, size_t nr,
+                                  int accumulate, const float *bias) {
+  float acc[NN_GEMM_MR][NN_GEMM_NR] = {0};
+  for (size_t k = 0; k < kc; ++k) {
+    for (size_t i = 0; i < NN_GEMM_MR; ++i) {
+      const float a_ik = a[i];
+      for (size_t j = 0; j < NN_GEMM_NR; ++j) {
+        acc[i][j] += a_ik * b[j];
+      }
+    }
+    a += NN_GEMM_MR;
+    b += NN_GEMM_NR;
+  }
+  for (size_t i = 0; i < mr; ++i) {
+    float *c_i = c + i * rsc;
+    if (accumulate) {
+      for (size_t j = 0; j < nr; ++j) {
+        c_i[j] += acc[i][j];
+      }
     } else {
-      // Matrices
-      nn.weights[i] = mat_alloc(layer_dims[i - 1], layer_dims[i]);
-      nn.weight_grads[i] = mat_alloc(layer_dims[i - 1], layer_dims[i]);
-      // Vectors
-      nn.weighted_sums[i] = mat_alloc(1, layer_dims[i]);
-      nn.biases[i] = mat_alloc(1, layer_dims[i]);
-      nn.bias_grads[i] = mat_alloc(1, layer_dims[i]);
-      nn.errors[i] = mat_alloc(1, layer_dims[i]);
+      for (size_t j = 0; j < nr; ++j) {
+        c_i[j] = acc[i][j];
+      }
+    }
+    if (bias) {
+      for (size_t j = 0; j < nr; ++j) {
+        c_i[j] += bias[j];
+      }
     }
+  }
+}
+
+// Packing buffers of the calling thread, kept across calls; they only grow,
+// to at most the NN_GEMM_MC/KC/NC blocks, and are freed when it exits.
+typedef struct {
+  float *a_pack;
+  float *b_pack;
+  float *b_row;
+  size_t a_cap; // floats
+  size_t b_cap;
+  size_t row_cap;
+} NN__GemmBuffers;
+
+static pthread_key_t nn__gemm_key;
+static pthread_once_t nn__gemm_once = PTHREAD_ONCE_INIT;
 
-    // malloc a vector to store the loss
-    nn.loss_step = mat_alloc(1, layer_dims[n_layers - 1]);
-    nn.loss_batch = mat_alloc(1, layer_dims[n_layers - 1]);
-    nn.loss_epoch = mat_alloc(1, layer_dims[n_layers - 1]);
+static void nn__gemm_buffers_free(void *arg) {
+  NN__GemmBuffers *buf = arg;
+  NN_FREE(buf->a_pack);
+  NN_FREE(buf->b_pack);
+  NN_FREE(buf->b_row);
+  NN_FREE(buf);
+}
+
+static void nn__gemm_key_init(void) {
+  int err = pthread_key_create(&nn__gemm_key, nn__gemm_buffers_free);
+  NN_ASSERT(err == 0 && "ERROR: pthread_key_create");
+}
+
+// make *p hold at least n floats
+static float *nn__gemm_reserve(float **p, size_t *cap, size_t n) {
+  if (*cap < n) {
+    NN_FREE(*p);
+    *p = NN_MALLOC(n * sizeof(**p));
+    NN_ASSERT(*p != NULL);
+    *cap = n;
   }
+  return *p;
+}
 
-  return nn;
+static NN__GemmBuffers *nn__gemm_buffers(void) {
+  pthread_once(&nn__gemm_once, nn__gemm_key_init);
+  NN__GemmBuffers *buf = pthread_getspecific(nn__gemm_key);
+  if (buf == NULL) {
+    buf = NN_MALLOC(sizeof(*buf));
+    NN_ASSERT(buf != NULL);
+    *buf = (NN__GemmBuffers){0};
+    pthread_setspecific(nn__gemm_key, buf);
+  }
+  return buf;
 }
 
-void nn_print(NN nn, const char *name) {
+// apply the activation of an epilogue to rows [i0, i0 + m) and columns
+// [j0, j0 + n) of C
+static void nn__gemm_activate(const NN_GemmEpilogue *ep, float *c, size_t rsc,
+                              size_t i0, size_t m, size_t j0, size_t n) {
+  for (size_t i = i0; i < i0 + m; ++i) {
+    float *c_i = c + i * rsc + j0;
+    float *a_i = ep->act ? ep->act + i * ep->rs_act + j0 : c_i;
+    ep->sigma(a_i, c_i, n);
+  }
+}
+
+// C[M x N] = A[M x K] * B[K x N], or C += A * B if accumulate is set.
+// C must be row-contiguous (column stride 1) and must not alias A or B.
+// B holds b_type elements; 16-bit B must be row-contiguous (csb == 1).
+// ep (or NULL) adds a bias and an activation, see NN_GemmEpilogue.
+static void nn__gemm(size_t M, size_t N, size_t K, const float *a, size_t rsa,
+                     size_t csa, const void *b, NN_DType b_type, size_t rsb,
+                     size_t csb, float *c, size_t rsc, int accumulate,
+                     const NN_GemmEpilogue *ep) {
+  NN_ASSERT(b_type == NN_F32 || b_type == NN_F16 || b_type == NN_BF16);
+  NN_ASSERT(b_type == NN_F32 || csb == 1);
+  NN_ASSERT(!(ep && accumulate));
+  const float *bias = ep ? ep->bias : NULL;
+  if (M == 0 || N == 0) {
+    return;
+  }
+  // Few rows (e.g. a single sample times a weight matrix): packing B would
+  // touch it twice, so stream its rows straight into C instead.
+  if (K == 0 || (M < NN_GEMM_MR && b_type == NN_F32)) {
+    for (size_t i = 0; i < M; ++i) {
+      float *c_i = c + i * rsc;
+      if (!accumulate) {
+        memset(c_i, 0, N * sizeof(*c));
+      }
+      for (size_t k = 0; k < K; ++k) {
+        const float a_ik = a[i * rsa + k * csa];
+        const float *b_k = (const float *)b + k * rsb;
+        for (size_t j = 0; j < N; ++j) {
+          c_i[j] += a_ik * b_k[j * csb];
+        }
+      }
+      if (bias) {
+        for (size_t j = 0; j < N; ++j) {
+          c_i[j] += bias[j];
+        }
+      }
+      if (ep) {
+        nn__gemm_activate(ep, c, rsc, i, 1, 0, N);
+      }
+    }
+    return;
+  }
+
+  const size_t mc_max = M < NN_GEMM_MC ? M : NN_GEMM_MC;
+  const size_t kc_max = K < NN_GEMM_KC ? K : NN_GEMM_KC;
+  const size_t nc_max = N < NN_GEMM_NC ? N : NN_GEMM_NC;
+  const size_t mc_pad = (mc_max + NN_GEMM_MR - 1) / NN_GEMM_MR * NN_GEMM_MR;
+  const size_t nc_pad = (nc_max + NN_GEMM_NR - 1) / NN_GEMM_NR * NN_GEMM_NR;
+  NN__GemmBuffers *buf = nn__gemm_buffers();
+  float *a_pack = nn__gemm_reserve(&buf->a_pack, &buf->a_cap, mc_pad * kc_max);
+  float *b_pack = nn__gemm_reserve(&buf->b_pack, &buf->b_cap, kc_max * nc_pad);
+  float *b_row = NULL;
+  if (b_type != NN_F32) {
+    b_row = nn__gemm_reserve(&buf->b_row, &buf->row_cap, nc_pad);
+  }
+
+  for (size_t jc = 0; jc < N; jc += NN_GEMM_NC) {
+    const size_t nc = N - jc < NN_GEMM_NC ? N - jc : NN_GEMM_NC;
+
+    for (size_t pc = 0; pc < K; pc += NN_GEMM_KC) {
+      const size_t kc = K - pc < NN_GEMM_KC ? K - pc : NN_GEMM_KC;
+      // only the first k-block may overwrite C, the last adds the bias
+      const int acc = accumulate || pc > 0;
+      const float *bias_nc = bias && pc + kc == K ? bias + jc : NULL;
+      if (b_type == NN_F32) {
+        nn__gemm_pack_b(b_pack, (const float *)b + pc * rsb + jc * csb, rsb,
+                        csb, kc, nc);
+      } else {
+        nn__gemm_pack_b16(b_pack, (const uint16_t *)b + pc * rsb + jc,
+                          b_type, rsb, kc, nc, b_row);
+      }
+
+      for (size_t ic = 0; ic < M; ic += NN_GEMM_MC) {
+        const size_t mc = M - ic < NN_GEMM_MC ? M - ic : NN_GEMM_MC;
+        nn__gemm_pack_a(a_pack, a + ic * rsa + pc * csa, rsa, csa, mc, kc);
+
+        for (size_t jr = 0; jr < nc; jr += NN_GEMM_NR) {
+          const size_t nr = nc - jr < NN_GEMM_NR ? nc - jr : NN_GEMM_NR;
+          for (size_t ir = 0; ir < mc; ir += NN_GEMM_MR) {
+            const size_t mr = mc - ir < NN_GEMM_MR ? mc - ir : NN_GEMM_MR;
+            nn__gemm_micro_kernel(kc, a_pack + ir * kc, b_pack + jr * kc,
+                                  c + (ic + ir) * rsc + jc + jr, rsc, mr, nr,
+                                  acc, bias_nc ? bias_nc + jr : NULL);
+          }
+        }
+        if (ep && pc + kc == K && (nc == N || !ep->whole_rows)) {
+          nn__gemm_activate(ep, c, rsc, ic, mc, jc, nc);
+        }
+      }
+    }
+  }
+  if (ep && ep->whole_rows && N > NN_GEMM_NC) {
+    // the rows were split into several nc blocks
+    nn__gemm_activate(ep, c, rsc, 0, M, 0, N);
+  }
+}
+
+void mat_mul_mat(Matrix dst, Matrix a, Matrix b) {
+  mat_gemm(dst, a, 0, b, 0, 0);
+}
+
+void mat_gemm(Matrix dst, Matrix a, int trp_a, Matrix b, int trp_b,
+              int accumulate) {
+  // dst (+)= op(a) * op(b), where op transposes its operand if trp_ is set
+  const size_t a_rows = trp_a ? a.num_cols : a.num_rows;
+  const size_t a_cols = trp_a ? a.num_rows : a.num_cols;
+  const size_t b_rows = trp_b ? b.num_cols : b.num_rows;
+  const size_t b_cols = trp_b ? b.num_rows : b.num_cols;
+  NN_ASSERT(a_cols == b_rows);
+  NN_ASSERT(dst.num_rows == a_rows);
+  NN_ASSERT(dst.num_cols == b_cols);
+  nn__gemm(a_rows, b_cols, a_cols, a.p_data, trp_a ? 1 : a.stride,
+           trp_a ? a.stride : 1, b.p_data, NN_F32, trp_b ? 1 : b.stride,
+           trp_b ? b.stride : 1, dst.p_data, dst.stride, accumulate, NULL);
+}
+
+void mat_dense(Matrix act, Matrix z, Matrix x, Matrix w, Matrix b, Sigma f) {
+  // Fused dense layer: act = f(x * w + b) in one GEMM. z receives x * w + b
+  // if it has data (training needs it for backprop); otherwise act is
+  // computed in place and no pre-activations are stored.
+  NN_ASSERT(x.num_cols == w.num_rows);
+  NN_ASSERT(act.num_rows == x.num_rows && act.num_cols == w.num_cols);
+  NN_ASSERT(b.num_rows == 1 && b.num_cols == w.num_cols);
+  NN_GemmEpilogue ep = {.bias = b.p_data,
+                        .sigma = nn__sigma_kernel(f),
+                        .whole_rows = f == SOFTMAX};
+  Matrix c = act;
+  if (z.p_data) {
+    NN_ASSERT(z.num_rows == act.num_rows && z.num_cols == act.num_cols);
+    ep.act = act.p_data;
+    ep.rs_act = act.stride;
+    c = z;
+  }
+  nn__gemm(x.num_rows, w.num_cols, x.num_cols, x.p_data, x.stride, 1,
+           w.p_data, NN_F32, w.stride, 1, c.p_data, c.stride, 0, &ep);
+}
+
+void mat_sigmoid(Matrix m) {
+  for (size_t row = 0; row < m.num_rows; ++row) {
+    sigma_array(&MAT_AT(m, row, 0), &MAT_AT(m, row, 0), m.num_cols, SIGMOID);
+  }
+}
+
+// --------------------------------------------------------------
+
+// TODO: nn_ functions don't use mat_ functions. change nn_ ? remove mat_ ?
+
+static size_t nn__align(size_t n) {
+  return (n + NN_ALIGNMENT - 1) / NN_ALIGNMENT * NN_ALIGNMENT;
+}
+
+static void *nn__aligned_alloc(size_t n_bytes) {
+  void *p = NN_ALIGNED_ALLOC(nn__align(n_bytes > 0 ? n_bytes : 1));
+  NN_ASSERT(p != NULL);
+  return p;
+}
+
+// bytes of the params (or grads) block
+static size_t nn__blob_size(size_t *layer_dims, size_t n_layers) {
+  size_t size = 0;
+  for (size_t i = 1; i < n_layers; ++i) {
+    size += nn__align(layer_dims[i - 1] * layer_dims[i] * sizeof(float));
+    size += nn__align(layer_dims[i] * sizeof(float));
+  }
+  return size;
+}
+
+// point weight and bias matrices into a params or grads block
+static void nn__bind_params(Matrix *w, Matrix *b, float *block,
+                            size_t *layer_dims, size_t n_layers) {
+  char *p = (char *)block;
+  w[0] = (Matrix){0};
+  b[0] = (Matrix){0};
+  for (size_t i = 1; i < n_layers; ++i) {
+    w[i] = (Matrix){layer_dims[i - 1], layer_dims[i], layer_dims[i],
+                    (float *)p};
+    p += nn__align(layer_dims[i - 1] * layer_dims[i] * sizeof(float));
+    b[i] = (Matrix){1, layer_dims[i], layer_dims[i], (float *)p};
+    p += nn__align(layer_dims[i] * sizeof(float));
+  }
+}
+
+// bytes of the grads block: gradients followed by three loss vectors
+static size_t nn__grads_size(size_t *layer_dims, size_t n_layers) {
+  return nn__blob_size(layer_dims, n_layers) +
+         3 * nn__align(layer_dims[n_layers - 1] * sizeof(float));
+}
+
+static void nn__bind_losses(NN *nn, size_t *layer_dims) {
+  const size_t dim_out = layer_dims[nn->n_layers - 1];
+  char *p = (char *)nn->grads + nn__blob_size(layer_dims, nn->n_layers);
+  nn->loss_step = (Matrix){1, dim_out, dim_out, (float *)p};
+  p += nn__align(dim_out * sizeof(float));
+  nn->loss_batch = (Matrix){1, dim_out, dim_out, (float *)p};
+  p += nn__align(dim_out * sizeof(float));
+  nn->loss_epoch = (Matrix){1, dim_out, dim_out, (float *)p};
+}
+
+// bytes of the scratch block for batches of up to max_batch samples
+static size_t nn__scratch_size(size_t *layer_dims, size_t n_layers,
+                               size_t max_batch) {
+  size_t size = nn__align(max_batch * layer_dims[0] * sizeof(float));
+  for (size_t i = 1; i < n_layers; ++i) {
+    size += 3 * nn__align(max_batch * layer_dims[i] * sizeof(float));
+  }
+  return size;
+}
+
+// point activations, weighted sums and errors into a scratch block
+static void nn__bind_scratch(NN nn, float *block, size_t *layer_dims,
+                             size_t max_batch) {
+  char *p = (char *)block;
+  Matrix *mats[3] = {nn.activations, nn.weighted_sums, nn.errors};
+  for (size_t i = 0; i < nn.n_layers; ++i) {
+    for (size_t k = 0; k < 3; ++k) {
+      if (i == 0 && k > 0) {
+        mats[k][i] = (Matrix){0};
+        continue;
+      }
+      mats[k][i] =
+          (Matrix){max_batch, layer_dims[i], layer_dims[i], (float *)p};
+      p += nn__align(max_batch * layer_dims[i] * sizeof(float));
+    }
+  }
+}
+
+static void nn__layer_dims(NN nn, size_t *layer_dims) {
+  layer_dims[0] = nn.activations[0].num_cols;
+  for (size_t i = 1; i < nn.n_layers; ++i) {
+    layer_dims[i] = nn.activations[i].num_cols;
+  }
+}
+
+// dims of layer descriptors
+static void nn__layers_dims(const NN_Layer *layers, size_t n_layers,
+                            size_t *layer_dims) {
+  for (size_t i = 0; i < n_layers; ++i) {
+    layer_dims[i] = layers[i].dim;
+  }
+}
+
+static NN nn__create(const NN_Layer *layers, size_t n_layers,
+                     float *params) {
+  // params == NULL allocates a zeroed params block, otherwise the network
+  // uses (and does not own) the given block
+  NN_ASSERT(n_layers > 0);
+  for (size_t i = 1; i < n_layers; ++i) {
+    NN_ASSERT(layers[i].kind == NN_DENSE && "ERROR: layer kind");
+    NN_ASSERT(layers[i].act < NN__SIGMA_COUNT && "ERROR: activation");
+    NN_ASSERT((layers[i].act != SOFTMAX || i == n_layers - 1) &&
+              "ERROR: softmax is only supported on the output layer");
+  }
+  size_t layer_dims[n_layers];
+  nn__layers_dims(layers, n_layers, layer_dims);
+
+  // init NN struct
+  NN nn;
+  nn.n_layers = n_layers;
+  nn.map_base = NULL;
+  nn.map_size = 0;
+
+  // one block holds the arrays of matrices and the layer descriptors
+  Matrix *arrays = NN_MALLOC(7 * n_layers * sizeof(*arrays) +
+                             n_layers * sizeof(*nn.layers));
+  NN_ASSERT(arrays != NULL);
+  nn.layers = (NN_Layer *)(arrays + 7 * n_layers);
+  memcpy(nn.layers, layers, n_layers * sizeof(*nn.layers));
+  nn.layers[0].act = IDENTITY;
+  nn.weighted_sums = arrays;
+  nn.activations = arrays + n_layers;
+  nn.weights = arrays + 2 * n_layers;
+  nn.weight_grads = arrays + 3 * n_layers;
+  nn.biases = arrays + 4 * n_layers;
+  nn.bias_grads = arrays + 5 * n_layers;
+  nn.errors = arrays + 6 * n_layers;
+
+  // parameters
+  const size_t blob_size = nn__blob_size(layer_dims, n_layers);
+  nn.n_params = blob_size / sizeof(float);
+  if (params == NULL) {
+    params = nn__aligned_alloc(blob_size);
+    memset(params, 0, blob_size);
+  }
+  nn.params = params;
+  nn__bind_params(nn.weights, nn.biases, nn.params, layer_dims, n_layers);
+
+  // gradients and losses
+  const size_t grads_size = nn__grads_size(layer_dims, n_layers);
+  nn.grads = nn__aligned_alloc(grads_size);
+  memset(nn.grads, 0, grads_size);
+  nn__bind_params(nn.weight_grads, nn.bias_grads, nn.grads, layer_dims,
+                  n_layers);
+  nn__bind_losses(&nn, layer_dims);
+
+  // per-sample scratch for a single sample
+  nn__bind_scratch(
+      nn, nn__aligned_alloc(nn__scratch_size(layer_dims, n_layers, 1)),
+      layer_dims, 1);
+
+  return nn;
+}
+
+NN nn_create_layers(const NN_Layer *layers, size_t n_layers) {
+  return nn__create(layers, n_layers, NULL);
+}
+
+NN nn_create(size_t *layer_dims, size_t n_layers, Sigma s_hidden,
+             Sigma s_output) {
+  // s_hidden for all hidden layers, s_output for the output layer
+  NN_Layer layers[n_layers];
+  for (size_t i = 0; i < n_layers; ++i) {
+    layers[i] = (NN_Layer){.dim = layer_dims[i],
+                           .act = i == n_layers - 1 ? s_output : s_hidden,
+                           .kind = NN_DENSE};
+  }
+  return nn__create(layers, n_layers, NULL);
+}
+
+void nn_free(NN nn) {
+  NN_FREE(nn.activations[0].p_data); // scratch
+  NN_FREE(nn.grads);
+  if (nn.map_base) {
+    munmap(nn.map_base, nn.map_size);
+  } else {
+    NN_FREE(nn.params);
+  }
+  NN_FREE(nn.weighted_sums); // layer arrays
+}
+
+NN nn_clone_scratch(NN nn, size_t max_batch) {
+  // The clone shares weights and biases with nn, but owns its activations,
+  // weighted sums, errors, gradients and losses. Several clones can run
+  // forward and backprop passes concurrently.
+  NN_ASSERT(max_batch > 0);
+  size_t layer_dims[nn.n_layers];
+  nn__layer_dims(nn, layer_dims);
+
+  NN c = nn;
+  Matrix *arrays = NN_MALLOC(5 * nn.n_layers * sizeof(*arrays));
+  NN_ASSERT(arrays != NULL);
+  c.weighted_sums = arrays;
+  c.activations = arrays + nn.n_layers;
+  c.weight_grads = arrays + 2 * nn.n_layers;
+  c.bias_grads = arrays + 3 * nn.n_layers;
+  c.errors = arrays + 4 * nn.n_layers;
+
+  const size_t grads_size = nn__grads_size(layer_dims, nn.n_layers);
+  c.grads = nn__aligned_alloc(grads_size);
+  memset(c.grads, 0, grads_size);
+  nn__bind_params(c.weight_grads, c.bias_grads, c.grads, layer_dims,
+                  nn.n_layers);
+  nn__bind_losses(&c, layer_dims);
+
+  nn__bind_scratch(c,
+                   nn__aligned_alloc(nn__scratch_size(layer_dims, nn.n_layers,
+                                                      max_batch)),
+                   layer_dims, max_batch);
+  return c;
+}
+
+void nn_free_scratch(NN nn) {
+  // frees a NN returned by nn_clone_scratch; the shared weights stay alive
+  NN_FREE(nn.activations[0].p_data);
+  NN_FREE(nn.grads);
+  NN_FREE(nn.weighted_sums);
+}
+
+void nn_print(NN nn, const char *name) {
   char buf[256];
   printf("%s = [\n", name);
   // snprintf(buf, sizeof(buf), "z%zu", (size_t)0);
@@ -493,7 +1895,7 @@ void nn_print_loss(NN nn, const GD_Type gd_type) {
   default:
     NN_ASSERT(0);
   }
-  size_t output_dim = nn.activations[nn.n_layers - 1].num_rows;
+  size_t output_dim = nn.activations[nn.n_layers - 1].num_cols;
   for (size_t i = 0; i < output_dim; ++i) {
     switch (gd_type) {
     case EGD:
@@ -522,6 +1924,1006 @@ void nn_rand(NN nn, float min, float max) {
   }
 }
 
+void nn_reserve_batch(NN nn, size_t max_batch) {
+  // The per-sample matrices live in the shared layer arrays, so every copy
+  // of this NN sees the grown scratch block.
+  NN_ASSERT(max_batch > 0);
+  if (nn.activations[0].num_rows >= max_batch) {
+    return;
+  }
+  size_t layer_dims[nn.n_layers];
+  nn__layer_dims(nn, layer_dims);
+  NN_FREE(nn.activations[0].p_data);
+  nn__bind_scratch(
+      nn, nn__aligned_alloc(nn__scratch_size(layer_dims, nn.n_layers,
+                                             max_batch)),
+      layer_dims, max_batch);
+}
+
+// monotonic clock in nanoseconds
+static uint64_t nn__now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**************************************************************
+ * Profiling (NN_PROFILE)                                     *
+ * Each timed region adds its wall time, the bytes it touches *
+ * and its FLOPs to the stats of its layer and phase. A layer *
+ * counts one call per phase and pass: the output error and   *
+ * E * W^T regions add to the backward stats without a call.  *
+ * Workers add atomically, so data-parallel times are summed  *
+ * over the threads. Bytes and FLOPs are counted from the     *
+ * shapes, for n samples through a d_in x d_out layer:        *
+ *   forward   2*n*d_in*d_out  Z = A * W, + 2*n*d_out  b, f   *
+ *   backward  2*n*d_in*d_out  dW, + 2*n*d_in*d_out  E * W^T  *
+ *   update    a few per parameter, see nn__prof_update_flops *
+ * Every region is also logged as a Chrome trace event.       *
+ **************************************************************/
+
+#ifdef NN_PROFILE
+
+typedef enum {
+  NN__PROF_FORWARD = 0,
+  NN__PROF_BACKWARD = 1,
+  NN__PROF_UPDATE = 2,
+  NN__PROF_PHASES = 3,
+} NN__ProfPhase;
+
+static const char *nn__prof_phase_names[NN__PROF_PHASES] = {
+    "forward", "backward", "update"};
+
+typedef struct {
+  uint64_t ns;
+  uint64_t calls;
+  uint64_t bytes;
+  uint64_t flops;
+} NN__ProfStat;
+
+typedef struct {
+  uint64_t t0; // ns, CLOCK_MONOTONIC
+  uint64_t dur;
+  uint32_t tid;
+  uint16_t layer;
+  uint16_t phase;
+} NN__ProfEvent;
+
+// stats of the running epoch and of all finished epochs since the reset
+static NN__ProfStat nn__prof_epoch[NN_PROFILE_MAX_LAYERS][NN__PROF_PHASES];
+static NN__ProfStat nn__prof_total[NN_PROFILE_MAX_LAYERS][NN__PROF_PHASES];
+static NN__ProfEvent nn__prof_events[NN_PROFILE_MAX_EVENTS];
+static size_t nn__prof_n_events; // keeps counting past NN_PROFILE_MAX_EVENTS
+static uint32_t nn__prof_n_threads;
+static _Thread_local uint32_t nn__prof_tid; // 0 = not seen yet
+
+static void nn__prof_add(size_t layer, NN__ProfPhase phase, uint64_t t0,
+                         uint64_t calls, uint64_t bytes, uint64_t flops) {
+  const uint64_t t1 = nn__now_ns();
+  NN_ASSERT(layer < NN_PROFILE_MAX_LAYERS &&
+            "ERROR: raise NN_PROFILE_MAX_LAYERS");
+  NN__ProfStat *s = &nn__prof_epoch[layer][phase];
+  __atomic_fetch_add(&s->ns, t1 - t0, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->calls, calls, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->bytes, bytes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->flops, flops, __ATOMIC_RELAXED);
+
+  if (nn__prof_tid == 0) {
+    nn__prof_tid = __atomic_add_fetch(&nn__prof_n_threads, 1, __ATOMIC_RELAXED);
+  }
+  const size_t i = __atomic_fetch_add(&nn__prof_n_events, 1, __ATOMIC_RELAXED);
+  if (i < NN_PROFILE_MAX_EVENTS) {
+    nn__prof_events[i] =
+        (NN__ProfEvent){t0, t1 - t0, nn__prof_tid, layer, phase};
+  }
+}
+
+// FLOPs per parameter of one optimizer step
+static uint64_t nn__prof_update_flops(Opt_Type type) {
+  switch (type) {
+  case OPT_SGD:
+    return 4;
+  case OPT_MOMENTUM:
+    return 6;
+  case OPT_NESTEROV:
+    return 8;
+  default:
+    return 16; // Adam(W), counting the sqrt and the division as one each
+  }
+}
+
+static void nn__prof_print(NN nn, const NN__ProfStat *a, const NN__ProfStat *b,
+                           const char *title) {
+  // prints the sum of the stats a and b (b may be NULL)
+  NN__ProfStat stats[NN_PROFILE_MAX_LAYERS][NN__PROF_PHASES] = {0};
+  uint64_t ns_total = 0;
+  for (size_t l = 1; l < nn.n_layers; ++l) {
+    for (size_t ph = 0; ph < NN__PROF_PHASES; ++ph) {
+      const size_t i = l * NN__PROF_PHASES + ph;
+      NN__ProfStat *s = &stats[l][ph];
+      *s = a[i];
+      if (b) {
+        s->ns += b[i].ns;
+        s->calls += b[i].calls;
+        s->bytes += b[i].bytes;
+        s->flops += b[i].flops;
+      }
+      ns_total += s->ns;
+    }
+  }
+
+  printf("Profile %s: %.3f ms, summed over threads\n", title, ns_total * 1e-6);
+  printf("  layer      d_in x d_out  phase        calls         ms   share"
+         "   GFLOP/s      GB/s\n");
+  size_t l_max = 0;
+  uint64_t ns_max = 0;
+  for (size_t l = 1; l < nn.n_layers; ++l) {
+    uint64_t ns_layer = 0;
+    for (size_t ph = 0; ph < NN__PROF_PHASES; ++ph) {
+      const NN__ProfStat s = stats[l][ph];
+      ns_layer += s.ns;
+      if (ph == 0) {
+        printf("  %5zu  %8zu x %-5zu", l, nn.weights[l].num_rows,
+               nn.weights[l].num_cols);
+      } else {
+        printf("  %5s  %16s", "", "");
+      }
+      // bytes / ns = GB/s, flops / ns = GFLOP/s
+      printf("  %-9s %8llu %10.3f %6.1f%% %9.2f %9.2f\n",
+             nn__prof_phase_names[ph], (unsigned long long)s.calls,
+             s.ns * 1e-6, ns_total ? 100.0 * s.ns / ns_total : 0.0,
+             s.ns ? (double)s.flops / s.ns : 0.0,
+             s.ns ? (double)s.bytes / s.ns : 0.0);
+    }
+    if (ns_layer > ns_max) {
+      ns_max = ns_layer;
+      l_max = l;
+    }
+  }
+  if (ns_total > 0) {
+    printf("  slowest layer: %zu (%.1f%%)\n", l_max,
+           100.0 * ns_max / ns_total);
+  }
+  printf("\n");
+}
+
+// fold the running epoch into the totals, printing it first if asked
+static void nn__prof_end_epoch(NN nn, size_t e, int print) {
+  if (print) {
+    char title[32];
+    snprintf(title, sizeof(title), "of epoch %zu", e);
+    nn__prof_print(nn, &nn__prof_epoch[0][0], NULL, title);
+  }
+  for (size_t l = 0; l < NN_PROFILE_MAX_LAYERS; ++l) {
+    for (size_t ph = 0; ph < NN__PROF_PHASES; ++ph) {
+      NN__ProfStat *t = &nn__prof_total[l][ph];
+      const NN__ProfStat s = nn__prof_epoch[l][ph];
+      t->ns += s.ns;
+      t->calls += s.calls;
+      t->bytes += s.bytes;
+      t->flops += s.flops;
+    }
+  }
+  memset(nn__prof_epoch, 0, sizeof(nn__prof_epoch));
+}
+
+void nn_profile_reset(void) {
+  memset(nn__prof_epoch, 0, sizeof(nn__prof_epoch));
+  memset(nn__prof_total, 0, sizeof(nn__prof_total));
+  nn__prof_n_events = 0;
+}
+
+void nn_profile_print(NN nn) {
+  // everything recorded since the last reset, including a running epoch
+  NN_ASSERT(nn.n_layers <= NN_PROFILE_MAX_LAYERS);
+  nn__prof_print(nn, &nn__prof_total[0][0], &nn__prof_epoch[0][0],
+                 "since reset");
+}
+
+void nn_profile_trace(const char *file_path) {
+  // Chrome trace JSON (chrome://tracing, Perfetto): one complete event per
+  // timed region, one track per thread
+  FILE *fp_write = fopen(file_path, "w");
+  if (!fp_write) {
+    fprintf(stderr, "ERROR: fopen write");
+    return;
+  }
+  const size_t n = nn__prof_n_events < NN_PROFILE_MAX_EVENTS
+                       ? nn__prof_n_events
+                       : NN_PROFILE_MAX_EVENTS;
+  uint64_t t_base = UINT64_MAX;
+  for (size_t i = 0; i < n; ++i) {
+    t_base = nn__prof_events[i].t0 < t_base ? nn__prof_events[i].t0 : t_base;
+  }
+  fprintf(fp_write, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+  for (size_t i = 0; i < n; ++i) {
+    const NN__ProfEvent ev = nn__prof_events[i];
+    fprintf(fp_write,
+            "{\"name\": \"%s %u\", \"cat\": \"%s\", \"ph\": \"X\", "
+            "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 0, \"tid\": %u, "
+            "\"args\": {\"layer\": %u}}%s\n",
+            nn__prof_phase_names[ev.phase], ev.layer,
+            nn__prof_phase_names[ev.phase], (ev.t0 - t_base) * 1e-3,
+            ev.dur * 1e-3, ev.tid, ev.layer, i + 1 < n ? "," : "");
+  }
+  fprintf(fp_write, "]}\n");
+  if (ferror(fp_write)) {
+    fprintf(stderr, "ERROR: fwrite");
+  }
+  fclose(fp_write);
+  if (nn__prof_n_events > n) {
+    fprintf(stderr,
+            "WARNING: %zu trace events dropped, raise NN_PROFILE_MAX_EVENTS\n",
+            nn__prof_n_events - n);
+  }
+}
+
+#define NN__PROF_BEGIN(t0) const uint64_t t0 = nn__now_ns()
+#define NN__PROF_END(t0, layer, phase, bytes, flops)                          \
+  nn__prof_add(layer, phase, t0, 1, bytes, flops)
+// a further part of a call that is counted by another region
+#define NN__PROF_END_PART(t0, layer, phase, bytes, flops)                     \
+  nn__prof_add(layer, phase, t0, 0, bytes, flops)
+#else
+#define NN__PROF_BEGIN(t0)
+#define NN__PROF_END(t0, layer, phase, bytes, flops)
+#define NN__PROF_END_PART(t0, layer, phase, bytes, flops)
+#endif // NN_PROFILE
+
+/****************************************************************
+ * Data-parallel training: each worker forwards and backprops a *
+ * contiguous shard of the chunk on its own scratch clone, then *
+ * every worker reduces a slice of the flat gradients of all    *
+ * clones into the main network.                                *
+ ****************************************************************/
+
+typedef struct NN_Pool NN_Pool;
+
+typedef struct {
+  NN_Pool *pool;
+  size_t id;
+  NN nn; // worker 0 is the main network itself
+  pthread_t thread;
+} NN_Worker;
+
+struct NN_Pool {
+  size_t n_workers;
+  NN_Worker *workers;
+  pthread_barrier_t start;
+  pthread_barrier_t computed;
+  pthread_barrier_t reduced;
+  int quit;
+  // current job
+  Matrix x;
+  Matrix y;
+  const size_t *samples;
+  size_t n;
+};
+
+static void nn__pool_work(NN_Worker *w) {
+  NN_Pool *pool = w->pool;
+  const size_t n_workers = pool->n_workers;
+
+  // forward and backprop this worker's shard
+  const size_t lo = pool->n * w->id / n_workers;
+  const size_t hi = pool->n * (w->id + 1) / n_workers;
+  if (hi > lo) {
+    nn_forward_batch(w->nn, pool->x, pool->y, pool->samples + lo, hi - lo);
+    nn_backprop_batch(w->nn, pool->y, pool->samples + lo, hi - lo);
+  } else {
+    mat_fill(w->nn.loss_step, 0);
+  }
+  pthread_barrier_wait(&pool->computed);
+
+  // reduce this worker's slice of the flat gradients of all clones
+  NN main = pool->workers[0].nn;
+  const size_t lo_p = main.n_params * w->id / n_workers;
+  const size_t hi_p = main.n_params * (w->id + 1) / n_workers;
+  for (size_t k = 1; k < n_workers; ++k) {
+    float *grads = pool->workers[k].nn.grads;
+    for (size_t i = lo_p; i < hi_p; ++i) {
+      main.grads[i] += grads[i];
+      grads[i] = 0.f;
+    }
+  }
+
+  // losses are small, the main worker reduces them
+  if (w->id == 0) {
+    for (size_t k = 1; k < n_workers; ++k) {
+      NN c = pool->workers[k].nn;
+      mat_add_mat(main.loss_step, c.loss_step);
+      mat_add_mat(main.loss_batch, c.loss_step);
+      mat_add_mat(main.loss_epoch, c.loss_step);
+    }
+  }
+  pthread_barrier_wait(&pool->reduced);
+}
+
+static void *nn__pool_thread(void *arg) {
+  NN_Worker *w = arg;
+  for (;;) {
+    pthread_barrier_wait(&w->pool->start);
+    if (w->pool->quit) {
+      return NULL;
+    }
+    nn__pool_work(w);
+  }
+}
+
+static void nn__pool_init(NN_Pool *pool, NN nn, size_t n_workers,
+                          size_t max_shard) {
+  pool->n_workers = n_workers;
+  pool->quit = 0;
+  pool->workers = NN_MALLOC(n_workers * sizeof(*pool->workers));
+  NN_ASSERT(pool->workers != NULL);
+  pthread_barrier_init(&pool->start, NULL, n_workers);
+  pthread_barrier_init(&pool->computed, NULL, n_workers);
+  pthread_barrier_init(&pool->reduced, NULL, n_workers);
+  for (size_t k = 0; k < n_workers; ++k) {
+    NN_Worker *w = &pool->workers[k];
+    w->pool = pool;
+    w->id = k;
+    w->nn = k == 0 ? nn : nn_clone_scratch(nn, max_shard);
+    if (k > 0) {
+      int err = pthread_create(&w->thread, NULL, nn__pool_thread, w);
+      NN_ASSERT(err == 0 && "ERROR: pthread_create");
+      (void)err;
+    }
+  }
+}
+
+static void nn__pool_run(NN_Pool *pool, Matrix x, Matrix y,
+                         const size_t *samples, size_t n) {
+  pool->x = x;
+  pool->y = y;
+  pool->samples = samples;
+  pool->n = n;
+  pthread_barrier_wait(&pool->start);
+  nn__pool_work(&pool->workers[0]);
+}
+
+static void nn__pool_free(NN_Pool *pool) {
+  pool->quit = 1;
+  pthread_barrier_wait(&pool->start);
+  for (size_t k = 1; k < pool->n_workers; ++k) {
+    pthread_join(pool->workers[k].thread, NULL);
+    nn_free_scratch(pool->workers[k].nn);
+  }
+  pthread_barrier_destroy(&pool->start);
+  pthread_barrier_destroy(&pool->computed);
+  pthread_barrier_destroy(&pool->reduced);
+  NN_FREE(pool->workers);
+}
+
+/**************************************************************
+ * Training telemetry in shared memory                        *
+ * A channel holds a header, the layer table and two snapshot *
+ * slots. Each slot is a seqlock: the trainer makes its seq   *
+ * odd, writes the snapshot and makes seq even again; readers *
+ * retry a copy during which seq changed. The trainer         *
+ * alternates slots, so the newest complete snapshot stays    *
+ * readable while the next one is written and the trainer     *
+ * never waits for a reader.                                  *
+ **************************************************************/
+
+typedef struct {
+  char magic[8];        // NN_TELEMETRY_MAGIC, written last
+  uint32_t n_layers;    // including the input layer
+  uint32_t closed;      // set once the trainer is done
+  uint64_t n_params;    // floats per snapshot
+  uint64_t slot_offset; // first slot, multiple of NN_ALIGNMENT
+  uint64_t slot_size;   // bytes per slot, multiple of NN_ALIGNMENT
+  uint64_t published;   // snapshots so far, the newest is in slot
+                        // (published - 1) % 2
+} NN__TelemetryHeader;
+
+typedef struct {
+  uint64_t seq; // odd while the slot is being written
+  uint64_t epoch;
+  float loss;
+} NN__TelemetrySlot; // followed by the params at NN_ALIGNMENT
+
+static NN__TelemetrySlot *nn__telemetry_slot(const NN__TelemetryHeader *h,
+                                             size_t i) {
+  return (NN__TelemetrySlot *)((unsigned char *)h + h->slot_offset +
+                               i * h->slot_size);
+}
+
+static float *nn__telemetry_params(const NN__TelemetrySlot *slot) {
+  return (float *)((unsigned char *)slot +
+                   nn__align(sizeof(NN__TelemetrySlot)));
+}
+
+// inode of the shared memory object called name, 0 if there is none
+static uint64_t nn__telemetry_id(const char *name) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat st;
+  uint64_t id = fstat(fd, &st) == 0 ? st.st_ino : 0;
+  close(fd);
+  return id;
+}
+
+NN_Telemetry nn_telemetry_create(const char *name, NN nn) {
+  // Creates the channel name for snapshots of nn, replacing any channel of
+  // an earlier run. On failure the channel is not open (.shm == NULL) and
+  // publishing to it does nothing.
+  NN_Telemetry t = {0};
+  NN_ASSERT(strlen(name) < sizeof(t.name) && "ERROR: telemetry name");
+  strcpy(t.name, name);
+  const size_t meta_size =
+      sizeof(NN__TelemetryHeader) +
+      nn.n_layers * (sizeof(uint64_t) + sizeof(uint32_t));
+  const size_t slot_offset = nn__align(meta_size);
+  const size_t slot_size = nn__align(nn__align(sizeof(NN__TelemetrySlot)) +
+                                     nn.n_params * sizeof(*nn.params));
+  t.shm_size = slot_offset + 2 * slot_size;
+
+  shm_unlink(name);
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: shm_open %s\n", name);
+    return t;
+  }
+  void *shm = MAP_FAILED;
+  if (ftruncate(fd, t.shm_size) == 0) {
+    shm = mmap(NULL, t.shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (shm == MAP_FAILED) {
+    fprintf(stderr, "ERROR: mmap %s\n", name);
+    shm_unlink(name);
+    return t;
+  }
+
+  // the object is zero-filled, a reader ignores it until the magic is set
+  NN__TelemetryHeader *h = shm;
+  h->n_layers = nn.n_layers;
+  h->n_params = nn.n_params;
+  h->slot_offset = slot_offset;
+  h->slot_size = slot_size;
+  unsigned char *meta = (unsigned char *)(h + 1);
+  for (size_t i = 0; i < nn.n_layers; ++i) {
+    uint64_t dim = nn.layers[i].dim;
+    uint32_t s = i == 0 ? IDENTITY : nn.layers[i].act;
+    memcpy(meta + i * sizeof(dim), &dim, sizeof(dim));
+    memcpy(meta + nn.n_layers * sizeof(dim) + i * sizeof(s), &s, sizeof(s));
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(h->magic, NN_TELEMETRY_MAGIC, sizeof(h->magic));
+
+  t.shm = shm;
+  t.n_layers = nn.n_layers;
+  t.owner = 1;
+  t.id = nn__telemetry_id(name);
+  return t;
+}
+
+void nn_telemetry_publish(NN_Telemetry t, NN nn, size_t epoch, float loss) {
+  // Copies nn.params with the epoch and loss into the free slot. Only the
+  // trainer writes, so it never waits.
+  if (t.shm == NULL) {
+    return;
+  }
+  NN__TelemetryHeader *h = t.shm;
+  NN_ASSERT(t.owner && nn.n_params == h->n_params);
+  const uint64_t k = h->published;
+  NN__TelemetrySlot *slot = nn__telemetry_slot(h, k % 2);
+  const uint64_t seq = slot->seq;
+  __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->epoch = epoch;
+  slot->loss = loss;
+  memcpy(nn__telemetry_params(slot), nn.params,
+         nn.n_params * sizeof(*nn.params));
+  __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&h->published, k + 1, __ATOMIC_RELEASE);
+}
+
+NN_Telemetry nn_telemetry_open(const char *name) {
+  // Maps the channel name read-only. .shm is NULL if there is no complete
+  // channel (yet); t.layers describes the network of its snapshots.
+  NN_Telemetry t = {0};
+  NN_ASSERT(strlen(name) < sizeof(t.name) && "ERROR: telemetry name");
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    return t;
+  }
+  struct stat st;
+  void *shm = MAP_FAILED;
+  if (fstat(fd, &st) == 0 &&
+      (size_t)st.st_size >= sizeof(NN__TelemetryHeader)) {
+    shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (shm == MAP_FAILED) {
+    return t;
+  }
+
+  const NN__TelemetryHeader *h = shm;
+  const size_t size = st.st_size;
+  // the writer stores the magic last; only after it matched and the fence
+  // are the other header fields complete
+  int ok = memcmp(h->magic, NN_TELEMETRY_MAGIC, sizeof(h->magic)) == 0;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  const size_t n_layers = ok ? h->n_layers : 0;
+  const size_t slot_offset = ok ? h->slot_offset : 0;
+  const size_t slot_size = ok ? h->slot_size : 0;
+  const size_t n_params = ok ? h->n_params : 0;
+  ok = ok && n_layers > 0 && n_layers < 1 << 16 &&
+       slot_offset >= sizeof(*h) + n_layers * (sizeof(uint64_t) +
+                                                sizeof(uint32_t)) &&
+       slot_size >= nn__align(sizeof(NN__TelemetrySlot)) +
+                        n_params * sizeof(float) &&
+       slot_offset + 2 * slot_size <= size;
+  NN_Layer *layers = ok ? NN_MALLOC(n_layers * sizeof(*layers)) : NULL;
+  const unsigned char *meta = (const unsigned char *)(h + 1);
+  for (size_t i = 0; layers && i < n_layers; ++i) {
+    uint64_t dim;
+    uint32_t s;
+    memcpy(&dim, meta + i * sizeof(dim), sizeof(dim));
+    memcpy(&s, meta + n_layers * sizeof(dim) + i * sizeof(s), sizeof(s));
+    ok = ok && s < NN__SIGMA_COUNT;
+    layers[i] = (NN_Layer){.dim = dim, .act = s, .kind = NN_DENSE};
+  }
+  if (!ok) {
+    NN_FREE(layers);
+    munmap(shm, size);
+    return t;
+  }
+
+  t.shm = shm;
+  t.shm_size = size;
+  t.n_layers = n_layers;
+  t.layers = layers;
+  strcpy(t.name, name);
+  t.id = st.st_ino;
+  return t;
+}
+
+int nn_telemetry_read(NN_Telemetry t, NN nn, uint64_t *seq, size_t *epoch,
+                      float *loss) {
+  // Copies the newest snapshot into nn.params (and its epoch and loss, if
+  // not NULL) and returns 1 if it is newer than *seq, which is then
+  // updated; 0 = none read yet. nn must have the layers of the channel,
+  // e.g. nn_create_layers(t.layers, t.n_layers).
+  if (t.shm == NULL) {
+    return 0;
+  }
+  const NN__TelemetryHeader *h = t.shm;
+  NN_ASSERT(nn.n_params == h->n_params);
+  for (;;) {
+    const uint64_t k = __atomic_load_n(&h->published, __ATOMIC_ACQUIRE);
+    if (k == 0 || k == *seq) {
+      return 0;
+    }
+    const NN__TelemetrySlot *slot = nn__telemetry_slot(h, (k - 1) % 2);
+    const uint64_t s0 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (s0 % 2 != 0) {
+      continue; // the trainer moved on and reuses the slot
+    }
+    const size_t e = slot->epoch;
+    const float l = slot->loss;
+    memcpy(nn.params, nn__telemetry_params(slot),
+           nn.n_params * sizeof(*nn.params));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != s0) {
+      continue; // overwritten while copying
+    }
+    *seq = k;
+    if (epoch) {
+      *epoch = e;
+    }
+    if (loss) {
+      *loss = l;
+    }
+    return 1;
+  }
+}
+
+int nn_telemetry_closed(NN_Telemetry t) {
+  // 1 if t is not open, its trainer closed it or a new run replaced it
+  if (t.shm == NULL) {
+    return 1;
+  }
+  const NN__TelemetryHeader *h = t.shm;
+  return __atomic_load_n(&h->closed, __ATOMIC_ACQUIRE) ||
+         nn__telemetry_id(t.name) != t.id;
+}
+
+void nn_telemetry_close(NN_Telemetry t) {
+  // The trainer marks its channel closed and removes the name; readers keep
+  // their mapping, and the last snapshot, until they close it too.
+  if (t.shm == NULL) {
+    return;
+  }
+  if (t.owner) {
+    NN__TelemetryHeader *h = t.shm;
+    __atomic_store_n(&h->closed, 1, __ATOMIC_RELEASE);
+    shm_unlink(t.name);
+  }
+  munmap(t.shm, t.shm_size);
+  NN_FREE(t.layers);
+}
+
+// optimizer state arrays of n_params floats
+static uint32_t nn__opt_n_state(Optimizer opt) {
+  return (opt.m != NULL) + (opt.v != NULL);
+}
+
+// Writes checkpoints from a background thread. The trainer copies its
+// state into the snapshot buffers, which takes a few memcpys, and goes on
+// while the thread writes and syncs the file.
+typedef struct {
+  const char *path;
+  NN nn;              // the trained network with params at the snapshot
+  NN_Checkpoint snap; // with its own optimizer state and sample map
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int pending; // snap is filled and not yet written
+  int stop;
+} NN__Checkpointer;
+
+static void *nn__checkpointer_thread(void *arg) {
+  NN__Checkpointer *c = arg;
+  pthread_mutex_lock(&c->lock);
+  for (;;) {
+    while (!c->pending && !c->stop) {
+      pthread_cond_wait(&c->cond, &c->lock);
+    }
+    if (!c->pending) {
+      break;
+    }
+    // the trainer does not touch the snapshot while it is pending
+    pthread_mutex_unlock(&c->lock);
+    nn_checkpoint_save(c->path, c->nn, c->snap);
+    pthread_mutex_lock(&c->lock);
+    c->pending = 0;
+    pthread_cond_broadcast(&c->cond);
+  }
+  pthread_mutex_unlock(&c->lock);
+  return NULL;
+}
+
+// buffers for snapshots of the state described by live
+static NN__Checkpointer *nn__checkpointer_create(const char *path, NN nn,
+                                                 NN_Checkpoint live) {
+  NN__Checkpointer *c = NN_MALLOC(sizeof(*c));
+  NN_ASSERT(c != NULL);
+  *c = (NN__Checkpointer){.path = path, .nn = nn};
+  const size_t n_bytes = nn.n_params * sizeof(*nn.params);
+  c->nn.params = nn__aligned_alloc(n_bytes);
+  c->snap.opt = live.opt;
+  if (live.opt.m != NULL) {
+    const size_t n_state = nn__opt_n_state(live.opt);
+    c->snap.opt.m = nn__aligned_alloc(n_state * n_bytes);
+    c->snap.opt.v = n_state > 1 ? c->snap.opt.m + nn.n_params : NULL;
+  }
+  if (live.sample_map != NULL && live.n_samples > 0) {
+    c->snap.sample_map =
+        NN_MALLOC(live.n_samples * sizeof(*c->snap.sample_map));
+    NN_ASSERT(c->snap.sample_map != NULL);
+    c->snap.n_samples = live.n_samples;
+  }
+  if (live.best_params != NULL) {
+    c->snap.best_params = nn__aligned_alloc(n_bytes);
+  }
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->cond, NULL);
+  int err = pthread_create(&c->thread, NULL, nn__checkpointer_thread, c);
+  NN_ASSERT(err == 0 && "ERROR: pthread_create");
+  return c;
+}
+
+// hand the state live to the writer; if it is still busy with the
+// previous checkpoint, wait for it or (!wait) skip this one
+static void nn__checkpointer_snapshot(NN__Checkpointer *c, NN nn,
+                                      NN_Checkpoint live, int wait) {
+  pthread_mutex_lock(&c->lock);
+  if (c->pending && !wait) {
+    pthread_mutex_unlock(&c->lock);
+    return;
+  }
+  while (c->pending) {
+    pthread_cond_wait(&c->cond, &c->lock);
+  }
+  const size_t n_bytes = nn.n_params * sizeof(*nn.params);
+  memcpy(c->nn.params, nn.params, n_bytes);
+  if (live.opt.m != NULL) {
+    memcpy(c->snap.opt.m, live.opt.m, nn__opt_n_state(live.opt) * n_bytes);
+  }
+  if (c->snap.n_samples > 0) {
+    memcpy(c->snap.sample_map, live.sample_map,
+           c->snap.n_samples * sizeof(*live.sample_map));
+  }
+  if (c->snap.best_params != NULL) {
+    memcpy(c->snap.best_params, live.best_params, n_bytes);
+  }
+  c->snap.opt.t = live.opt.t;
+  c->snap.epoch = live.epoch;
+  c->snap.rng = live.rng;
+  c->snap.best_loss = live.best_loss;
+  c->snap.best_epoch = live.best_epoch;
+  c->snap.n_worse = live.n_worse;
+  c->pending = 1;
+  pthread_cond_signal(&c->cond);
+  pthread_mutex_unlock(&c->lock);
+}
+
+// write a pending checkpoint, then stop the thread
+static void nn__checkpointer_free(NN__Checkpointer *c) {
+  pthread_mutex_lock(&c->lock);
+  c->stop = 1;
+  pthread_cond_signal(&c->cond);
+  pthread_mutex_unlock(&c->lock);
+  pthread_join(c->thread, NULL);
+  pthread_mutex_destroy(&c->lock);
+  pthread_cond_destroy(&c->cond);
+  NN_FREE(c->nn.params);
+  NN_FREE(c->snap.opt.m);
+  NN_FREE(c->snap.sample_map);
+  NN_FREE(c->snap.best_params);
+  NN_FREE(c);
+}
+
+// Per-run training state shared by nn_train_loop and nn_train_stream
+typedef struct {
+  TrainParams p;
+  size_t n_threads;
+  size_t chunk_size; // samples forwarded at once, split over the workers
+  Optimizer opt;
+  NN_Pool pool;
+  NN_Rng rng;             // shuffles the samples
+  NN_Telemetry telemetry; // from p.telemetry, or not open
+  uint64_t published_ns;  // time of the last snapshot
+  float loss;             // of the last finished epoch, NAN before
+  size_t *sample_map;     // sample order kept across epochs, NULL = none
+  size_t n_samples;
+  NN__Checkpointer *ckpt; // from p.checkpoint, or NULL
+  float best_loss;        // lowest validation loss, INFINITY before
+  size_t best_epoch;      // epochs done at best_loss
+  size_t n_worse;         // evaluations since best_loss
+  float *best_params;     // params at best_loss if p.keep_best, or NULL
+} NN_Trainer;
+
+// the state a checkpoint after epoch epochs keeps
+static NN_Checkpoint nn__trainer_state(const NN_Trainer *t, size_t epoch) {
+  return (NN_Checkpoint){
+      .epoch = epoch,
+      .rng = t->rng,
+      .opt = t->opt,
+      .sample_map = t->sample_map,
+      .n_samples = t->n_samples,
+      .best_loss = t->best_loss,
+      .best_epoch = t->best_epoch,
+      .n_worse = t->n_worse,
+      .best_params = t->best_params,
+  };
+}
+
+static void nn__trainer_init(NN_Trainer *t, NN nn, TrainParams p,
+                             size_t batch_size, size_t *sample_map,
+                             size_t n_samples) {
+  // forward whole chunks of a batch at once, split over the workers
+  t->p = p;
+  t->n_threads = p.gd_type == SGD || p.n_threads < 2 ? 1 : p.n_threads;
+  t->chunk_size = batch_size < NN_MAX_BATCH * t->n_threads
+                      ? batch_size
+                      : NN_MAX_BATCH * t->n_threads;
+  const size_t max_shard = (t->chunk_size + t->n_threads - 1) / t->n_threads;
+  nn_reserve_batch(nn, max_shard);
+  if (p.val_x.num_rows > 0) {
+    // validation forwards batches of up to NN_MAX_BATCH even for SGD
+    NN_ASSERT(p.val_x.num_rows == p.val_y.num_rows &&
+              p.val_x.num_cols == NN_X_IN(nn).num_cols &&
+              p.val_y.num_cols == NN_Y_OUT(nn).num_cols);
+    nn_reserve_batch(nn, p.val_x.num_rows < NN_MAX_BATCH ? p.val_x.num_rows
+                                                         : NN_MAX_BATCH);
+  }
+  t->opt = nn_opt_create(nn, p.opt);
+  t->rng = nn_rng_seed(p.seed);
+  if (t->n_threads > 1) {
+    printf("Data-parallel: %zu threads\n\n", t->n_threads);
+    nn__pool_init(&t->pool, nn, t->n_threads, max_shard);
+  }
+  t->telemetry = (NN_Telemetry){0};
+  if (p.telemetry != NULL) {
+    t->telemetry = nn_telemetry_create(p.telemetry, nn);
+    printf("Telemetry: %s, a snapshot every %g s\n\n", p.telemetry,
+           p.telemetry_interval);
+  }
+  t->published_ns = nn__now_ns();
+  t->loss = NAN;
+  t->sample_map = sample_map;
+  t->n_samples = n_samples;
+  t->best_loss = INFINITY;
+  t->best_epoch = 0;
+  t->n_worse = 0;
+  t->best_params = NULL;
+  if (p.val_x.num_rows > 0) {
+    printf("Validation: %zu samples every %zu epochs", p.val_x.num_rows,
+           p.val_every ? p.val_every : 1);
+    if (p.patience > 0) {
+      printf(", patience %zu", p.patience);
+    }
+    printf("%s\n\n", p.keep_best ? ", keeping the best params" : "");
+    if (p.keep_best) {
+      // seeded by nn__trainer_resume
+      t->best_params = nn__aligned_alloc(nn.n_params * sizeof(*nn.params));
+    }
+  }
+  t->ckpt = NULL;
+  if (p.checkpoint != NULL) {
+    t->ckpt =
+        nn__checkpointer_create(p.checkpoint, nn, nn__trainer_state(t, 0));
+    printf("Checkpoint: %s, every %zu epochs\n\n", p.checkpoint,
+           p.checkpoint_every ? p.checkpoint_every : p.epochs);
+  }
+}
+
+// restore params, optimizer, shuffling stream, sample order and early
+// stopping state from p.checkpoint if p.resume is set; returns the epoch
+// to start at
+static size_t nn__trainer_resume(NN_Trainer *t, NN nn) {
+  if (t->best_params != NULL) {
+    // the params to keep if no evaluation improves on them
+    memcpy(t->best_params, nn.params, nn.n_params * sizeof(*nn.params));
+  }
+  if (!t->p.resume || t->p.checkpoint == NULL) {
+    return 0;
+  }
+  NN_Checkpoint c = nn__trainer_state(t, 0);
+  if (nn_checkpoint_load(t->p.checkpoint, nn, &c) != 0) {
+    printf("No checkpoint %s, starting at epoch 0\n\n", t->p.checkpoint);
+    return 0;
+  }
+  t->opt.t = c.opt.t;
+  t->rng = c.rng;
+  t->best_loss = c.best_loss;
+  t->best_epoch = c.best_epoch;
+  t->n_worse = c.n_worse;
+  printf("Resumed %s at epoch %zu\n\n", t->p.checkpoint, c.epoch);
+  return c.epoch;
+}
+
+static void nn__trainer_free(NN_Trainer *t) {
+  if (t->n_threads > 1) {
+    nn__pool_free(&t->pool);
+  }
+  if (t->ckpt != NULL) {
+    nn__checkpointer_free(t->ckpt);
+  }
+  nn_opt_free(t->opt);
+  nn_telemetry_close(t->telemetry);
+  NN_FREE(t->best_params);
+}
+
+// publish a snapshot for the visualizer if p.telemetry_interval passed
+// since the last one, or always if force is set
+static void nn__trainer_publish(NN_Trainer *t, NN nn, size_t e, int force) {
+  if (t->telemetry.shm == NULL) {
+    return;
+  }
+  const uint64_t now = nn__now_ns();
+  if (!force && now - t->published_ns < t->p.telemetry_interval * 1e9) {
+    return;
+  }
+  nn_telemetry_publish(t->telemetry, nn, e, t->loss);
+  t->published_ns = now;
+}
+
+static int nn__print_due(TrainParams p, size_t e) {
+  return (p.epochs > 100 && e % (int)(p.epochs / 25)) == 0 ||
+         e == p.epochs - 1;
+}
+
+// evaluate the validation set after epoch e; returns 1 once p.patience
+// evaluations in a row did not improve on the best loss
+static int nn__trainer_validate(NN_Trainer *t, NN nn, size_t e) {
+  const TrainParams p = t->p;
+  const float loss = nn_evaluate(nn, p.val_x, p.val_y);
+  if (loss < t->best_loss) {
+    t->best_loss = loss;
+    t->best_epoch = e + 1;
+    t->n_worse = 0;
+    if (t->best_params != NULL) {
+      memcpy(t->best_params, nn.params, nn.n_params * sizeof(*nn.params));
+    }
+  } else {
+    ++t->n_worse;
+  }
+  if (nn__print_due(p, e)) {
+    printf("[%zu] Validation Loss: %f (best %f after %zu epochs)\n", e, loss,
+           t->best_loss, t->best_epoch);
+  }
+  if (p.patience > 0 && t->n_worse >= p.patience && e + 1 < p.epochs) {
+    printf("Early stop after %zu epochs: no improvement in %zu "
+           "evaluations, best loss %f after %zu epochs\n",
+           e + 1, t->n_worse, t->best_loss, t->best_epoch);
+    return 1;
+  }
+  return 0;
+}
+
+// keep the loss of the finished epoch e and validate every p.val_every
+// epochs; checkpoint every p.checkpoint_every epochs and at the end, which
+// is also where the best params are restored and the final snapshot is
+// published. Returns 1 if training stops early.
+static int nn__trainer_end_epoch(NN_Trainer *t, NN nn, size_t e) {
+  float loss = 0;
+  for (size_t j = 0; j < nn.loss_epoch.num_cols; ++j) {
+    loss += MAT_AT(nn.loss_epoch, 0, j);
+  }
+  t->loss = loss;
+  const int validate = t->p.val_x.num_rows > 0;
+  const size_t val_every = t->p.val_every ? t->p.val_every : 1;
+  const int scheduled = validate && (e + 1) % val_every == 0;
+  const int stop = scheduled && nn__trainer_validate(t, nn, e);
+  const int last = stop || e + 1 == t->p.epochs;
+  const size_t every = t->p.checkpoint_every;
+  if (t->ckpt != NULL && (last || (every > 0 && (e + 1) % every == 0))) {
+    nn__checkpointer_snapshot(t->ckpt, nn, nn__trainer_state(t, e + 1),
+                              last);
+  }
+  if (last && validate && !scheduled) {
+    // the final params count too; evaluated after the checkpoint, so a
+    // resumed run keeps the schedule of an uninterrupted one
+    nn__trainer_validate(t, nn, e);
+  }
+  if (last && t->best_params != NULL && t->best_epoch > 0) {
+    // the checkpoint above keeps the state to resume from
+    memcpy(nn.params, t->best_params, nn.n_params * sizeof(*nn.params));
+    printf("Restored the best params (after %zu epochs)\n", t->best_epoch);
+  }
+  nn__trainer_publish(t, nn, e, last);
+  return stop;
+}
+
+// forward and backprop n samples, accumulating their gradients (SGD also
+// steps after every sample)
+static void nn__trainer_accumulate(NN_Trainer *t, NN nn, Matrix x, Matrix y,
+                                   const size_t *sample_map, size_t n_total) {
+  // chunk loop
+  for (size_t ss = 0; ss < n_total; ss += t->chunk_size) {
+    // get sample indices
+    const size_t n =
+        n_total - ss < t->chunk_size ? n_total - ss : t->chunk_size;
+    const size_t *samples = &sample_map[ss];
+
+    if (t->n_threads > 1) {
+      // forward, backprop and reduce gradients on all workers
+      nn__pool_run(&t->pool, x, y, samples, n);
+    } else {
+      // forward pass the whole chunk
+      nn_forward_batch(nn, x, y, samples, n);
+
+      // backprop errors and accumulate gradients of the whole chunk
+      nn_backprop_batch(nn, y, samples, n);
+    }
+
+    if (t->p.gd_type == SGD) {
+      nn_opt_step(nn, &t->opt, t->p.lr, 1);
+      // printf("[%zu] ", s);
+      // NN_PRINT_LOSS(nn, SGD);
+    }
+
+  } // chunk loop
+}
+
+static void nn__print_epoch(NN nn, TrainParams p, size_t e) {
+  const int print = nn__print_due(p, e);
+  if (print) {
+    printf("[%zu] ", e);
+    NN_PRINT_LOSS(nn, EGD);
+  }
+#ifdef NN_PROFILE
+  nn__prof_end_epoch(nn, e, print);
+#endif // NN_PROFILE
+}
+
 void nn_train_loop(NN nn, Matrix x, Matrix y, TrainParams p) {
   const size_t n_samples = x.num_rows;
   printf("Training Samples in Epoch: %zu\n", n_samples);
@@ -553,112 +2955,467 @@ void nn_train_loop(NN nn, Matrix x, Matrix y, TrainParams p) {
          batch_size, n_batches, n_samples % batch_size);
 
   // create map for accessing samples in a shuffled manner
-  size_t sample_map[n_samples];
+  size_t *sample_map = NN_MALLOC(n_samples * sizeof(*sample_map));
+  NN_ASSERT(sample_map != NULL);
   for (size_t i = 0; i < n_samples; ++i) {
     sample_map[i] = i;
   }
 
+  NN_Trainer t;
+  nn__trainer_init(&t, nn, p, batch_size, sample_map, n_samples);
+  const size_t e0 = nn__trainer_resume(&t, nn);
+
   // epoch loop
-  for (size_t e = 0; e < p.epochs; ++e) {
+  for (size_t e = e0; e < p.epochs; ++e) {
     mat_fill(nn.loss_epoch, 0);
-    shuffle_array(sample_map, n_samples);
-
-    // save weights for visualization
-    // TODO: ...
+    shuffle_array_rng(sample_map, n_samples, &t.rng);
 
     // batch loop
     for (size_t b = 0; b < n_batches; ++b) {
       mat_fill(nn.loss_batch, 0);
-
-      // sample loop
-      for (size_t ss = 0; ss < batch_size; ++ss) {
-        // get sample index
-        size_t s = sample_map[ss + b * batch_size];
-
-        // forward pass a single sample
-        nn_forward(nn, x, y, s);
-
-        // backprop errors and compute gradients
-        nn_backprop(nn, y, s);
-
-        if (p.gd_type == SGD) {
-          nn_update_weights(nn, p.lr, 1);
-          // printf("[%zu] ", s);
-          // NN_PRINT_LOSS(nn, SGD);
-        }
-
-      } // sample loop
+      nn__trainer_accumulate(&t, nn, x, y, &sample_map[b * batch_size],
+                             batch_size);
       if (p.gd_type == BGD) {
-        nn_update_weights(nn, p.lr, batch_size);
+        nn_opt_step(nn, &t.opt, p.lr, batch_size);
         // printf("[%zu] ", b);
         // NN_PRINT_LOSS(nn, BGD);
       }
+      // save weights for visualization
+      nn__trainer_publish(&t, nn, e, 0);
 
     } // batch loop
     if (p.gd_type == EGD) {
-      nn_update_weights(nn, p.lr, n_samples);
+      nn_opt_step(nn, &t.opt, p.lr, n_samples);
     }
-    if ((p.epochs > 100 && e % (int)(p.epochs / 25)) == 0 ||
-        e == p.epochs - 1) {
-      printf("[%zu] ", e);
-      NN_PRINT_LOSS(nn, EGD);
+    nn__print_epoch(nn, p, e);
+    if (nn__trainer_end_epoch(&t, nn, e)) {
+      break;
     }
 
   } // epoch loop
+
+  nn__trainer_free(&t);
+  NN_FREE(sample_map);
+#ifdef NN_PROFILE
+  nn_profile_print(nn);
+#endif // NN_PROFILE
+}
+
+/**************************************************************
+ * Streaming data sources                                     *
+ * Records of x_cols + y_cols values (x first) are read in    *
+ * chunks of chunk_rows. A loader thread fills the next chunk *
+ * while the current one is being trained on.                 *
+ **************************************************************/
+
+typedef enum {
+  DS_EMPTY = 0,   // free for the loader
+  DS_FULL = 1,    // holds a chunk (rows > 0) or the end of the epoch
+  DS_IN_USE = 2,  // handed out by ds_next_chunk
+} DS_SlotState;
+
+struct DataStream {
+  FILE *fp;
+  DS_Format format;
+  size_t x_cols;
+  size_t y_cols;
+  size_t chunk_rows;
+  float *buffers[2];
+  size_t rows[2];
+  DS_SlotState state[2];
+  size_t next_load; // slot the loader fills next
+  size_t next_take; // slot ds_next_chunk hands out next
+  int rewind;
+  int quit;
+  char *line; // CSV line buffer
+  size_t line_cap;
+  size_t line_no;    // CSV lines read this epoch, loader only
+  size_t error_line; // first bad CSV line, 0 if none
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+// read up to chunk_rows records into buf, return the number of records;
+// a short CSV record ends the chunk and sets *error_line
+static size_t ds__read_chunk(DataStream *ds, float *buf,
+                             size_t *error_line) {
+  const size_t cols = ds->x_cols + ds->y_cols;
+  if (ds->format == DS_BINARY) {
+    size_t rows = fread(buf, cols * sizeof(*buf), ds->chunk_rows, ds->fp);
+    return rows;
+  }
+
+  size_t rows = 0;
+  while (rows < ds->chunk_rows &&
+         getline(&ds->line, &ds->line_cap, ds->fp) != -1) {
+    ++ds->line_no;
+    char *p = ds->line;
+    char *end;
+    size_t col = 0;
+    for (; col < cols; ++col) {
+      float v = strtof(p, &end);
+      if (end == p) {
+        break;
+      }
+      buf[rows * cols + col] = v;
+      p = end;
+      while (*p == ',' || *p == ' ' || *p == '\t') {
+        ++p;
+      }
+    }
+    if (col == 0) {
+      continue; // empty line or header
+    }
+    if (col < cols) {
+      fprintf(stderr, "ERROR: CSV line %zu has %zu of %zu columns\n",
+              ds->line_no, col, cols);
+      *error_line = ds->line_no;
+      break;
+    }
+    ++rows;
+  }
+  return rows;
+}
+
+static void *ds__loader(void *arg) {
+  DataStream *ds = arg;
+  pthread_mutex_lock(&ds->mutex);
+  for (;;) {
+    const size_t slot = ds->next_load;
+    while (!ds->quit && !ds->rewind && ds->state[slot] != DS_EMPTY) {
+      pthread_cond_wait(&ds->cond, &ds->mutex);
+    }
+    if (ds->quit) {
+      break;
+    }
+    if (ds->rewind) {
+      // ds_rewind reset the slots; start over at the first record
+      fseek(ds->fp, 0, SEEK_SET);
+      ds->line_no = 0;
+      ds->rewind = 0;
+      continue;
+    }
+
+    // read without holding the lock; after a bad record every epoch ends
+    // right away
+    size_t error_line = 0;
+    size_t rows = 0;
+    if (ds->error_line == 0) {
+      pthread_mutex_unlock(&ds->mutex);
+      rows = ds__read_chunk(ds, ds->buffers[slot], &error_line);
+      pthread_mutex_lock(&ds->mutex);
+    }
+    if (ds->rewind) {
+      continue;
+    }
+    if (error_line > 0) {
+      ds->error_line = error_line;
+    }
+    ds->rows[slot] = rows;
+    ds->state[slot] = DS_FULL;
+    ds->next_load = 1 - slot;
+    pthread_cond_broadcast(&ds->cond);
+
+    // after the end of the epoch wait for ds_rewind
+    while (rows == 0 && !ds->quit && !ds->rewind) {
+      pthread_cond_wait(&ds->cond, &ds->mutex);
+    }
+  }
+  pthread_mutex_unlock(&ds->mutex);
+  return NULL;
+}
+
+DataStream *ds_open(const char *file_path, DS_Format format, size_t x_cols,
+                    size_t y_cols, size_t chunk_rows) {
+  NN_ASSERT(chunk_rows > 0);
+  FILE *fp = fopen(file_path, format == DS_BINARY ? "rb" : "r");
+  if (!fp) {
+    fprintf(stderr, "ERROR: fopen read %s\n", file_path);
+    return NULL;
+  }
+  DataStream *ds = NN_MALLOC(sizeof(*ds));
+  NN_ASSERT(ds != NULL);
+  memset(ds, 0, sizeof(*ds));
+  ds->fp = fp;
+  ds->format = format;
+  ds->x_cols = x_cols;
+  ds->y_cols = y_cols;
+  ds->chunk_rows = chunk_rows;
+  for (size_t k = 0; k < 2; ++k) {
+    ds->buffers[k] =
+        nn__aligned_alloc(chunk_rows * (x_cols + y_cols) * sizeof(float));
+  }
+  pthread_mutex_init(&ds->mutex, NULL);
+  pthread_cond_init(&ds->cond, NULL);
+  int err = pthread_create(&ds->thread, NULL, ds__loader, ds);
+  NN_ASSERT(err == 0 && "ERROR: pthread_create");
+  (void)err;
+  return ds;
+}
+
+size_t ds_next_chunk(DataStream *ds, Matrix *x, Matrix *y) {
+  // Hand out the next chunk as x/y views into the stream's buffer. The
+  // views stay valid until the next call. Returns 0 at the end of the
+  // epoch; call ds_rewind to start the next one.
+  pthread_mutex_lock(&ds->mutex);
+  for (size_t k = 0; k < 2; ++k) {
+    if (ds->state[k] == DS_IN_USE) {
+      ds->state[k] = DS_EMPTY;
+    }
+  }
+  pthread_cond_broadcast(&ds->cond);
+
+  const size_t slot = ds->next_take;
+  while (ds->state[slot] != DS_FULL) {
+    pthread_cond_wait(&ds->cond, &ds->mutex);
+  }
+  const size_t rows = ds->rows[slot];
+  if (rows > 0) {
+    ds->state[slot] = DS_IN_USE;
+    ds->next_take = 1 - slot;
+  }
+  pthread_mutex_unlock(&ds->mutex);
+
+  const size_t cols = ds->x_cols + ds->y_cols;
+  *x = (Matrix){rows, ds->x_cols, cols, ds->buffers[slot]};
+  *y = (Matrix){rows, ds->y_cols, cols, ds->buffers[slot] + ds->x_cols};
+  return rows;
+}
+
+void ds_rewind(DataStream *ds) {
+  pthread_mutex_lock(&ds->mutex);
+  for (size_t k = 0; k < 2; ++k) {
+    ds->state[k] = DS_EMPTY;
+  }
+  ds->next_load = 0;
+  ds->next_take = 0;
+  ds->rewind = 1;
+  pthread_cond_broadcast(&ds->cond);
+  pthread_mutex_unlock(&ds->mutex);
+}
+
+size_t ds_error(DataStream *ds) {
+  // The line of the first CSV record with too few columns, 0 if none. The
+  // stream ends at that record, so check this once ds_next_chunk returns 0.
+  pthread_mutex_lock(&ds->mutex);
+  const size_t error_line = ds->error_line;
+  pthread_mutex_unlock(&ds->mutex);
+  return error_line;
+}
+
+void ds_close(DataStream *ds) {
+  pthread_mutex_lock(&ds->mutex);
+  ds->quit = 1;
+  pthread_cond_broadcast(&ds->cond);
+  pthread_mutex_unlock(&ds->mutex);
+  pthread_join(ds->thread, NULL);
+  pthread_mutex_destroy(&ds->mutex);
+  pthread_cond_destroy(&ds->cond);
+  fclose(ds->fp);
+  NN_FREE(ds->buffers[0]);
+  NN_FREE(ds->buffers[1]);
+  free(ds->line); // allocated by getline
+  NN_FREE(ds);
+}
+
+void nn_train_stream(NN nn, DataStream *ds, TrainParams p) {
+  // Samples are shuffled within each chunk. EGD steps once per epoch, BGD
+  // batches do not span chunks (the chunk remainder is skipped).
+  size_t batch_size;
+  switch (p.gd_type) {
+  case SGD:
+    printf("Step-GD: Update weights on each step.\n");
+    batch_size = 1;
+    break;
+  case BGD:
+    printf("Batch-GD: Update weights on each batch.\n");
+    batch_size = p.batch_size;
+    break;
+  case EGD:
+    printf("Epoch-GD: Update weights on each epoch.\n");
+    batch_size = ds->chunk_rows;
+    break;
+  default:
+    printf("unreachable");
+    return;
+  }
+  printf("Streaming chunks of %zu samples, batch size: %zu\n\n",
+         ds->chunk_rows, batch_size);
+
+  size_t *sample_map = NN_MALLOC(ds->chunk_rows * sizeof(*sample_map));
+  NN_ASSERT(sample_map != NULL);
+
+  // the sample map is refilled per chunk, only the shuffling stream
+  // carries over between epochs
+  NN_Trainer t;
+  nn__trainer_init(&t, nn, p, batch_size, NULL, 0);
+  const size_t e0 = nn__trainer_resume(&t, nn);
+
+  // epoch loop
+  for (size_t e = e0; e < p.epochs; ++e) {
+    mat_fill(nn.loss_epoch, 0);
+    size_t n_samples = 0;
+
+    // chunk loop
+    Matrix x, y;
+    size_t n;
+    while ((n = ds_next_chunk(ds, &x, &y)) > 0) {
+      for (size_t i = 0; i < n; ++i) {
+        sample_map[i] = i;
+      }
+      shuffle_array_rng(sample_map, n, &t.rng);
+      n_samples += n;
+
+      if (p.gd_type == EGD) {
+        nn__trainer_accumulate(&t, nn, x, y, sample_map, n);
+        continue;
+      }
+      // batch loop
+      for (size_t b = 0; b + batch_size <= n; b += batch_size) {
+        mat_fill(nn.loss_batch, 0);
+        nn__trainer_accumulate(&t, nn, x, y, &sample_map[b], batch_size);
+        if (p.gd_type == BGD) {
+          nn_opt_step(nn, &t.opt, p.lr, batch_size);
+        }
+        nn__trainer_publish(&t, nn, e, 0);
+      } // batch loop
+    } // chunk loop
+    if (ds_error(ds)) {
+      break; // the loader stopped at a bad record
+    }
+    ds_rewind(ds);
+
+    if (p.gd_type == EGD && n_samples > 0) {
+      nn_opt_step(nn, &t.opt, p.lr, n_samples);
+    }
+    nn__print_epoch(nn, p, e);
+    if (nn__trainer_end_epoch(&t, nn, e)) {
+      break;
+    }
+
+  } // epoch loop
+
+  nn__trainer_free(&t);
+#ifdef NN_PROFILE
+  nn_profile_print(nn);
+#endif // NN_PROFILE
+  NN_FREE(sample_map);
 }
 
 void nn_set_input_layer_activations(NN nn, Matrix x, size_t s) {
-  for (size_t i = 0; i < x.num_cols; ++i) { // set input layer activations
-    MAT_AT(nn.activations[0], 0, i) = MAT_AT(x, s, i);
+  nn_set_input_layer_activations_batch(nn, x, &s, 1);
+}
+
+void nn_set_input_layer_activations_batch(NN nn, Matrix x,
+                                          const size_t *samples, size_t n) {
+  NN_ASSERT(x.num_cols == NN_X_IN(nn).num_cols);
+  NN_ASSERT(n <= NN_X_IN(nn).num_rows);
+  // gather the (shuffled) sample rows into consecutive activation rows
+  for (size_t r = 0; r < n; ++r) {
+    size_t s = samples ? samples[r] : r;
+    memcpy(&MAT_AT(NN_X_IN(nn), r, 0), &MAT_AT(x, s, 0),
+           x.num_cols * sizeof(*x.p_data));
   }
 }
 
 void nn_update_losses(const NN nn, const Matrix y, size_t s) {
+  nn_update_losses_batch(nn, y, &s, 1);
+}
+
+void nn_update_losses_batch(const NN nn, const Matrix y,
+                            const size_t *samples, size_t n) {
   NN_ASSERT(y.num_cols == NN_Y_OUT(nn).num_cols);
 
-  for (size_t j = 0; j < y.num_cols; ++j) {
-    float a_L = MAT_AT(NN_Y_OUT(nn), 0, j);
-    float y_true = MAT_AT(y, s, j);
-    float sq_err = squared_error(a_L, y_true);
-    MAT_AT(nn.loss_step, 0, j) = sq_err;
-    MAT_AT(nn.loss_batch, 0, j) += sq_err;
-    MAT_AT(nn.loss_epoch, 0, j) += sq_err;
+  // loss_step holds the loss summed over the samples of the last pass;
+  // a SOFTMAX output is scored by cross-entropy, all others by
+  // squared error
+  const size_t L = nn.n_layers - 1;
+  const int softmax = nn.layers[L].act == SOFTMAX;
+  mat_fill(nn.loss_step, 0);
+  for (size_t r = 0; r < n; ++r) {
+    size_t s = samples ? samples[r] : r;
+    const float *a_L = &MAT_AT(NN_Y_OUT(nn), r, 0);
+    const float *z_L = &MAT_AT(nn.weighted_sums[L], r, 0);
+    // log p_j = z_j - z_k + log p_k for the largest z_k: p_k >= 1 / dim
+    // cannot underflow, unlike p_j, so the loss stays finite
+    float z_max = 0.f, log_p_max = 0.f;
+    if (softmax) {
+      size_t k = 0;
+      for (size_t j = 1; j < y.num_cols; ++j) {
+        k = z_L[j] > z_L[k] ? j : k;
+      }
+      z_max = z_L[k];
+      log_p_max = logf(a_L[k]);
+    }
+    for (size_t j = 0; j < y.num_cols; ++j) {
+      float y_true = MAT_AT(y, s, j);
+      float loss = softmax ? cross_entropy(z_L[j] - z_max + log_p_max, y_true)
+                           : squared_error(a_L[j], y_true);
+      MAT_AT(nn.loss_step, 0, j) += loss;
+      MAT_AT(nn.loss_batch, 0, j) += loss;
+      MAT_AT(nn.loss_epoch, 0, j) += loss;
+    }
   }
 }
 
 void nn_forward(NN nn, const Matrix x, const Matrix y, const size_t s) {
-  nn_set_input_layer_activations(nn, x, s);
+  nn_forward_batch(nn, x, y, &s, 1);
+}
+
+void nn_forward_batch(NN nn, const Matrix x, const Matrix y,
+                      const size_t *samples, size_t n) {
+  // samples == NULL forwards the first n rows of x; an empty y (p_data ==
+  // NULL) skips the loss update
+  nn_set_input_layer_activations_batch(nn, x, samples, n);
 
   // for layer l in [1, 2, ..., L-1]
   for (size_t l = 0; l < nn.n_layers - 1; ++l) {
+    Matrix a_prev = mat_rows(nn.activations[l], 0, n);
+    Matrix z = mat_rows(nn.weighted_sums[l + 1], 0, n);
+    Matrix a = mat_rows(nn.activations[l + 1], 0, n);
+
+    // Z = A_prev * W + b; A = sigma(Z), fused into one GEMM
+    NN__PROF_BEGIN(t0);
+    mat_dense(a, z, a_prev, nn.weights[l + 1], nn.biases[l + 1],
+              nn.layers[l + 1].act);
+    // reads A_prev, W, b and writes Z, A
+    NN__PROF_END(t0, l + 1, NN__PROF_FORWARD,
+                 sizeof(float) * (n * a_prev.num_cols +
+                                  a_prev.num_cols * a.num_cols + a.num_cols +
+                                  2 * n * a.num_cols),
+                 2 * n * a_prev.num_cols * a.num_cols + 2 * n * a.num_cols);
+  }
 
-    // for i in layer l+1 neurons
-    for (size_t i = 0; i < nn.activations[l + 1].num_cols; ++i) {
-      // set weighted sum to bias: z_i = b_i
-      MAT_AT(nn.weighted_sums[l + 1], 0, i) = MAT_AT(nn.biases[l + 1], 0, i);
+  if (y.p_data != NULL) {
+    nn_update_losses_batch(nn, y, samples, n);
+  }
+}
 
-      // for j in layer l neurons
-      for (size_t j = 0; j < nn.activations[l].num_cols; ++j) {
-        float w_ji = MAT_AT(nn.weights[l + 1], j, i);
-        float a_j = MAT_AT(nn.activations[l], 0, j);
-        // add weighted activations z_i+=sum(w_ji*aj)
-        MAT_AT(nn.weighted_sums[l + 1], 0, i) += w_ji * a_j;
-      }
+float nn_evaluate(NN nn, const Matrix x, const Matrix y) {
+  // Mean loss per sample of nn on (x, y), forwarded in batches as large as
+  // the scratch of nn holds. The batch and epoch losses are left as they
+  // were, so this can run between training epochs.
+  NN_ASSERT(x.num_rows == y.num_rows && x.num_rows > 0);
+  const size_t dim = NN_Y_OUT(nn).num_cols;
+  float loss_batch[dim], loss_epoch[dim];
+  memcpy(loss_batch, nn.loss_batch.p_data, sizeof(loss_batch));
+  memcpy(loss_epoch, nn.loss_epoch.p_data, sizeof(loss_epoch));
 
-      // a_i=sigma_i(z_i)
-      if (l >= nn.n_layers - 2) {
-        // activate ouput layer
-        MAT_AT(nn.activations[l + 1], 0, i) =
-            sigma(MAT_AT(nn.weighted_sums[l + 1], 0, i), nn.s_output);
-      } else {
-        // activate hidden layers
-        MAT_AT(nn.activations[l + 1], 0, i) =
-            sigma(MAT_AT(nn.weighted_sums[l + 1], 0, i), nn.s_hidden);
-      }
+  const size_t max_batch = NN_X_IN(nn).num_rows;
+  double loss = 0;
+  for (size_t r0 = 0; r0 < x.num_rows; r0 += max_batch) {
+    const size_t n =
+        x.num_rows - r0 < max_batch ? x.num_rows - r0 : max_batch;
+    nn_forward_batch(nn, mat_rows(x, r0, n), mat_rows(y, r0, n), NULL, n);
+    for (size_t j = 0; j < dim; ++j) {
+      loss += MAT_AT(nn.loss_step, 0, j);
     }
   }
 
-  nn_update_losses(nn, y, s);
+  memcpy(nn.loss_batch.p_data, loss_batch, sizeof(loss_batch));
+  memcpy(nn.loss_epoch.p_data, loss_epoch, sizeof(loss_epoch));
+  return loss / x.num_rows;
 }
 
 void nn_clear_errors(NN nn) {
@@ -668,75 +3425,113 @@ void nn_clear_errors(NN nn) {
 }
 
 void nn_set_error_at_output_layer(NN nn, const Matrix y, size_t s) {
+  nn_set_error_at_output_layer_batch(nn, y, &s, 1);
+}
+
+void nn_set_error_at_output_layer_batch(NN nn, const Matrix y,
+                                        const size_t *samples, size_t n) {
   NN_ASSERT(y.num_cols == NN_Y_OUT(nn).num_cols);
 
+  if (nn.layers[nn.n_layers - 1].act == SOFTMAX) {
+    /************************************************
+     * softmax + cross-entropy: e_i[L]=p_i-y_true,  *
+     * the softmax Jacobian cancels with dL/dp      *
+     ************************************************/
+    for (size_t r = 0; r < n; ++r) {
+      size_t s = samples ? samples[r] : r;
+      float *e_L = &MAT_AT(nn.errors[nn.n_layers - 1], r, 0);
+      const float *p = &MAT_AT(NN_Y_OUT(nn), r, 0);
+      const float *y_s = &MAT_AT(y, s, 0);
+      for (size_t j = 0; j < y.num_cols; ++j) {
+        e_L[j] = p[j] - y_s[j];
+      }
+    }
+    return;
+  }
+
   /*********************************************
    * e_i[L]=sigma_out'(z_i[L])*(a_i[L]-y_true) *
    *********************************************/
-  for (size_t j = 0; j < y.num_cols; ++j) {
-    float a_L = MAT_AT(NN_Y_OUT(nn), 0, j);
-    float z_L = MAT_AT(nn.weighted_sums[nn.n_layers - 1], 0, j);
-    float y_true = MAT_AT(y, s, j);
-    float sq_err_prime = squared_error_derivative(a_L, y_true);
-    float sigma_prime = sigma_derivative(z_L, nn.s_output);
-    MAT_AT(nn.errors[nn.n_layers - 1], 0, j) += sq_err_prime * sigma_prime;
+  const NN_ActKernel sigma_d =
+      nn__sigma_derivative_kernel(nn.layers[nn.n_layers - 1].act);
+  for (size_t r = 0; r < n; ++r) {
+    size_t s = samples ? samples[r] : r;
+    float *e_L = &MAT_AT(nn.errors[nn.n_layers - 1], r, 0);
+    for (size_t j = 0; j < y.num_cols; ++j) {
+      float a_L = MAT_AT(NN_Y_OUT(nn), r, j);
+      float y_true = MAT_AT(y, s, j);
+      e_L[j] = squared_error_derivative(a_L, y_true);
+    }
+    sigma_d(e_L, &MAT_AT(nn.weighted_sums[nn.n_layers - 1], r, 0),
+            y.num_cols);
   }
 }
 
 void nn_backprop(NN nn, const Matrix y, const size_t s) {
-  nn_clear_errors(nn);
-  nn_set_error_at_output_layer(nn, y, s);
+  nn_backprop_batch(nn, y, &s, 1);
+}
+
+void nn_backprop_batch(NN nn, const Matrix y, const size_t *samples,
+                       size_t n) {
+  // expects the activations of nn_forward_batch with the same samples
+  NN__PROF_BEGIN(t0_out);
+  nn_set_error_at_output_layer_batch(nn, y, samples, n);
+  NN__PROF_END_PART(t0_out, nn.n_layers - 1, NN__PROF_BACKWARD,
+                    sizeof(float) * 4 * n * y.num_cols, 3 * n * y.num_cols);
 
   // propagate error backwards from last to second layer
-  /*************************************************
-   * e_j[l]=sigma'(z_j[l])*SUM{w_ji[l+1]*e_i[l+1]} *
-   *************************************************/
+  /*****************************************
+   * E[l] = (E[l+1] * W[l+1]^T) . s'(Z[l]) *
+   *****************************************/
   const size_t L = nn.n_layers - 1;
 
   // for layer l in [L-1, L-2, ..., 2]
   for (size_t l = L - 1; l > 0; --l) {
-
-    // for j in layer l neurons
-    for (size_t j = 0; j < nn.activations[l].num_cols; ++j) {
-
-      // for i in layer l+1 neurons
-      for (size_t i = 0; i < nn.activations[l + 1].num_cols; ++i) {
-        float e_i = MAT_AT(nn.errors[l + 1], 0, i);
-        float w_ji = MAT_AT(nn.weights[l + 1], j, i);
-        // sum(w_ji*e_i)
-        MAT_AT(nn.errors[l], 0, j) += w_ji * e_i;
-      }
-
-      float z_j = MAT_AT(nn.weighted_sums[l], 0, j);
-      float ds_z_j = sigma_derivative(z_j, nn.s_hidden);
-      // multiply sum(w_ji*e_i) with sigma'(z_j)
-      MAT_AT(nn.errors[l], 0, j) *= ds_z_j;
+    Matrix e = mat_rows(nn.errors[l], 0, n);
+    Matrix z = mat_rows(nn.weighted_sums[l], 0, n);
+    const NN_ActKernel sigma_d = nn__sigma_derivative_kernel(nn.layers[l].act);
+    NN__PROF_BEGIN(t0);
+    mat_gemm(e, mat_rows(nn.errors[l + 1], 0, n), 0, nn.weights[l + 1], 1, 0);
+    for (size_t r = 0; r < n; ++r) {
+      sigma_d(&MAT_AT(e, r, 0), &MAT_AT(z, r, 0), e.num_cols);
     }
+    // part of the backward pass of layer l+1: reads E[l+1], W[l+1], Z[l]
+    // and writes E[l]
+    NN__PROF_END_PART(t0, l + 1, NN__PROF_BACKWARD,
+                      sizeof(float) * (n * nn.errors[l + 1].num_cols +
+                                       e.num_cols * nn.errors[l + 1].num_cols +
+                                       3 * n * e.num_cols),
+                      2 * n * e.num_cols * nn.errors[l + 1].num_cols +
+                          n * e.num_cols);
   }
 
-  // compute gradients
-  /*******************************
-   * dE/dw_ij(k)=e_j(k)*a_i(k-1) *
-   *******************************/
+  // accumulate gradients over the batch
+  /****************************
+   * dW[l] += A[l-1]^T * E[l] *
+   * db[l] += SUM_rows{E[l]}  *
+   ****************************/
 
   // for layer l in [1, 2, ..., L]
   for (size_t l = 1; l < nn.n_layers; ++l) {
-
-    // for j in layer l neurons
-    for (size_t j = 0; j < nn.activations[l].num_cols; ++j) {
-      float e_j = MAT_AT(nn.errors[l], 0, j);
-
-      // for i in layer neurons
-      for (size_t i = 0; i < nn.activations[l - 1].num_cols; ++i) {
-        float a_i = MAT_AT(nn.activations[l - 1], 0, i);
-        float dw_ij = a_i * e_j;
-        // weight gradients at layer l
-        MAT_AT(nn.weight_grads[l], i, j) += dw_ij;
+    Matrix e = mat_rows(nn.errors[l], 0, n);
+    NN__PROF_BEGIN(t0);
+    mat_gemm(nn.weight_grads[l], mat_rows(nn.activations[l - 1], 0, n), 1, e,
+             0, 1);
+    for (size_t r = 0; r < n; ++r) {
+      for (size_t j = 0; j < e.num_cols; ++j) {
+        MAT_AT(nn.bias_grads[l], 0, j) += MAT_AT(e, r, j);
       }
-
-      // bias gradients at layer l
-      MAT_AT(nn.bias_grads[l], 0, j) += e_j;
     }
+    // reads A[l-1], E[l] and updates dW[l], db[l]; the one counted call of
+    // layer l
+    NN__PROF_END(t0, l, NN__PROF_BACKWARD,
+                 sizeof(float) * (n * nn.activations[l - 1].num_cols +
+                                  n * e.num_cols +
+                                  2 * nn.activations[l - 1].num_cols *
+                                      e.num_cols +
+                                  2 * e.num_cols),
+                 2 * n * nn.activations[l - 1].num_cols * e.num_cols +
+                     n * e.num_cols);
   }
 }
 
@@ -745,22 +3540,152 @@ void nn_update_weights(NN nn, float lr, size_t n) {
    * w_ij = w_ij * (-lr) * gw_ij *
    * b_j  = b_j  * (-lr) * gb_j  *
    *******************************/
-  for (size_t l = 1; l < nn.n_layers; ++l) {
-    for (size_t i = 0; i < nn.weights[l].num_rows; ++i) {
-      for (size_t j = 0; j < nn.weights[l].num_cols; ++j) {
-        MAT_AT(nn.weights[l], i, j) -=
-            lr * MAT_AT(nn.weight_grads[l], i, j) / n;
-        MAT_AT(nn.weight_grads[l], i, j) = 0.f;
-      }
+  // params and grads share one layout, so this is a single flat loop
+  const float scale = lr / n;
+  for (size_t i = 0; i < nn.n_params; ++i) {
+    nn.params[i] -= scale * nn.grads[i];
+    nn.grads[i] = 0.f;
+  }
+}
+
+OptParams nn_opt_defaults(Opt_Type type) {
+  return (OptParams){
+      .type = type,
+      .momentum = 0.9f,
+      .beta1 = 0.9f,
+      .beta2 = 0.999f,
+      .eps = 1e-8f,
+      .weight_decay = 0.f,
+  };
+}
+
+Optimizer nn_opt_create(NN nn, OptParams p) {
+  Optimizer opt = {.p = p, .n_params = nn.n_params, .t = 0};
+  size_t n_state;
+  switch (p.type) {
+  case OPT_SGD:
+    n_state = 0;
+    break;
+  case OPT_MOMENTUM:
+  case OPT_NESTEROV:
+    n_state = 1;
+    break;
+  case OPT_ADAM:
+  case OPT_ADAMW:
+    n_state = 2;
+    break;
+  default:
+    NN_ASSERT(0 && "Unreachable");
+    return opt;
+  }
+
+  // m and v share one zeroed block
+  if (n_state > 0) {
+    const size_t n_bytes = n_state * nn.n_params * sizeof(float);
+    opt.m = nn__aligned_alloc(n_bytes);
+    memset(opt.m, 0, n_bytes);
+    opt.v = n_state > 1 ? opt.m + nn.n_params : NULL;
+  } else {
+    opt.m = NULL;
+    opt.v = NULL;
+  }
+  return opt;
+}
+
+void nn_opt_free(Optimizer opt) { NN_FREE(opt.m); }
+
+// one optimizer step over the parameters [lo, hi), see nn_opt_step
+static void nn__opt_step_range(NN nn, Optimizer *opt, float lr, size_t n,
+                               size_t lo, size_t hi) {
+  float *restrict w = nn.params + lo;
+  float *restrict g = nn.grads + lo;
+  float *restrict m = opt->m ? opt->m + lo : NULL;
+  float *restrict v = opt->v ? opt->v + lo : NULL;
+  const size_t n_params = hi - lo;
+  const float inv_n = 1.f / n;
+  const float wd = opt->p.weight_decay;
+  const float mu = opt->p.momentum;
+
+  switch (opt->p.type) {
+  case OPT_SGD:
+    for (size_t i = 0; i < n_params; ++i) {
+      const float g_i = g[i] * inv_n + wd * w[i];
+      w[i] -= lr * g_i;
+      g[i] = 0.f;
+    }
+    break;
+  case OPT_MOMENTUM:
+    for (size_t i = 0; i < n_params; ++i) {
+      const float g_i = g[i] * inv_n + wd * w[i];
+      m[i] = mu * m[i] + g_i;
+      w[i] -= lr * m[i];
+      g[i] = 0.f;
+    }
+    break;
+  case OPT_NESTEROV:
+    for (size_t i = 0; i < n_params; ++i) {
+      const float g_i = g[i] * inv_n + wd * w[i];
+      m[i] = mu * m[i] + g_i;
+      w[i] -= lr * (g_i + mu * m[i]);
+      g[i] = 0.f;
     }
-    for (size_t j = 0; j < nn.biases[l].num_cols; ++j) {
-      MAT_AT(nn.biases[l], 0, j) -= lr * MAT_AT(nn.bias_grads[l], 0, j) / n;
-      MAT_AT(nn.bias_grads[l], 0, j) = 0.f;
+    break;
+  case OPT_ADAM:
+  case OPT_ADAMW: {
+    /*********************************************
+     * m = b1 * m + (1 - b1) * g                 *
+     * v = b2 * v + (1 - b2) * g^2               *
+     * w -= lr * m_hat / (sqrt(v_hat) + eps)     *
+     * with m_hat = m / (1 - b1^t),              *
+     *      v_hat = v / (1 - b2^t)               *
+     *********************************************/
+    const float b1 = opt->p.beta1;
+    const float b2 = opt->p.beta2;
+    const float eps = opt->p.eps;
+    const float step = lr / (1.f - powf(b1, opt->t));
+    const float inv_bc2 = 1.f / sqrtf(1.f - powf(b2, opt->t));
+    const float l2 = opt->p.type == OPT_ADAM ? wd : 0.f;
+    const float decay = opt->p.type == OPT_ADAMW ? lr * wd : 0.f;
+    for (size_t i = 0; i < n_params; ++i) {
+      const float g_i = g[i] * inv_n + l2 * w[i];
+      m[i] = b1 * m[i] + (1.f - b1) * g_i;
+      v[i] = b2 * v[i] + (1.f - b2) * g_i * g_i;
+      w[i] -= step * m[i] / (sqrtf(v[i]) * inv_bc2 + eps) + decay * w[i];
+      g[i] = 0.f;
     }
+  } break;
+  default:
+    NN_ASSERT(0 && "Unreachable");
   }
 }
 
-void nn_save(NN nn, const char *file_path) {
+void nn_opt_step(NN nn, Optimizer *opt, float lr, size_t n) {
+  // Update all parameters with the gradients summed over n samples and
+  // zero the gradients, in a single pass per optimizer. Padding between
+  // the parameter blobs has zero gradients and stays zero.
+  NN_ASSERT(opt->n_params == nn.n_params);
+  opt->t += 1;
+#ifdef NN_PROFILE
+  // one pass per layer, so that every layer's update is timed
+  const size_t n_state = (opt->m != NULL) + (opt->v != NULL);
+  for (size_t l = 1; l < nn.n_layers; ++l) {
+    const size_t lo = nn.weights[l].p_data - nn.params;
+    const size_t hi = l + 1 < nn.n_layers
+                          ? (size_t)(nn.weights[l + 1].p_data - nn.params)
+                          : nn.n_params;
+    NN__PROF_BEGIN(t0);
+    nn__opt_step_range(nn, opt, lr, n, lo, hi);
+    // reads and writes params, grads and the optimizer state
+    NN__PROF_END(t0, l, NN__PROF_UPDATE,
+                 2 * sizeof(float) * (2 + n_state) * (hi - lo),
+                 nn__prof_update_flops(opt->p.type) * (hi - lo));
+  }
+#else
+  nn__opt_step_range(nn, opt, lr, n, 0, nn.n_params);
+#endif // NN_PROFILE
+}
+
+void nn_save_text(NN nn, const char *file_path) {
   FILE *fp_write;
   fp_write = fopen(file_path, "w");
   if (!fp_write) {
@@ -778,8 +3703,11 @@ void nn_save(NN nn, const char *file_path) {
   }
   fprintf(fp_write, "\n");
 
-  // third line: hidden activation, output activation
-  fprintf(fp_write, "%i %i\n", nn.s_hidden, nn.s_output);
+  // third line: activation of each layer after the input layer
+  for (size_t i = 1; i < nn.n_layers; ++i) {
+    fprintf(fp_write, i == 1 ? "%i" : " %i", nn.layers[i].act);
+  }
+  fprintf(fp_write, "\n");
 
   for (size_t i = 1; i < nn.n_layers; ++i) {
     // layer weight rows
@@ -806,7 +3734,7 @@ void nn_save(NN nn, const char *file_path) {
   fclose(fp_write);
 }
 
-NN nn_load(const char *file_path) {
+NN nn_load_text(const char *file_path) {
   const size_t MAX_INT_LENGTH = 5;
   const size_t DECIMAL_LENGTH = 10; // 10 for floats, 20 for doubles
   size_t n;
@@ -846,15 +3774,28 @@ NN nn_load(const char *file_path) {
   buffc = realloc(buffc, sizeof(char) * n);
   NN_ASSERT(buffc && "ERROR: realloc buffc");
 
-  // read third line
+  // read third line: one activation per layer after the input layer, or
+  // (older files) the hidden and the output activation
   NN_ASSERT(fgets(buffc, n + 1, fp_read) && "ERROR: fgets");
-  tk = strtok(buffc, " ");
-  Sigma s_hidden = atoi(tk);
-  tk = strtok(NULL, " ");
-  Sigma s_output = atoi(tk);
+  Sigma acts[n_layers + 1];
+  size_t n_acts = 0;
+  for (tk = strtok(buffc, " \n"); tk; tk = strtok(NULL, " \n")) {
+    NN_ASSERT(n_acts <= n_layers && "ERROR: too many activations");
+    acts[n_acts++] = atoi(tk);
+  }
+  const int per_layer = n_acts == n_layers - 1;
+  NN_ASSERT((per_layer || n_acts == 2) && "ERROR: activations");
+  NN_Layer layers[n_layers];
+  for (size_t i = 0; i < n_layers; ++i) {
+    Sigma act = IDENTITY;
+    if (i > 0) {
+      act = per_layer ? acts[i - 1] : i == n_layers - 1 ? acts[1] : acts[0];
+    }
+    layers[i] = (NN_Layer){.dim = layer_dims[i], .act = act, .kind = NN_DENSE};
+  }
 
   // alloc network
-  NN nn = nn_create(layer_dims, ARRAY_LEN(layer_dims), s_hidden, s_output);
+  NN nn = nn_create_layers(layers, n_layers);
 
   // read weights
   for (size_t i = 1; i < nn.n_layers; ++i) {
@@ -889,4 +3830,798 @@ NN nn_load(const char *file_path) {
   return nn;
 }
 
+/**************************************************************
+ * Binary model format (little endian)                        *
+ *   NN_ModelHeader                                           *
+ *   uint64_t layer_dims[n_layers]                            *
+ *   uint32_t sigmas[n_layers]         (sigmas[0] is unused)  *
+ *   zero padding up to data_offset    (multiple of 64)       *
+ *   params block                      (NN_F32, see NN)       *
+ *   or int8 layer blocks              (NN_I8, see NN_QLayer) *
+ *   or 16-bit layer blocks            (NN_F16, NN_BF16)      *
+ * The checksum folds the 64-bit words of the data (the last *
+ * one zero padded) into the hash with a 64x64->128 bit       *
+ * multiply whose halves are xored (wyhash style), so every   *
+ * input bit reaches every bit of the hash.                   *
+ **************************************************************/
+
+static uint64_t nn__checksum_mix(uint64_t h, uint64_t word) {
+  const __uint128_t m =
+      (__uint128_t)(h ^ word ^ 0xa0761d6478bd642fULL) * 0xe7037ed1a0b428dbULL;
+  return (uint64_t)m ^ (uint64_t)(m >> 64);
+}
+
+static uint64_t nn__checksum(uint64_t h, const void *data, size_t n_bytes) {
+  const unsigned char *p = data;
+  size_t i = 0;
+  for (; i + 8 <= n_bytes; i += 8) {
+    uint64_t word;
+    memcpy(&word, p + i, sizeof(word));
+    h = nn__checksum_mix(h, word);
+  }
+  if (i < n_bytes) {
+    uint64_t word = 0;
+    memcpy(&word, p + i, n_bytes - i);
+    h = nn__checksum_mix(h, word);
+  }
+  return h;
+}
+
+#define NN_CHECKSUM_INIT 0xcbf29ce484222325ULL
+
+// bytes of the int8 weight blocks, per layer:
+//   q [dim_out][k_stride] | w_scale [dim_out] | bias [dim_out] | a_scale
+static size_t nn__qblob_size(size_t *layer_dims, size_t n_layers) {
+  size_t size = 0;
+  for (size_t i = 1; i < n_layers; ++i) {
+    size += nn__align(layer_dims[i] * nn__align(layer_dims[i - 1]));
+    size += 2 * nn__align(layer_dims[i] * sizeof(float));
+    size += nn__align(sizeof(float));
+  }
+  return size;
+}
+
+// bytes of the 16-bit weight blocks, per layer:
+//   w [dim_in][dim_out] (NN_F16 or NN_BF16) | bias [dim_out] (float)
+static size_t nn__hblob_size(size_t *layer_dims, size_t n_layers) {
+  size_t size = 0;
+  for (size_t i = 1; i < n_layers; ++i) {
+    size += nn__align(layer_dims[i - 1] * layer_dims[i] * sizeof(uint16_t));
+    size += nn__align(layer_dims[i] * sizeof(float));
+  }
+  return size;
+}
+
+static size_t nn__data_size(NN_DType dtype, size_t *layer_dims,
+                            size_t n_layers) {
+  switch (dtype) {
+  case NN_I8:
+    return nn__qblob_size(layer_dims, n_layers);
+  case NN_F16:
+  case NN_BF16:
+    return nn__hblob_size(layer_dims, n_layers);
+  default:
+    return nn__blob_size(layer_dims, n_layers);
+  }
+}
+
+static int nn__save_model(const char *file_path, const NN_Layer *layers,
+                          size_t n_layers, NN_DType dtype, const void *data) {
+  size_t layer_dims[n_layers];
+  nn__layers_dims(layers, n_layers, layer_dims);
+  FILE *fp_write;
+  fp_write = fopen(file_path, "wb");
+  if (!fp_write) {
+    fprintf(stderr, "ERROR: fopen write");
+    return -1;
+  }
+
+  const size_t meta_size = sizeof(NN_ModelHeader) +
+                           n_layers * (sizeof(uint64_t) + sizeof(uint32_t));
+
+  NN_ModelHeader header = {
+      .magic = NN_MODEL_MAGIC,
+      .version = NN_MODEL_VERSION,
+      .dtype = dtype,
+      .n_layers = n_layers,
+      .data_offset = nn__align(meta_size),
+      .data_size = nn__data_size(dtype, layer_dims, n_layers),
+      .checksum = 0, // patched below once the data is written
+  };
+  fwrite(&header, sizeof(header), 1, fp_write);
+  for (size_t i = 0; i < n_layers; ++i) {
+    uint64_t dim = layer_dims[i];
+    fwrite(&dim, sizeof(dim), 1, fp_write);
+  }
+  for (size_t i = 0; i < n_layers; ++i) {
+    uint32_t s = i == 0 ? IDENTITY : layers[i].act;
+    fwrite(&s, sizeof(s), 1, fp_write);
+  }
+  static const char zeros[NN_ALIGNMENT] = {0};
+  fwrite(zeros, 1, header.data_offset - meta_size, fp_write);
+
+  // the params block is stored as is
+  fwrite(data, 1, header.data_size, fp_write);
+  header.checksum = nn__checksum(NN_CHECKSUM_INIT, data, header.data_size);
+  fseek(fp_write, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, fp_write);
+
+  int failed = ferror(fp_write);
+  if (failed) {
+    fprintf(stderr, "ERROR: fwrite");
+  }
+  failed = fclose(fp_write) != 0 || failed;
+  return failed ? -1 : 0;
+}
+
+// write file_path.tmp and rename it, so a reader of file_path sees either
+// the old or the new model, never a partly written one
+static int nn__replace_model(const char *file_path, const NN_Layer *layers,
+                             size_t n_layers, NN_DType dtype,
+                             const void *data) {
+  char tmp_path[strlen(file_path) + sizeof(".tmp")];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", file_path);
+  if (nn__save_model(tmp_path, layers, n_layers, dtype, data) != 0 ||
+      rename(tmp_path, file_path) != 0) {
+    fprintf(stderr, "ERROR: write model %s\n", file_path);
+    remove(tmp_path);
+    return -1;
+  }
+  return 0;
+}
+
+void nn_save(NN nn, const char *file_path) {
+  nn__replace_model(file_path, nn.layers, nn.n_layers, NN_F32, nn.params);
+}
+
+// validate the fields of a header that size the rest of the file, before
+// any of it is read
+static void nn__check_header(const NN_ModelHeader *header) {
+  NN_ASSERT(memcmp(header->magic, NN_MODEL_MAGIC, sizeof(header->magic)) ==
+                0 &&
+            "ERROR: not a nn model file");
+  NN_ASSERT(header->version == NN_MODEL_VERSION && "ERROR: model version");
+  NN_ASSERT(header->n_layers > 0 && header->n_layers < 1 << 16 &&
+            "ERROR: model layers");
+}
+
+// validate a checked header and its layer table, fill the layer descriptors
+static void nn__parse_header(const NN_ModelHeader *header,
+                             const unsigned char *meta, NN_Layer *layers) {
+  NN_ASSERT(header->dtype <= NN_BF16 && "ERROR: model dtype");
+  NN_ASSERT(header->data_offset % NN_ALIGNMENT == 0);
+
+  const size_t n_layers = header->n_layers;
+  const unsigned char *sigmas = meta + n_layers * sizeof(uint64_t);
+  size_t layer_dims[n_layers];
+  for (size_t i = 0; i < n_layers; ++i) {
+    uint64_t dim;
+    uint32_t s;
+    memcpy(&dim, meta + i * sizeof(dim), sizeof(dim));
+    memcpy(&s, sigmas + i * sizeof(s), sizeof(s));
+    NN_ASSERT(s < NN__SIGMA_COUNT && "ERROR: model activation");
+    NN_ASSERT((s != SOFTMAX || i == n_layers - 1) &&
+              "ERROR: model activation");
+    layer_dims[i] = dim;
+    layers[i] = (NN_Layer){.dim = dim, .act = i == 0 ? IDENTITY : s,
+                           .kind = NN_DENSE};
+  }
+  NN_ASSERT(header->data_size ==
+            nn__data_size(header->dtype, layer_dims, n_layers));
+}
+
+NN nn_load(const char *file_path) {
+  FILE *fp_read;
+  fp_read = fopen(file_path, "rb");
+  NN_ASSERT(fp_read && "ERROR: fopen read");
+
+  NN_ModelHeader header;
+  size_t n_read = fread(&header, sizeof(header), 1, fp_read);
+  NN_ASSERT(n_read == 1 && "ERROR: fread");
+  nn__check_header(&header);
+  const size_t n_layers = header.n_layers;
+  const size_t meta_size = n_layers * (sizeof(uint64_t) + sizeof(uint32_t));
+  unsigned char meta[meta_size];
+  n_read = fread(meta, 1, meta_size, fp_read);
+  NN_ASSERT(n_read == meta_size && "ERROR: fread");
+
+  NN_Layer layers[n_layers];
+  nn__parse_header(&header, meta, layers);
+  NN_ASSERT(header.dtype == NN_F32 &&
+            "ERROR: quantized models are inference only, see nn_infer_mmap");
+
+  // alloc network
+  NN nn = nn_create_layers(layers, n_layers);
+
+  // read all weights and biases into the params block in one go
+  fseek(fp_read, header.data_offset, SEEK_SET);
+  n_read = fread(nn.params, 1, header.data_size, fp_read);
+  NN_ASSERT(n_read == header.data_size && "ERROR: fread");
+  NN_ASSERT(nn__checksum(NN_CHECKSUM_INIT, nn.params, header.data_size) ==
+                header.checksum &&
+            "ERROR: model checksum mismatch");
+
+  fclose(fp_read);
+  return nn;
+}
+
+/**************************************************************
+ * Checkpoints (little endian)                                *
+ *   a binary model file of the params (NN_F32)               *
+ *   NN__CheckpointHeader                                     *
+ *   float opt_state[n_state][n_params]  (optimizer m, v)     *
+ *   float best_params[has_best][n_params]                    *
+ *   uint64_t sample_map[n_samples]                           *
+ * nn_load reads a checkpoint as a model. It is written to    *
+ * file_path.tmp and renamed, so a crash while writing leaves *
+ * the previous checkpoint intact.                            *
+ **************************************************************/
+
+typedef struct {
+  char magic[8];      // NN_CHECKPOINT_MAGIC
+  uint64_t epoch;     // epochs done
+  uint64_t rng[4];    // state of the sample shuffling stream
+  uint32_t opt_type;  // Opt_Type
+  uint32_t n_state;   // optimizer state arrays of n_params floats
+  uint64_t opt_t;     // optimizer steps taken
+  uint64_t n_samples; // entries of the sample map
+  uint64_t best_epoch;
+  uint64_t n_worse;
+  float best_loss;
+  uint32_t has_best; // best params follow the optimizer state
+  uint64_t checksum; // nn__checksum of the optimizer state, best params and
+                     // sample map
+} NN__CheckpointHeader;
+
+int nn_checkpoint_save(const char *file_path, NN nn, NN_Checkpoint c) {
+  // The previous checkpoint is kept if writing fails.
+  char tmp_path[strlen(file_path) + sizeof(".tmp")];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", file_path);
+  if (nn__save_model(tmp_path, nn.layers, nn.n_layers, NN_F32, nn.params) !=
+      0) {
+    return -1;
+  }
+  FILE *fp_write = fopen(tmp_path, "ab");
+  if (!fp_write) {
+    fprintf(stderr, "ERROR: fopen write");
+    return -1;
+  }
+
+  // m and v share one block, see nn_opt_create
+  const size_t n_state = nn__opt_n_state(c.opt);
+  NN__CheckpointHeader header = {
+      .magic = NN_CHECKPOINT_MAGIC,
+      .epoch = c.epoch,
+      .opt_type = c.opt.p.type,
+      .n_state = n_state,
+      .opt_t = c.opt.t,
+      .n_samples = c.sample_map ? c.n_samples : 0,
+      .best_epoch = c.best_epoch,
+      .n_worse = c.n_worse,
+      .best_loss = c.best_loss,
+      .has_best = c.best_params != NULL,
+  };
+  memcpy(header.rng, c.rng.s, sizeof(header.rng));
+  uint64_t h = nn__checksum(NN_CHECKSUM_INIT, c.opt.m,
+                            n_state * nn.n_params * sizeof(float));
+  h = nn__checksum(h, c.best_params,
+                   header.has_best * nn.n_params * sizeof(float));
+  for (size_t i = 0; i < header.n_samples; ++i) {
+    uint64_t s = c.sample_map[i];
+    h = nn__checksum(h, &s, sizeof(s));
+  }
+  header.checksum = h;
+
+  fwrite(&header, sizeof(header), 1, fp_write);
+  if (n_state > 0) {
+    fwrite(c.opt.m, sizeof(float), n_state * nn.n_params, fp_write);
+  }
+  if (header.has_best) {
+    fwrite(c.best_params, sizeof(float), nn.n_params, fp_write);
+  }
+  for (size_t i = 0; i < header.n_samples; ++i) {
+    uint64_t s = c.sample_map[i];
+    fwrite(&s, sizeof(s), 1, fp_write);
+  }
+  int failed = fflush(fp_write) != 0 || ferror(fp_write) ||
+               fsync(fileno(fp_write)) != 0;
+  failed = fclose(fp_write) != 0 || failed;
+  if (failed || rename(tmp_path, file_path) != 0) {
+    fprintf(stderr, "ERROR: write checkpoint %s\n", file_path);
+    return -1;
+  }
+  return 0;
+}
+
+int nn_checkpoint_load(const char *file_path, NN nn, NN_Checkpoint *c) {
+  // Restores nn.params and the state in *c from a checkpoint of the same
+  // network. c->opt must be created with the optimizer type of the run
+  // and c->sample_map (if not NULL) hold c->n_samples entries, as must
+  // c->best_params (if not NULL) hold n_params floats; they are filled in
+  // place.
+  FILE *fp_read = fopen(file_path, "rb");
+  if (!fp_read) {
+    return -1;
+  }
+
+  NN_ModelHeader header;
+  size_t n_read = fread(&header, sizeof(header), 1, fp_read);
+  NN_ASSERT(n_read == 1 && "ERROR: fread");
+  nn__check_header(&header);
+  NN_ASSERT(header.n_layers == nn.n_layers &&
+            "ERROR: checkpoint of another network");
+  const size_t meta_size =
+      nn.n_layers * (sizeof(uint64_t) + sizeof(uint32_t));
+  unsigned char meta[meta_size];
+  n_read = fread(meta, 1, meta_size, fp_read);
+  NN_ASSERT(n_read == meta_size && "ERROR: fread");
+  NN_Layer layers[nn.n_layers];
+  nn__parse_header(&header, meta, layers);
+  for (size_t i = 0; i < nn.n_layers; ++i) {
+    NN_ASSERT(layers[i].dim == nn.layers[i].dim &&
+              (i == 0 || layers[i].act == nn.layers[i].act) &&
+              "ERROR: checkpoint of another network");
+  }
+  NN_ASSERT(header.dtype == NN_F32 &&
+            header.data_size == nn.n_params * sizeof(*nn.params));
+
+  fseek(fp_read, header.data_offset, SEEK_SET);
+  n_read = fread(nn.params, 1, header.data_size, fp_read);
+  NN_ASSERT(n_read == header.data_size && "ERROR: fread");
+  NN_ASSERT(nn__checksum(NN_CHECKSUM_INIT, nn.params, header.data_size) ==
+                header.checksum &&
+            "ERROR: model checksum mismatch");
+
+  NN__CheckpointHeader state;
+  n_read = fread(&state, sizeof(state), 1, fp_read);
+  NN_ASSERT(n_read == 1 &&
+            memcmp(state.magic, NN_CHECKPOINT_MAGIC, sizeof(state.magic)) ==
+                0 &&
+            "ERROR: not a checkpoint file");
+  NN_ASSERT(state.opt_type == c->opt.p.type &&
+            state.n_state == nn__opt_n_state(c->opt) &&
+            "ERROR: checkpoint of another optimizer");
+  NN_ASSERT(state.n_samples == (c->sample_map ? c->n_samples : 0) &&
+            "ERROR: checkpoint of another data set");
+  NN_ASSERT(state.has_best == (c->best_params != NULL) &&
+            "ERROR: checkpoint without the best params");
+  const size_t n_state = state.n_state * nn.n_params;
+  if (n_state > 0) {
+    n_read = fread(c->opt.m, sizeof(float), n_state, fp_read);
+    NN_ASSERT(n_read == n_state && "ERROR: fread");
+  }
+  uint64_t h =
+      nn__checksum(NN_CHECKSUM_INIT, c->opt.m, n_state * sizeof(float));
+  if (state.has_best) {
+    n_read = fread(c->best_params, sizeof(float), nn.n_params, fp_read);
+    NN_ASSERT(n_read == nn.n_params && "ERROR: fread");
+    h = nn__checksum(h, c->best_params, nn.n_params * sizeof(float));
+  }
+  for (size_t i = 0; i < state.n_samples; ++i) {
+    uint64_t s;
+    n_read = fread(&s, sizeof(s), 1, fp_read);
+    NN_ASSERT(n_read == 1 && "ERROR: fread");
+    NN_ASSERT(s < state.n_samples && "ERROR: checkpoint sample map");
+    h = nn__checksum(h, &s, sizeof(s));
+    c->sample_map[i] = s;
+  }
+  NN_ASSERT(h == state.checksum && "ERROR: checkpoint checksum mismatch");
+  fclose(fp_read);
+
+  c->epoch = state.epoch;
+  memcpy(c->rng.s, state.rng, sizeof(c->rng.s));
+  c->opt.t = state.opt_t;
+  c->best_loss = state.best_loss;
+  c->best_epoch = state.best_epoch;
+  c->n_worse = state.n_worse;
+  return 0;
+}
+
+// map a model file and validate its header and checksum; layer dims and
+// activations are parsed by the caller once n_layers is known
+static unsigned char *nn__map_model(const char *file_path, int prot,
+                                    NN_ModelHeader *header,
+                                    size_t *map_size) {
+  int fd = open(file_path, O_RDONLY);
+  NN_ASSERT(fd >= 0 && "ERROR: open");
+  struct stat st;
+  int err = fstat(fd, &st);
+  NN_ASSERT(err == 0 && "ERROR: fstat");
+  *map_size = st.st_size;
+  NN_ASSERT(*map_size >= sizeof(NN_ModelHeader) &&
+            "ERROR: not a nn model file");
+  unsigned char *map = mmap(NULL, *map_size, prot, MAP_PRIVATE, fd, 0);
+  close(fd);
+  NN_ASSERT(map != MAP_FAILED && "ERROR: mmap");
+
+  // the layer table lies between the header and the data, and both have
+  // to fit into the file before the caller parses them
+  memcpy(header, map, sizeof(*header));
+  nn__check_header(header);
+  const size_t meta_size =
+      sizeof(*header) +
+      header->n_layers * (sizeof(uint64_t) + sizeof(uint32_t));
+  NN_ASSERT(header->data_offset >= meta_size &&
+            header->data_offset <= *map_size &&
+            header->data_size <= *map_size - header->data_offset &&
+            "ERROR: truncated model file");
+  NN_ASSERT(nn__checksum(NN_CHECKSUM_INIT, map + header->data_offset,
+                         header->data_size) == header->checksum &&
+            "ERROR: model checksum mismatch");
+  return map;
+}
+
+NN nn_mmap(const char *file_path) {
+  // Map the model file and use its weights in place. The mapping is private,
+  // so training a mapped network never writes back to the file.
+  NN_ModelHeader header;
+  size_t map_size;
+  unsigned char *map = nn__map_model(file_path, PROT_READ | PROT_WRITE,
+                                     &header, &map_size);
+  const size_t n_layers = header.n_layers;
+  NN_Layer layers[n_layers];
+  nn__parse_header(&header, map + sizeof(header), layers);
+  NN_ASSERT(header.dtype == NN_F32 &&
+            "ERROR: quantized models are inference only, see nn_infer_mmap");
+
+  // use the params block of the mapping in place
+  NN nn = nn__create(layers, n_layers, (float *)(map + header.data_offset));
+  nn.map_base = map;
+  nn.map_size = map_size;
+  return nn;
+}
+
+// --------------------------------------------------------------
+
+// point the int8 layers (and the dims-only weights) into an NN_I8 block
+static void nn__bind_qlayers(NN_Infer *m, size_t *layer_dims) {
+  const size_t n_layers = m->n_layers;
+  size_t n_channels = 0;
+  for (size_t i = 1; i < n_layers; ++i) {
+    n_channels += layer_dims[i];
+  }
+  // one block holds the layer array and the per-channel weight sums
+  char *block = NN_MALLOC(n_layers * sizeof(NN_QLayer) +
+                          n_channels * sizeof(int32_t));
+  NN_ASSERT(block != NULL);
+  m->qlayers = (NN_QLayer *)block;
+  int32_t *w_sum = (int32_t *)(block + n_layers * sizeof(NN_QLayer));
+
+  char *p = (char *)m->params;
+  m->weights[0] = (Matrix){0};
+  m->biases[0] = (Matrix){0};
+  m->qlayers[0] = (NN_QLayer){0};
+  for (size_t i = 1; i < n_layers; ++i) {
+    const size_t dim_in = layer_dims[i - 1];
+    const size_t dim_out = layer_dims[i];
+    NN_QLayer *q = &m->qlayers[i];
+    q->k_stride = nn__align(dim_in);
+    q->q = (int8_t *)p;
+    p += nn__align(dim_out * q->k_stride);
+    q->w_scale = (float *)p;
+    p += nn__align(dim_out * sizeof(float));
+    m->biases[i] = (Matrix){1, dim_out, dim_out, (float *)p};
+    p += nn__align(dim_out * sizeof(float));
+    memcpy(&q->a_scale, p, sizeof(q->a_scale));
+    p += nn__align(sizeof(float));
+    m->weights[i] = (Matrix){dim_in, dim_out, dim_out, NULL};
+
+    q->w_sum = w_sum;
+    w_sum += dim_out;
+    for (size_t j = 0; j < dim_out; ++j) {
+      int32_t sum = 0;
+      for (size_t k = 0; k < dim_in; ++k) {
+        sum += q->q[j * q->k_stride + k];
+      }
+      q->w_sum[j] = sum;
+    }
+    m->max_k = q->k_stride > m->max_k ? q->k_stride : m->max_k;
+  }
+}
+
+// point the 16-bit weights and the float biases into an NN_F16/BF16 block
+static void nn__bind_half(NN_Infer *m, size_t *layer_dims) {
+  m->weights_h = NN_MALLOC(m->n_layers * sizeof(*m->weights_h));
+  NN_ASSERT(m->weights_h != NULL);
+  char *p = (char *)m->params;
+  m->weights[0] = (Matrix){0};
+  m->biases[0] = (Matrix){0};
+  m->weights_h[0] = NULL;
+  for (size_t i = 1; i < m->n_layers; ++i) {
+    const size_t dim_in = layer_dims[i - 1];
+    const size_t dim_out = layer_dims[i];
+    m->weights[i] = (Matrix){dim_in, dim_out, dim_out, NULL};
+    m->weights_h[i] = (uint16_t *)p;
+    p += nn__align(dim_in * dim_out * sizeof(uint16_t));
+    m->biases[i] = (Matrix){1, dim_out, dim_out, (float *)p};
+    p += nn__align(dim_out * sizeof(float));
+  }
+}
+
+static NN_Infer nn__infer_create(const NN_Layer *layers, size_t n_layers,
+                                 NN_DType dtype, float *params) {
+  NN_ASSERT(n_layers > 1);
+  size_t layer_dims[n_layers];
+  nn__layers_dims(layers, n_layers, layer_dims);
+
+  NN_Infer m = {0};
+  m.n_layers = n_layers;
+  m.dtype = dtype;
+  m.params = params;
+  m.data_size = nn__data_size(dtype, layer_dims, n_layers);
+
+  // one block holds the arrays of matrices and the layer descriptors
+  Matrix *arrays = NN_MALLOC(2 * n_layers * sizeof(*arrays) +
+                             n_layers * sizeof(*m.layers));
+  NN_ASSERT(arrays != NULL);
+  m.weights = arrays;
+  m.biases = arrays + n_layers;
+  m.layers = (NN_Layer *)(arrays + 2 * n_layers);
+  memcpy(m.layers, layers, n_layers * sizeof(*m.layers));
+  if (dtype == NN_I8) {
+    nn__bind_qlayers(&m, layer_dims);
+  } else if (dtype == NN_F16 || dtype == NN_BF16) {
+    nn__bind_half(&m, layer_dims);
+  } else {
+    nn__bind_params(m.weights, m.biases, params, layer_dims, n_layers);
+  }
+
+  // the input is read from x and the output written to y_pred, so only the
+  // hidden layers pass through the buffers of a context
+  for (size_t i = 1; i < n_layers - 1; ++i) {
+    m.max_dim = layer_dims[i] > m.max_dim ? layer_dims[i] : m.max_dim;
+  }
+  return m;
+}
+
+NN_Infer nn_infer_create(NN nn) {
+  // The model shares weights and biases with nn, which must outlive it.
+  return nn__infer_create(nn.layers, nn.n_layers, NN_F32, nn.params);
+}
+
+NN_Infer nn_infer_mmap(const char *file_path) {
+  // The weights are used in place from a read-only mapping, so processes
+  // serving the same model file share its pages.
+  NN_ModelHeader header;
+  size_t map_size;
+  unsigned char *map =
+      nn__map_model(file_path, PROT_READ, &header, &map_size);
+  const size_t n_layers = header.n_layers;
+  NN_Layer layers[n_layers];
+  nn__parse_header(&header, map + sizeof(header), layers);
+
+  NN_Infer m = nn__infer_create(layers, n_layers, header.dtype,
+                                (float *)(map + header.data_offset));
+  m.map_base = map;
+  m.map_size = map_size;
+  return m;
+}
+
+void nn_infer_save(NN_Infer m, const char *file_path) {
+  nn__replace_model(file_path, m.layers, m.n_layers, m.dtype, m.params);
+}
+
+void nn_infer_free(NN_Infer m) {
+  if (m.map_base) {
+    munmap(m.map_base, m.map_size);
+  } else if (m.owns_params) {
+    NN_FREE(m.params);
+  }
+  NN_FREE(m.qlayers);
+  NN_FREE(m.weights_h);
+  NN_FREE(m.weights); // layer arrays
+}
+
+NN_InferCtx nn_infer_ctx_create(NN_Infer m, size_t max_batch) {
+  // A context may be used with any model whose hidden layers are at most
+  // as wide as those of m, but by one thread at a time.
+  NN_ASSERT(max_batch > 0);
+  NN_InferCtx ctx = {
+      .max_dim = m.max_dim, .max_k = m.max_k, .max_batch = max_batch};
+  if (m.max_dim > 0) {
+    const size_t buffer_size =
+        nn__align(max_batch * m.max_dim * sizeof(float));
+    char *block = nn__aligned_alloc(2 * buffer_size);
+    ctx.buffers[0] = (float *)block;
+    ctx.buffers[1] = (float *)(block + buffer_size);
+  }
+  if (m.max_k > 0) {
+    ctx.qbuffer = nn__aligned_alloc(max_batch * m.max_k);
+  }
+  return ctx;
+}
+
+void nn_infer_ctx_free(NN_InferCtx ctx) {
+  NN_FREE(ctx.buffers[0]); // both buffers
+  NN_FREE(ctx.qbuffer);
+}
+
+static int8_t nn__quantize(float x, float inv_scale) {
+  float q = x * inv_scale;
+  q = q > 127.f ? 127.f : q < -127.f ? -127.f : q;
+  return (int8_t)lrintf(q);
+}
+
+// a = sigma(z) of one int8 layer for the n rows of a_prev
+static void nn__predict_layer_i8(NN_QLayer q, Matrix b, NN_InferCtx ctx,
+                                 Matrix a_prev, Matrix a, Sigma f) {
+  const size_t n = a_prev.num_rows;
+  const size_t k = q.k_stride;
+
+  // q_a = round(a_prev / a_scale), rows zero padded to k_stride
+  const float inv_scale = 1.f / q.a_scale;
+  for (size_t r = 0; r < n; ++r) {
+    int8_t *q_a = ctx.qbuffer + r * k;
+    for (size_t i = 0; i < a_prev.num_cols; ++i) {
+      q_a[i] = nn__quantize(MAT_AT(a_prev, r, i), inv_scale);
+    }
+    memset(q_a + a_prev.num_cols, 0, k - a_prev.num_cols);
+  }
+
+  // z_j = a_scale * w_scale_j * (q_a . q_j) + b_j, four rows per q_j load
+  for (size_t r = 0; r < n; r += 4) {
+    const int8_t *rows[4];
+    for (size_t i = 0; i < 4; ++i) {
+      rows[i] = ctx.qbuffer + (r + i < n ? r + i : n - 1) * k;
+    }
+    for (size_t j = 0; j < a.num_cols; ++j) {
+      int32_t dots[4];
+      nn__dot4_i8_kernel(dots, rows, q.q + j * k, k, q.w_sum[j]);
+      const float scale = q.a_scale * q.w_scale[j];
+      for (size_t i = 0; i < 4 && r + i < n; ++i) {
+        MAT_AT(a, r + i, j) = dots[i] * scale + MAT_AT(b, 0, j);
+      }
+    }
+  }
+
+  const NN_ActKernel act = nn__sigma_kernel(f);
+  for (size_t r = 0; r < n; ++r) {
+    act(&MAT_AT(a, r, 0), &MAT_AT(a, r, 0), a.num_cols);
+  }
+}
+
+void nn_predict(NN_Infer m, NN_InferCtx ctx, Matrix x, Matrix y_pred) {
+  // y_pred = network(x), row by row; no targets and no losses. Only ctx is
+  // written to, so threads may share m as long as each has its own ctx.
+  // Inputs with more than max_batch rows are forwarded in slices.
+  NN_ASSERT(x.num_cols == m.weights[1].num_rows);
+  NN_ASSERT(y_pred.num_cols == m.biases[m.n_layers - 1].num_cols);
+  NN_ASSERT(y_pred.num_rows == x.num_rows);
+  NN_ASSERT(m.max_dim <= ctx.max_dim);
+  NN_ASSERT(m.max_k <= ctx.max_k);
+  if (m.dtype == NN_I8) {
+    pthread_once(&nn__simd_once, nn__simd_init);
+  }
+
+  for (size_t r0 = 0; r0 < x.num_rows; r0 += ctx.max_batch) {
+    const size_t n = x.num_rows - r0 < ctx.max_batch ? x.num_rows - r0
+                                                     : ctx.max_batch;
+    Matrix a_prev = mat_rows(x, r0, n);
+
+    // for layer l in [1, 2, ..., L-1]
+    for (size_t l = 1; l < m.n_layers; ++l) {
+      const size_t dim = m.biases[l].num_cols;
+      const int is_output = l == m.n_layers - 1;
+      const Sigma f = m.layers[l].act;
+      Matrix a = is_output ? mat_rows(y_pred, r0, n)
+                           : (Matrix){n, dim, dim, ctx.buffers[l % 2]};
+
+      // A = sigma(A_prev * W + b) in one GEMM, no Z is stored; 16-bit
+      // weights are widened to float while packing
+      if (m.dtype == NN_I8) {
+        nn__predict_layer_i8(m.qlayers[l], m.biases[l], ctx, a_prev, a, f);
+      } else if (m.dtype == NN_F16 || m.dtype == NN_BF16) {
+        NN_GemmEpilogue ep = {.bias = m.biases[l].p_data,
+                              .sigma = nn__sigma_kernel(f),
+                              .whole_rows = f == SOFTMAX};
+        nn__gemm(n, dim, a_prev.num_cols, a_prev.p_data, a_prev.stride, 1,
+                 m.weights_h[l], m.dtype, dim, 1, a.p_data, a.stride, 0, &ep);
+      } else {
+        mat_dense(a, (Matrix){0}, a_prev, m.weights[l], m.biases[l], f);
+      }
+      a_prev = a;
+    }
+  }
+}
+
+NN_Infer nn_infer_convert(NN nn, NN_DType dtype) {
+  // Copy of nn's weights as NN_F32, NN_F16 or NN_BF16 that owns its data;
+  // save it with nn_infer_save. Biases stay float and all arithmetic is
+  // float, half precision only halves the weight bytes moved per layer.
+  NN_ASSERT(dtype == NN_F32 || dtype == NN_F16 || dtype == NN_BF16);
+  size_t layer_dims[nn.n_layers];
+  nn__layer_dims(nn, layer_dims);
+  const size_t data_size = nn__data_size(dtype, layer_dims, nn.n_layers);
+  char *data = nn__aligned_alloc(data_size);
+  memset(data, 0, data_size);
+
+  if (dtype == NN_F32) {
+    memcpy(data, nn.params, data_size);
+  } else {
+    char *p = data;
+    for (size_t l = 1; l < nn.n_layers; ++l) {
+      const Matrix w = nn.weights[l];
+      uint16_t *h = (uint16_t *)p;
+      for (size_t i = 0; i < w.num_rows; ++i) {
+        for (size_t j = 0; j < w.num_cols; ++j) {
+          const float x = MAT_AT(w, i, j);
+          h[i * w.num_cols + j] =
+              dtype == NN_F16 ? nn__f32_to_f16(x) : nn__f32_to_bf16(x);
+        }
+      }
+      p += nn__align(w.num_rows * w.num_cols * sizeof(uint16_t));
+      memcpy(p, nn.biases[l].p_data, w.num_cols * sizeof(float));
+      p += nn__align(w.num_cols * sizeof(float));
+    }
+  }
+
+  NN_Infer m = nn__infer_create(nn.layers, nn.n_layers, dtype, (float *)data);
+  m.owns_params = 1;
+  return m;
+}
+
+// --------------------------------------------------------------
+
+void nn_calibrate(NN nn, Matrix x, float *a_max) {
+  // Running max |a| of the inputs of every layer over the rows of x, for
+  // nn_quantize: a_max[l] belongs to the input of layer l + 1 (a_max[0] to
+  // x itself). Zero a_max once, then call for each calibration chunk.
+  const size_t max_batch = NN_X_IN(nn).num_rows;
+  for (size_t r0 = 0; r0 < x.num_rows; r0 += max_batch) {
+    const size_t n =
+        x.num_rows - r0 < max_batch ? x.num_rows - r0 : max_batch;
+    nn_forward_batch(nn, mat_rows(x, r0, n), (Matrix){0}, NULL, n);
+    for (size_t l = 0; l < nn.n_layers - 1; ++l) {
+      for (size_t r = 0; r < n; ++r) {
+        for (size_t i = 0; i < nn.activations[l].num_cols; ++i) {
+          float v = fabsf(MAT_AT(nn.activations[l], r, i));
+          a_max[l] = v > a_max[l] ? v : a_max[l];
+        }
+      }
+    }
+  }
+}
+
+NN_Infer nn_quantize(NN nn, const float *a_max) {
+  // Post-training quantization of nn into an NN_I8 model that owns its
+  // data; save it with nn_infer_save. Weights get one symmetric scale per
+  // output channel, layer inputs one scale per layer from a_max (see
+  // nn_calibrate). Biases stay float.
+  size_t layer_dims[nn.n_layers];
+  nn__layer_dims(nn, layer_dims);
+  const size_t data_size = nn__qblob_size(layer_dims, nn.n_layers);
+  char *data = nn__aligned_alloc(data_size);
+  memset(data, 0, data_size);
+
+  char *p = data;
+  for (size_t l = 1; l < nn.n_layers; ++l) {
+    const Matrix w = nn.weights[l];
+    const size_t k_stride = nn__align(w.num_rows);
+    int8_t *q = (int8_t *)p;
+    p += nn__align(w.num_cols * k_stride);
+    float *w_scale = (float *)p;
+    p += nn__align(w.num_cols * sizeof(float));
+    memcpy(p, nn.biases[l].p_data, w.num_cols * sizeof(float));
+    p += nn__align(w.num_cols * sizeof(float));
+    float a_scale = a_max[l - 1] > 0 ? a_max[l - 1] / 127.f : 1.f;
+    memcpy(p, &a_scale, sizeof(a_scale));
+    p += nn__align(sizeof(float));
+
+    for (size_t j = 0; j < w.num_cols; ++j) {
+      float w_max = 0;
+      for (size_t i = 0; i < w.num_rows; ++i) {
+        w_max = fmaxf(w_max, fabsf(MAT_AT(w, i, j)));
+      }
+      w_scale[j] = w_max > 0 ? w_max / 127.f : 1.f;
+      for (size_t i = 0; i < w.num_rows; ++i) {
+        q[j * k_stride + i] = nn__quantize(MAT_AT(w, i, j), 1.f / w_scale[j]);
+      }
+    }
+  }
+
+  NN_Infer m = nn__infer_create(nn.layers, nn.n_layers, NN_I8, (float *)data);
+  m.owns_params = 1;
+  return m;
+}
+
 #endif // NN_IMPLEMENTATION
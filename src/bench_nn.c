@@ -0,0 +1,373 @@
+/*
+Benchmark harness for the matrix and network kernels of nn.h.
+
+Usage: bench_nn [options]
+  --gemm MxKxN     time mat_mul_mat of a MxK by a KxN matrix (repeatable)
+  --net d0,d1,...  layer dims of the network benchmarks
+  --batch B        samples per nn_forward_batch / nn_predict /
+                   nn_backprop_batch
+  --samples N      samples per nn_train_loop epoch
+  --threads T      n_threads for nn_train_loop
+  --warmup W       untimed runs before measuring
+  --repeat R       timed runs, the median is reported
+  --format F       text, csv or json
+*/
+
+#define NN_IMPLEMENTATION
+#include "../nn.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_GEMMS 16
+#define MAX_LAYERS 32
+
+typedef enum {
+  FMT_TEXT = 0,
+  FMT_CSV = 1,
+  FMT_JSON = 2,
+} Format;
+
+typedef struct {
+  size_t gemms[MAX_GEMMS][3];
+  size_t n_gemms;
+  size_t layer_dims[MAX_LAYERS];
+  size_t n_layers;
+  size_t batch;
+  size_t samples;
+  size_t threads;
+  size_t warmup;
+  size_t repeat;
+  Format format;
+} BenchParams;
+
+typedef struct {
+  const char *name;
+  char shape[128];
+  double median_s;
+  double min_s;
+  double flops;   // per run
+  double samples; // per run
+} BenchResult;
+
+double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// run fn warmup + repeat times, fill median and min time of the timed runs
+typedef void (*BenchFn)(void *ctx);
+
+void bench_run(BenchFn fn, void *ctx, BenchParams p, BenchResult *r) {
+  for (size_t i = 0; i < p.warmup; ++i) {
+    fn(ctx);
+  }
+  double times[p.repeat];
+  for (size_t i = 0; i < p.repeat; ++i) {
+    double t0 = now_s();
+    fn(ctx);
+    times[i] = now_s() - t0;
+  }
+  qsort(times, p.repeat, sizeof(times[0]), cmp_double);
+  r->median_s = times[p.repeat / 2];
+  r->min_s = times[0];
+}
+
+void print_header(Format format) {
+  switch (format) {
+  case FMT_TEXT:
+    printf("# simd: %s\n", nn_simd_name());
+    printf("%-18s %-26s %12s %12s %10s %14s\n", "bench", "shape", "median_ms",
+           "min_ms", "GFLOP/s", "samples/s");
+    break;
+  case FMT_CSV:
+    printf("bench,shape,simd,median_ms,min_ms,gflops,samples_per_s\n");
+    break;
+  case FMT_JSON:
+    printf("[\n");
+    break;
+  }
+}
+
+void print_result(Format format, BenchResult r, int first) {
+  double gflops = r.flops / r.median_s * 1e-9;
+  double sps = r.samples / r.median_s;
+  switch (format) {
+  case FMT_TEXT:
+    printf("%-18s %-26s %12.3f %12.3f %10.2f %14.1f\n", r.name, r.shape,
+           r.median_s * 1e3, r.min_s * 1e3, gflops, sps);
+    break;
+  case FMT_CSV:
+    printf("%s,%s,%s,%f,%f,%f,%f\n", r.name, r.shape, nn_simd_name(),
+           r.median_s * 1e3, r.min_s * 1e3, gflops, sps);
+    break;
+  case FMT_JSON:
+    printf("%s  {\"bench\": \"%s\", \"shape\": \"%s\", \"simd\": \"%s\", "
+           "\"median_ms\": %f, \"min_ms\": %f, \"gflops\": %f, "
+           "\"samples_per_s\": %f}",
+           first ? "" : ",\n", r.name, r.shape, nn_simd_name(),
+           r.median_s * 1e3, r.min_s * 1e3, gflops, sps);
+    break;
+  }
+}
+
+void print_footer(Format format) {
+  if (format == FMT_JSON) {
+    printf("\n]\n");
+  }
+}
+
+// --------------------------------------------------------------
+
+typedef struct {
+  Matrix dst, a, b;
+} GemmCtx;
+
+void bench_gemm(void *ctx) {
+  GemmCtx *c = ctx;
+  mat_mul_mat(c->dst, c->a, c->b);
+}
+
+typedef struct {
+  NN nn;
+  NN_Infer infer;
+  NN_InferCtx infer_ctx;
+  Matrix x, y, y_pred;
+  size_t batch;
+  TrainParams tp;
+} NetCtx;
+
+void bench_forward(void *ctx) {
+  NetCtx *c = ctx;
+  nn_forward_batch(c->nn, c->x, c->y, NULL, c->batch);
+}
+
+void bench_predict(void *ctx) {
+  NetCtx *c = ctx;
+  nn_predict(c->infer, c->infer_ctx, mat_rows(c->x, 0, c->batch), c->y_pred);
+}
+
+void bench_backprop(void *ctx) {
+  NetCtx *c = ctx;
+  nn_backprop_batch(c->nn, c->y, NULL, c->batch);
+}
+
+void bench_train(void *ctx) {
+  // nn_train_loop reports progress on stdout, keep it out of the results
+  NetCtx *c = ctx;
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  int devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, STDOUT_FILENO);
+  nn_train_loop(c->nn, c->x, c->y, c->tp);
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(devnull);
+  close(saved);
+}
+
+// --------------------------------------------------------------
+
+int parse_list(const char *s, size_t *out, size_t max, char sep) {
+  size_t n = 0;
+  while (*s && n < max) {
+    char *end;
+    out[n++] = strtoul(s, &end, 10);
+    if (end == s) {
+      return 0;
+    }
+    s = *end == sep ? end + 1 : end;
+    if (*end != sep && *end != '\0') {
+      return 0;
+    }
+  }
+  return (int)n;
+}
+
+void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [--gemm MxKxN]... [--net d0,d1,...] [--batch B] "
+          "[--samples N] [--threads T] [--warmup W] [--repeat R] "
+          "[--format text|csv|json]\n",
+          prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  BenchParams p = {
+      .layer_dims = {512, 1024, 1024, 10},
+      .n_layers = 4,
+      .batch = 256,
+      .samples = 4096,
+      .threads = 1,
+      .warmup = 2,
+      .repeat = 10,
+      .format = FMT_TEXT,
+  };
+
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+    }
+    const char *val = argv[++i];
+    if (strcmp(arg, "--gemm") == 0) {
+      if (p.n_gemms >= MAX_GEMMS ||
+          parse_list(val, p.gemms[p.n_gemms], 3, 'x') != 3) {
+        usage(argv[0]);
+      }
+      p.n_gemms++;
+    } else if (strcmp(arg, "--net") == 0) {
+      int n = parse_list(val, p.layer_dims, MAX_LAYERS, ',');
+      if (n < 2) {
+        usage(argv[0]);
+      }
+      p.n_layers = n;
+    } else if (strcmp(arg, "--batch") == 0) {
+      p.batch = strtoul(val, NULL, 10);
+    } else if (strcmp(arg, "--samples") == 0) {
+      p.samples = strtoul(val, NULL, 10);
+    } else if (strcmp(arg, "--threads") == 0) {
+      p.threads = strtoul(val, NULL, 10);
+    } else if (strcmp(arg, "--warmup") == 0) {
+      p.warmup = strtoul(val, NULL, 10);
+    } else if (strcmp(arg, "--repeat") == 0) {
+      p.repeat = strtoul(val, NULL, 10);
+    } else if (strcmp(arg, "--format") == 0) {
+      if (strcmp(val, "text") == 0) {
+        p.format = FMT_TEXT;
+      } else if (strcmp(val, "csv") == 0) {
+        p.format = FMT_CSV;
+      } else if (strcmp(val, "json") == 0) {
+        p.format = FMT_JSON;
+      } else {
+        usage(argv[0]);
+      }
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (p.n_gemms == 0) {
+    const size_t defaults[][3] = {{256, 256, 256}, {512, 512, 512},
+                                  {1024, 1024, 1024}, {256, 4096, 4096}};
+    p.n_gemms = ARRAY_LEN(defaults);
+    memcpy(p.gemms, defaults, sizeof(defaults));
+  }
+  if (p.repeat == 0 || p.batch == 0 || p.samples < p.batch) {
+    usage(argv[0]);
+  }
+
+  nn_seed(0);
+  int first = 1;
+  print_header(p.format);
+
+  // mat_mul_mat
+  for (size_t g = 0; g < p.n_gemms; ++g) {
+    size_t m = p.gemms[g][0], k = p.gemms[g][1], n = p.gemms[g][2];
+    GemmCtx c = {mat_alloc(m, n), mat_alloc(m, k), mat_alloc(k, n)};
+    mat_rand(c.a, -1, 1);
+    mat_rand(c.b, -1, 1);
+    BenchResult r = {.name = "mat_mul_mat", .flops = 2.0 * m * n * k};
+    snprintf(r.shape, sizeof(r.shape), "%zux%zux%zu", m, k, n);
+    bench_run(bench_gemm, &c, p, &r);
+    print_result(p.format, r, first);
+    first = 0;
+    mat_free(c.dst);
+    mat_free(c.a);
+    mat_free(c.b);
+  }
+
+  // network benchmarks
+  double macs = 0; // multiply-adds per sample and forward pass
+  const double first_macs = (double)p.layer_dims[0] * p.layer_dims[1];
+  char net_shape[128] = "";
+  for (size_t l = 0; l < p.n_layers; ++l) {
+    size_t len = strlen(net_shape);
+    snprintf(net_shape + len, sizeof(net_shape) - len, l ? "-%zu" : "%zu",
+             p.layer_dims[l]);
+    if (l > 0) {
+      macs += (double)p.layer_dims[l - 1] * p.layer_dims[l];
+    }
+  }
+  const size_t dim_in = p.layer_dims[0];
+  const size_t dim_out = p.layer_dims[p.n_layers - 1];
+  Matrix data = mat_alloc(p.samples, dim_in + dim_out);
+  mat_rand(data, 0, 1);
+  NetCtx c = {
+      .nn = nn_create(p.layer_dims, p.n_layers, RELU, SIGMOID),
+      .x = {p.samples, dim_in, dim_in + dim_out, data.p_data},
+      .y = {p.samples, dim_out, dim_in + dim_out, data.p_data + dim_in},
+      .batch = p.batch,
+      .tp = {.lr = 1e-3,
+             .epochs = 1,
+             .batch_size = p.batch,
+             .gd_type = BGD,
+             .n_threads = p.threads},
+  };
+  nn_rand(c.nn, -0.05, 0.05);
+  nn_reserve_batch(c.nn, p.batch);
+  c.y_pred = mat_alloc(p.batch, dim_out);
+
+  BenchResult r = {.name = "nn_forward_batch",
+                   .flops = 2.0 * macs * p.batch,
+                   .samples = p.batch};
+  snprintf(r.shape, sizeof(r.shape), "%s/b%zu", net_shape, p.batch);
+  bench_run(bench_forward, &c, p, &r);
+  print_result(p.format, r, first);
+  first = 0;
+
+  // nn_predict with float, 16-bit and int8 weights
+  float a_max[MAX_LAYERS] = {0};
+  nn_calibrate(c.nn, mat_rows(c.x, 0, p.batch), a_max);
+  NN_Infer models[] = {nn_infer_create(c.nn), nn_infer_convert(c.nn, NN_F16),
+                       nn_infer_convert(c.nn, NN_BF16),
+                       nn_quantize(c.nn, a_max)};
+  const char *names[] = {"nn_predict", "nn_predict_f16", "nn_predict_bf16",
+                         "nn_predict_i8"};
+  for (size_t i = 0; i < ARRAY_LEN(models); ++i) {
+    // a context is sized for the model it was created for
+    c.infer = models[i];
+    c.infer_ctx = nn_infer_ctx_create(models[i], p.batch);
+    r = (BenchResult){
+        .name = names[i], .flops = 2.0 * macs * p.batch, .samples = p.batch};
+    snprintf(r.shape, sizeof(r.shape), "%s/b%zu", net_shape, p.batch);
+    bench_run(bench_predict, &c, p, &r);
+    print_result(p.format, r, first);
+    nn_infer_ctx_free(c.infer_ctx);
+    nn_infer_free(models[i]);
+  }
+
+  // dW and E_prev are one GEMM each (E_prev skipped for the first layer)
+  const double backprop_macs = 2.0 * macs - first_macs;
+  r = (BenchResult){.name = "nn_backprop_batch",
+                    .flops = 2.0 * backprop_macs * p.batch,
+                    .samples = p.batch};
+  snprintf(r.shape, sizeof(r.shape), "%s/b%zu", net_shape, p.batch);
+  bench_run(bench_backprop, &c, p, &r);
+  print_result(p.format, r, first);
+
+  // forward + backprop + update over one epoch
+  r = (BenchResult){.name = "nn_train_loop",
+                    .flops = 2.0 * (macs + backprop_macs) *
+                             (p.samples / p.batch * p.batch),
+                    .samples = p.samples / p.batch * p.batch};
+  snprintf(r.shape, sizeof(r.shape), "%s/b%zu/t%zu", net_shape, p.batch,
+           p.threads);
+  bench_run(bench_train, &c, p, &r);
+  print_result(p.format, r, first);
+
+  print_footer(p.format);
+  nn_free(c.nn);
+  mat_free(c.y_pred);
+  mat_free(data);
+  return 0;
+}
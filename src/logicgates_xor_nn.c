@@ -43,8 +43,8 @@ const size_t N_SAMPLES = sizeof(TRAIN_OR) / sizeof(TRAIN_OR[0]) / STRIDE;
 
 int main(void) {
   // set random seed
-  // srand(time(0));
-  srand(0);
+  // nn_seed(time(0));
+  nn_seed(0);
 
   // setup training data
   float *training_data = TRAIN_XOR;
@@ -101,6 +101,7 @@ int main(void) {
 
   NN_PRINT_WEIGHTS(nn);
   nn_save(nn, "xor.model");
+  nn_free(nn);
 
   return 0;
 }
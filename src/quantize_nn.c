@@ -0,0 +1,148 @@
+/*
+Post-training quantization of a model written by nn_save.
+
+Usage: quantize_nn MODEL CALIB OUT [options]
+  --dtype T      i8 (default), f16 or bf16
+  --csv          CALIB is CSV (default: raw float32 records)
+  --y-cols N     target columns after the inputs of each CALIB record
+  --rows N       use at most N records of CALIB (default: all)
+
+For i8 the layer input ranges are calibrated on the CALIB records and the
+weights are quantized per output channel; f16 and bf16 round the weights.
+The model is written to OUT and compared with the float model on the
+CALIB records.
+*/
+
+#define NN_IMPLEMENTATION
+#include "../nn.h"
+
+#include <stdlib.h>
+
+#define CHUNK_ROWS 1024
+
+void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s MODEL CALIB OUT [--dtype i8|f16|bf16] [--csv] "
+          "[--y-cols N] [--rows N]\n",
+          prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 4) {
+    usage(argv[0]);
+  }
+  const char *model_path = argv[1];
+  const char *calib_path = argv[2];
+  const char *out_path = argv[3];
+  NN_DType dtype = NN_I8;
+  DS_Format format = DS_BINARY;
+  size_t y_cols = 0;
+  size_t max_rows = SIZE_MAX;
+  for (int i = 4; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (strcmp(arg, "--csv") == 0) {
+      format = DS_CSV;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+    }
+    const char *val = argv[++i];
+    if (strcmp(arg, "--dtype") == 0) {
+      if (strcmp(val, "i8") == 0) {
+        dtype = NN_I8;
+      } else if (strcmp(val, "f16") == 0) {
+        dtype = NN_F16;
+      } else if (strcmp(val, "bf16") == 0) {
+        dtype = NN_BF16;
+      } else {
+        usage(argv[0]);
+      }
+    } else if (strcmp(arg, "--y-cols") == 0) {
+      y_cols = strtoul(val, NULL, 10);
+    } else if (strcmp(arg, "--rows") == 0) {
+      max_rows = strtoul(val, NULL, 10);
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  NN nn = nn_load(model_path);
+  nn_reserve_batch(nn, CHUNK_ROWS);
+  const size_t dim_in = NN_X_IN(nn).num_cols;
+  const size_t dim_out = NN_Y_OUT(nn).num_cols;
+  DataStream *ds = ds_open(calib_path, format, dim_in, y_cols, CHUNK_ROWS);
+  if (ds == NULL) {
+    return 1;
+  }
+
+  // calibrate (only i8 needs it, but all count the records)
+  float a_max[nn.n_layers - 1];
+  memset(a_max, 0, sizeof(a_max));
+  size_t rows = 0;
+  Matrix x, y;
+  while (rows < max_rows && ds_next_chunk(ds, &x, &y) > 0) {
+    x = mat_rows(x, 0, x.num_rows < max_rows - rows ? x.num_rows
+                                                     : max_rows - rows);
+    if (dtype == NN_I8) {
+      nn_calibrate(nn, x, a_max);
+    }
+    rows += x.num_rows;
+  }
+  if (rows < max_rows && ds_error(ds)) { // ended at a bad record
+    fprintf(stderr, "ERROR: bad record in %s\n", calib_path);
+    ds_close(ds);
+    nn_free(nn);
+    return 1;
+  }
+  NN_ASSERT(rows > 0 && "ERROR: no calibration records");
+  if (dtype == NN_I8) {
+    printf("calibrated on %zu records\n", rows);
+    for (size_t l = 0; l < nn.n_layers - 1; ++l) {
+      printf("  layer %zu: max |input| = %f\n", l + 1, a_max[l]);
+    }
+  }
+
+  NN_Infer q =
+      dtype == NN_I8 ? nn_quantize(nn, a_max) : nn_infer_convert(nn, dtype);
+  nn_infer_save(q, out_path);
+
+  // compare the quantized with the float model
+  NN_Infer f = nn_infer_create(nn);
+  NN_InferCtx ctx = nn_infer_ctx_create(q, CHUNK_ROWS);
+  Matrix y_f = mat_alloc(CHUNK_ROWS, dim_out);
+  Matrix y_q = mat_alloc(CHUNK_ROWS, dim_out);
+  double err_sum = 0;
+  float err_max = 0;
+  size_t n_eval = 0;
+  ds_rewind(ds);
+  while (n_eval < rows && ds_next_chunk(ds, &x, &y) > 0) {
+    const size_t n =
+        x.num_rows < rows - n_eval ? x.num_rows : rows - n_eval;
+    nn_predict(f, ctx, mat_rows(x, 0, n), mat_rows(y_f, 0, n));
+    nn_predict(q, ctx, mat_rows(x, 0, n), mat_rows(y_q, 0, n));
+    for (size_t r = 0; r < n; ++r) {
+      for (size_t j = 0; j < dim_out; ++j) {
+        float err = fabsf(MAT_AT(y_f, r, j) - MAT_AT(y_q, r, j));
+        err_sum += err;
+        err_max = err > err_max ? err : err_max;
+      }
+    }
+    n_eval += n;
+  }
+  printf("wrote %s (%zu bytes of weights, float: %zu)\n", out_path,
+         q.data_size, f.data_size);
+  printf("quantized vs float outputs on %zu records: mean |err| = %g, "
+         "max |err| = %g\n",
+         n_eval, err_sum / (n_eval * dim_out), err_max);
+
+  mat_free(y_f);
+  mat_free(y_q);
+  nn_infer_ctx_free(ctx);
+  nn_infer_free(f);
+  nn_infer_free(q);
+  ds_close(ds);
+  nn_free(nn);
+  return 0;
+}
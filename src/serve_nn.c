@@ -0,0 +1,387 @@
+/*
+Local inference server for models written by nn_save.
+
+Usage: serve_nn MODEL [options]
+  --socket PATH      Unix domain socket to listen on (default nn.sock)
+  --max-batch B      largest batch of requests per forward pass
+  --deadline-us U    longest time the oldest request waits for a batch
+
+Protocol, on a stream socket:
+  on connect the server sends  uint32 dim_in, uint32 dim_out
+  a request is                 dim_in float32 values
+  its response is              dim_out float32 values
+A client may pipeline requests; responses come back in request order.
+Sockets are non-blocking: responses a client does not read yet are queued,
+and a client with more than OUT_HIGH queued bytes is not read from until it
+catches up, so a slow reader never stalls the others.
+
+Requests from all clients are collected into one batch until it holds
+max_batch requests or the oldest request has waited deadline_us, then the
+batch is forwarded with a single nn_predict and the rows are sent back to
+their clients.
+*/
+
+#define _GNU_SOURCE // ppoll
+#define NN_IMPLEMENTATION
+#include "../nn.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+#define MAX_CLIENTS 256
+#define READ_SIZE 65536
+#define OUT_HIGH 65536 // queued response bytes that pause reading
+
+typedef struct {
+  int fd;             // -1 = free slot
+  unsigned char *in;  // partial request, dim_in floats
+  size_t in_len;      // bytes of the partial request
+  unsigned char *out; // responses not sent yet, out_cap bytes
+  size_t out_len;
+} Client;
+
+typedef struct {
+  NN_Infer model;
+  NN_InferCtx ctx;
+  size_t dim_in;
+  size_t dim_out;
+  size_t max_batch;
+  double deadline_s;
+  size_t out_cap; // queue size that reading pauses keep a client within
+
+  Client clients[MAX_CLIENTS];
+  Matrix x;       // max_batch x dim_in, the pending requests
+  Matrix y;       // max_batch x dim_out
+  int *owners;    // client slot of each pending request, -1 = gone
+  size_t pending; // rows of x in use
+  double oldest;  // arrival time of x row 0
+
+  size_t n_requests;
+  size_t n_batches;
+} Server;
+
+static volatile sig_atomic_t stop = 0;
+
+void on_signal(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// send as much of buf as the socket takes without blocking; the number of
+// bytes sent, -1 if the client is gone
+ssize_t send_some(int fd, const void *buf, size_t n) {
+  const char *p = buf;
+  size_t sent = 0;
+  while (sent < n) {
+    ssize_t k = send(fd, p + sent, n - sent, MSG_NOSIGNAL);
+    if (k < 0 && errno == EINTR) {
+      continue;
+    }
+    if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (k <= 0) {
+      return -1;
+    }
+    sent += k;
+  }
+  return sent;
+}
+
+void client_close(Server *s, size_t slot) {
+  close(s->clients[slot].fd);
+  s->clients[slot].fd = -1;
+  s->clients[slot].in_len = 0;
+  s->clients[slot].out_len = 0;
+  // its pending requests are still forwarded, but nobody gets the result
+  for (size_t r = 0; r < s->pending; ++r) {
+    if (s->owners[r] == (int)slot) {
+      s->owners[r] = -1;
+    }
+  }
+}
+
+// send what is queued for the client, 0 if it is still connected
+int client_flush(Server *s, size_t slot) {
+  Client *c = &s->clients[slot];
+  ssize_t k = send_some(c->fd, c->out, c->out_len);
+  if (k < 0) {
+    client_close(s, slot);
+    return -1;
+  }
+  memmove(c->out, c->out + k, c->out_len - k);
+  c->out_len -= k;
+  return 0;
+}
+
+// send buf to the client, queueing what the socket does not take now
+int client_send(Server *s, size_t slot, const void *buf, size_t n) {
+  Client *c = &s->clients[slot];
+  size_t sent = 0;
+  if (c->out_len == 0) {
+    ssize_t k = send_some(c->fd, buf, n);
+    if (k < 0) {
+      client_close(s, slot);
+      return -1;
+    }
+    sent = k;
+  }
+  NN_ASSERT(c->out_len + n - sent <= s->out_cap);
+  memcpy(c->out + c->out_len, (const char *)buf + sent, n - sent);
+  c->out_len += n - sent;
+  return 0;
+}
+
+// forward all pending requests in one pass and send back the results
+void flush_batch(Server *s) {
+  if (s->pending == 0) {
+    return;
+  }
+  nn_predict(s->model, s->ctx, mat_rows(s->x, 0, s->pending),
+             mat_rows(s->y, 0, s->pending));
+  for (size_t r = 0; r < s->pending; ++r) {
+    int slot = s->owners[r];
+    if (slot < 0) {
+      continue;
+    }
+    // a closed client's other rows are marked -1 by client_close
+    client_send(s, slot, &MAT_AT(s->y, r, 0), s->dim_out * sizeof(float));
+  }
+  s->n_requests += s->pending;
+  s->n_batches += 1;
+  s->pending = 0;
+}
+
+void push_request(Server *s, size_t slot, const unsigned char *data) {
+  if (s->pending == 0) {
+    s->oldest = now_s();
+  }
+  memcpy(&MAT_AT(s->x, s->pending, 0), data, s->dim_in * sizeof(float));
+  s->owners[s->pending] = slot;
+  s->pending += 1;
+  if (s->pending == s->max_batch) {
+    flush_batch(s);
+  }
+}
+
+// read what the client sent and queue every complete request
+void client_read(Server *s, size_t slot) {
+  static unsigned char buf[READ_SIZE];
+  Client *c = &s->clients[slot];
+  const size_t frame = s->dim_in * sizeof(float);
+
+  ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return;
+  }
+  if (n <= 0) {
+    client_close(s, slot);
+    return;
+  }
+
+  const unsigned char *p = buf;
+  while (n > 0 && c->fd >= 0) {
+    if (c->in_len == 0 && (size_t)n >= frame) {
+      // whole request in buf, no copy through c->in
+      push_request(s, slot, p);
+      p += frame;
+      n -= frame;
+      continue;
+    }
+    size_t k = frame - c->in_len < (size_t)n ? frame - c->in_len : (size_t)n;
+    memcpy(c->in + c->in_len, p, k);
+    c->in_len += k;
+    p += k;
+    n -= k;
+    if (c->in_len == frame) {
+      c->in_len = 0;
+      push_request(s, slot, c->in);
+    }
+  }
+}
+
+void client_accept(Server *s, int listen_fd) {
+  int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+  if (fd < 0) {
+    return;
+  }
+  for (size_t i = 0; i < MAX_CLIENTS; ++i) {
+    if (s->clients[i].fd < 0) {
+      s->clients[i].fd = fd;
+      s->clients[i].in_len = 0;
+      s->clients[i].out_len = 0;
+      uint32_t dims[2] = {s->dim_in, s->dim_out};
+      client_send(s, i, dims, sizeof(dims));
+      return;
+    }
+  }
+  close(fd); // full
+}
+
+int listen_unix(const char *path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  NN_ASSERT(fd >= 0 && "ERROR: socket");
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  NN_ASSERT(strlen(path) < sizeof(addr.sun_path) && "ERROR: socket path");
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 64) != 0) {
+    fprintf(stderr, "ERROR: listen on %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  return fd;
+}
+
+void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s MODEL [--socket PATH] [--max-batch B] "
+          "[--deadline-us U]\n",
+          prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage(argv[0]);
+  }
+  const char *model_path = argv[1];
+  const char *socket_path = "nn.sock";
+  size_t max_batch = 64;
+  size_t deadline_us = 1000;
+  for (int i = 2; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+    }
+    const char *val = argv[++i];
+    if (strcmp(arg, "--socket") == 0) {
+      socket_path = val;
+    } else if (strcmp(arg, "--max-batch") == 0) {
+      max_batch = strtoul(val, NULL, 10);
+    } else if (strcmp(arg, "--deadline-us") == 0) {
+      deadline_us = strtoul(val, NULL, 10);
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (max_batch == 0) {
+    usage(argv[0]);
+  }
+
+  Server s = {0};
+  s.model = nn_infer_mmap(model_path);
+  s.ctx = nn_infer_ctx_create(s.model, max_batch);
+  s.dim_in = s.model.weights[1].num_rows;
+  s.dim_out = s.model.biases[s.model.n_layers - 1].num_cols;
+  s.max_batch = max_batch;
+  s.deadline_s = deadline_us * 1e-6;
+  s.x = mat_alloc(max_batch, s.dim_in);
+  s.y = mat_alloc(max_batch, s.dim_out);
+  s.owners = NN_MALLOC(max_batch * sizeof(*s.owners));
+  NN_ASSERT(s.owners != NULL);
+  // below OUT_HIGH a client may send one more read of requests, and its
+  // requests in the batch are answered even after reading paused
+  s.out_cap = OUT_HIGH + sizeof(uint32_t[2]) +
+              (READ_SIZE / (s.dim_in * sizeof(float)) + 1 + max_batch) *
+                  s.dim_out * sizeof(float);
+  for (size_t i = 0; i < MAX_CLIENTS; ++i) {
+    s.clients[i].fd = -1;
+    s.clients[i].in = NN_MALLOC(s.dim_in * sizeof(float));
+    s.clients[i].out = NN_MALLOC(s.out_cap);
+    NN_ASSERT(s.clients[i].in != NULL && s.clients[i].out != NULL);
+  }
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  int listen_fd = listen_unix(socket_path);
+  printf("serving %s (%zu -> %zu) on %s, max batch %zu, deadline %zu us\n",
+         model_path, s.dim_in, s.dim_out, socket_path, max_batch,
+         deadline_us);
+  fflush(stdout);
+
+  struct pollfd fds[MAX_CLIENTS + 1];
+  size_t slots[MAX_CLIENTS + 1];
+  while (!stop) {
+    size_t n_fds = 0;
+    fds[n_fds++] = (struct pollfd){.fd = listen_fd, .events = POLLIN};
+    for (size_t i = 0; i < MAX_CLIENTS; ++i) {
+      const Client *c = &s.clients[i];
+      if (c->fd >= 0) {
+        // a client with a backlog of responses is not read from until it
+        // takes them
+        short events = c->out_len < OUT_HIGH ? POLLIN : 0;
+        events |= c->out_len > 0 ? POLLOUT : 0;
+        slots[n_fds] = i;
+        fds[n_fds++] = (struct pollfd){.fd = c->fd, .events = events};
+      }
+    }
+
+    // sleep until there is input or the oldest pending request is due
+    struct timespec timeout = {0};
+    if (s.pending > 0) {
+      double left = s.oldest + s.deadline_s - now_s();
+      left = left > 0 ? left : 0;
+      timeout.tv_sec = (time_t)left;
+      timeout.tv_nsec = (long)((left - timeout.tv_sec) * 1e9);
+    }
+    int ready = ppoll(fds, n_fds, s.pending > 0 ? &timeout : NULL, NULL);
+    if (ready < 0 && errno != EINTR) {
+      fprintf(stderr, "ERROR: poll\n");
+      break;
+    }
+
+    if (ready > 0) {
+      if (fds[0].revents & POLLIN) {
+        client_accept(&s, listen_fd);
+      }
+      for (size_t i = 1; i < n_fds; ++i) {
+        const size_t slot = slots[i];
+        if ((fds[i].revents & POLLOUT) && client_flush(&s, slot) != 0) {
+          continue;
+        }
+        if (s.clients[slot].fd >= 0 &&
+            (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+          client_read(&s, slot);
+        }
+      }
+    }
+
+    if (s.pending > 0 && now_s() - s.oldest >= s.deadline_s) {
+      flush_batch(&s);
+    }
+  }
+
+  flush_batch(&s);
+  printf("served %zu requests in %zu batches (%.1f per batch)\n",
+         s.n_requests, s.n_batches,
+         s.n_batches ? (double)s.n_requests / s.n_batches : 0.0);
+
+  close(listen_fd);
+  unlink(socket_path);
+  for (size_t i = 0; i < MAX_CLIENTS; ++i) {
+    if (s.clients[i].fd >= 0) {
+      close(s.clients[i].fd);
+    }
+    NN_FREE(s.clients[i].in);
+    NN_FREE(s.clients[i].out);
+  }
+  NN_FREE(s.owners);
+  mat_free(s.x);
+  mat_free(s.y);
+  nn_infer_ctx_free(s.ctx);
+  nn_infer_free(s.model);
+  return 0;
+}
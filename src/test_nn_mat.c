@@ -1,5 +1,9 @@
 #define NN_IMPLEMENTATION
-#include "nn.h"
+#include "../nn.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 void test_mat_mul_mat_1() {
   /* [[ 7 10 ] [ 15 22 ]] */
@@ -73,9 +77,1047 @@ void test_mat_mul_mat_4() {
   printf("\n");
 }
 
+float mat_mul_mat_max_err(Matrix dst, Matrix a, Matrix b) {
+  // compare against the textbook triple loop
+  float max_err = 0.f;
+  for (size_t row = 0; row < dst.num_rows; ++row) {
+    for (size_t col = 0; col < dst.num_cols; ++col) {
+      float ref = 0.f;
+      for (size_t i = 0; i < a.num_cols; ++i) {
+        ref += MAT_AT(a, row, i) * MAT_AT(b, i, col);
+      }
+      float err = fabsf(MAT_AT(dst, row, col) - ref);
+      max_err = err > max_err ? err : max_err;
+    }
+  }
+  return max_err;
+}
+
+void test_mat_mul_mat_5() {
+  /* blocked kernel vs reference, shapes not multiple of any tile size */
+  printf("------------------------------\n");
+  printf("Mat mul 203x301 * 301x2061\n");
+  Matrix m1 = mat_alloc(203, 301);
+  Matrix m2 = mat_alloc(301, 2061);
+  mat_rand(m1, -1, 1);
+  mat_rand(m2, -1, 1);
+  Matrix m1xm2 = mat_alloc(203, 2061);
+  mat_mul_mat(m1xm2, m1, m2);
+  float max_err = mat_mul_mat_max_err(m1xm2, m1, m2);
+  printf("max_err=%f\n", max_err);
+  NN_ASSERT(max_err < 1e-3);
+  printf("\n");
+}
+
+void test_mat_mul_mat_6() {
+  /* strided views: every other row of a 10x7 matrix times a 7x3 block */
+  printf("------------------------------\n");
+  printf("Mat mul strided 5x7 * 7x3\n");
+  Matrix m = mat_alloc(10, 7);
+  Matrix n = mat_alloc(7, 9);
+  mat_rand(m, -1, 1);
+  mat_rand(n, -1, 1);
+  Matrix m1 = {.num_rows = 5, .num_cols = 7, .stride = 14, .p_data = m.p_data};
+  Matrix m2 = {.num_rows = 7, .num_cols = 3, .stride = 9, .p_data = n.p_data};
+  Matrix out = mat_alloc(5, 8);
+  Matrix m1xm2 = {.num_rows = 5, .num_cols = 3, .stride = 8, .p_data = out.p_data};
+  mat_mul_mat(m1xm2, m1, m2);
+  MAT_PRINT(m1xm2);
+  float max_err = mat_mul_mat_max_err(m1xm2, m1, m2);
+  printf("max_err=%f\n", max_err);
+  NN_ASSERT(max_err < 1e-5);
+  printf("\n");
+}
+
+int nn_params_equal(NN a, NN b) {
+  if (a.n_layers != b.n_layers || a.n_params != b.n_params) {
+    return 0;
+  }
+  for (size_t l = 0; l < a.n_layers; ++l) {
+    if (a.layers[l].dim != b.layers[l].dim ||
+        a.layers[l].act != b.layers[l].act) {
+      return 0;
+    }
+  }
+  return memcmp(a.params, b.params, a.n_params * sizeof(float)) == 0;
+}
+
+int load_aborts(NN (*load)(const char *), const char *file_path) {
+  // run load in a child, a rejected file fails NN_ASSERT there
+  fflush(stdout);
+  pid_t pid = fork();
+  NN_ASSERT(pid >= 0);
+  if (pid == 0) {
+    freopen("/dev/null", "w", stderr);
+    load(file_path);
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFSIGNALED(status);
+}
+
+NN_ModelHeader read_model_header(const char *file_path) {
+  NN_ModelHeader header;
+  FILE *fp = fopen(file_path, "rb");
+  NN_ASSERT(fp && fread(&header, sizeof(header), 1, fp) == 1);
+  fclose(fp);
+  return header;
+}
+
+void flip_bits(const char *file_path, size_t offset, unsigned char mask) {
+  // xor the byte at offset with mask
+  FILE *fp = fopen(file_path, "r+b");
+  NN_ASSERT(fp);
+  unsigned char byte;
+  fseek(fp, offset, SEEK_SET);
+  NN_ASSERT(fread(&byte, 1, 1, fp) == 1);
+  byte ^= mask;
+  fseek(fp, offset, SEEK_SET);
+  fwrite(&byte, 1, 1, fp);
+  fclose(fp);
+}
+
+void test_nn_save_load() {
+  /* binary model round trip through nn_load and nn_mmap, then corrupted
+     weights are rejected by the checksum */
+  printf("------------------------------\n");
+  printf("Model save, load, mmap 5-7-3\n");
+  const char *file_path = "test_nn_mat.model";
+  size_t dims[] = {5, 7, 3};
+  NN nn = nn_create(dims, 3, RELU, SOFTMAX);
+  nn_rand(nn, -1, 1);
+  nn_save(nn, file_path);
+  NN_ASSERT(access("test_nn_mat.model.tmp", F_OK) != 0); // renamed
+
+  NN loaded = nn_load(file_path);
+  NN_ASSERT(nn_params_equal(nn, loaded));
+  NN mapped = nn_mmap(file_path);
+  NN_ASSERT(nn_params_equal(nn, mapped));
+  nn_free(mapped);
+
+  // one flipped bit, and the sign bits of two floats (a word-wise xor-
+  // multiply hash does not see the second pair)
+  const size_t data_offset = read_model_header(file_path).data_offset;
+  flip_bits(file_path, data_offset + 5, 0x10);
+  NN_ASSERT(load_aborts(nn_load, file_path));
+  NN_ASSERT(load_aborts(nn_mmap, file_path));
+  flip_bits(file_path, data_offset + 5, 0x10);
+  NN_ASSERT(!load_aborts(nn_load, file_path));
+  flip_bits(file_path, data_offset + 1 * sizeof(float) + 3, 0x80);
+  flip_bits(file_path, data_offset + 3 * sizeof(float) + 3, 0x80);
+  NN_ASSERT(load_aborts(nn_load, file_path));
+  NN_ASSERT(load_aborts(nn_mmap, file_path));
+  printf("round trip exact, corrupted file rejected\n");
+
+  remove(file_path);
+  nn_free(loaded);
+  nn_free(nn);
+  printf("\n");
+}
+
+void test_nn_opt_step() {
+  /* two steps of each optimizer on a 1-1 network (one weight, one bias),
+     lr 0.1, weight decay 0.1, against values worked out by hand */
+  printf("------------------------------\n");
+  printf("Optimizer steps\n");
+  const float grads[2][2] = {{0.4f, -0.2f}, {0.2f, 0.6f}}; // sums over n = 2
+  struct {
+    const char *name;
+    OptParams p;
+    float expected[2];
+  } cases[] = {
+      {"sgd", nn_opt_defaults(OPT_SGD), {0.4602500f, -0.2651250f}},
+      {"momentum", nn_opt_defaults(OPT_MOMENTUM), {0.4377500f, -0.2538750f}},
+      {"momentum 0", nn_opt_defaults(OPT_MOMENTUM), {0.4602500f, -0.2651250f}},
+      {"nesterov", nn_opt_defaults(OPT_NESTEROV), {0.4046525f, -0.2688262f}},
+      {"adam", nn_opt_defaults(OPT_ADAM), {0.3051714f, -0.1912503f}},
+      {"adamw", nn_opt_defaults(OPT_ADAMW), {0.2978320f, -0.1954440f}},
+  };
+  cases[2].p.momentum = 0.f; // plain SGD
+  size_t dims[] = {1, 1};
+  NN nn = nn_create(dims, 2, SIGMOID, SIGMOID);
+  for (size_t i = 0; i < ARRAY_LEN(cases); ++i) {
+    cases[i].p.weight_decay = 0.1f;
+    Optimizer opt = nn_opt_create(nn, cases[i].p);
+    MAT_AT(nn.weights[1], 0, 0) = 0.5f;
+    MAT_AT(nn.biases[1], 0, 0) = -0.25f;
+    for (size_t t = 0; t < 2; ++t) {
+      MAT_AT(nn.weight_grads[1], 0, 0) = grads[t][0];
+      MAT_AT(nn.bias_grads[1], 0, 0) = grads[t][1];
+      nn_opt_step(nn, &opt, 0.1f, 2);
+    }
+    const float w = MAT_AT(nn.weights[1], 0, 0);
+    const float b = MAT_AT(nn.biases[1], 0, 0);
+    printf("%-10s w=%f b=%f\n", cases[i].name, w, b);
+    NN_ASSERT(fabsf(w - cases[i].expected[0]) < 1e-6f);
+    NN_ASSERT(fabsf(b - cases[i].expected[1]) < 1e-6f);
+    NN_ASSERT(MAT_AT(nn.weight_grads[1], 0, 0) == 0.f);
+    nn_opt_free(opt);
+  }
+  nn_free(nn);
+  printf("\n");
+}
+
+float nn_predict_max_err(NN_Infer m, NN_Infer ref, Matrix x) {
+  // max |m(x) - ref(x)| over all outputs
+  const size_t n_out = ref.biases[ref.n_layers - 1].num_cols;
+  Matrix y = mat_alloc(x.num_rows, n_out);
+  Matrix y_ref = mat_alloc(x.num_rows, n_out);
+  NN_InferCtx ctx = nn_infer_ctx_create(m, x.num_rows);
+  nn_predict(m, ctx, x, y);
+  nn_infer_ctx_free(ctx);
+  ctx = nn_infer_ctx_create(ref, x.num_rows);
+  nn_predict(ref, ctx, x, y_ref);
+  nn_infer_ctx_free(ctx);
+  float max_err = 0.f;
+  for (size_t r = 0; r < x.num_rows; ++r) {
+    for (size_t j = 0; j < n_out; ++j) {
+      float err = fabsf(MAT_AT(y, r, j) - MAT_AT(y_ref, r, j));
+      max_err = err > max_err ? err : max_err;
+    }
+  }
+  mat_free(y);
+  mat_free(y_ref);
+  return max_err;
+}
+
+void test_nn_predict_i8() {
+  /* int8 model calibrated on the inputs vs the f32 model */
+  printf("------------------------------\n");
+  printf("Predict int8 vs f32 40-33-10\n");
+  size_t dims[] = {40, 33, 10};
+  NN nn = nn_create(dims, 3, LEAKY_RELU, SIGMOID);
+  nn_rand(nn, -1, 1);
+  Matrix x = mat_alloc(50, 40);
+  mat_rand(x, -1, 1);
+  float a_max[2] = {0};
+  nn_calibrate(nn, x, a_max);
+  NN_Infer ref = nn_infer_create(nn);
+  NN_Infer q = nn_quantize(nn, a_max);
+  float max_err = nn_predict_max_err(q, ref, x);
+  printf("max_err=%f\n", max_err);
+  NN_ASSERT(max_err < 5e-2); // of outputs in [0, 1]
+  nn_infer_free(q);
+  nn_infer_free(ref);
+  mat_free(x);
+  nn_free(nn);
+  printf("\n");
+}
+
+void test_nn_predict_f16() {
+  /* 16-bit weights vs the f32 model */
+  printf("------------------------------\n");
+  printf("Predict f16, bf16 vs f32 40-33-10\n");
+  size_t dims[] = {40, 33, 10};
+  NN nn = nn_create(dims, 3, LEAKY_RELU, SIGMOID);
+  nn_rand(nn, -1, 1);
+  Matrix x = mat_alloc(50, 40);
+  mat_rand(x, -1, 1);
+  NN_Infer ref = nn_infer_create(nn);
+  NN_Infer h = nn_infer_convert(nn, NN_F16);
+  NN_Infer bh = nn_infer_convert(nn, NN_BF16);
+  float max_err_f16 = nn_predict_max_err(h, ref, x);
+  float max_err_bf16 = nn_predict_max_err(bh, ref, x);
+  printf("max_err f16=%f bf16=%f\n", max_err_f16, max_err_bf16);
+  NN_ASSERT(max_err_f16 < 1e-3);
+  NN_ASSERT(max_err_bf16 < 1e-2);
+  nn_infer_free(bh);
+  nn_infer_free(h);
+  nn_infer_free(ref);
+  mat_free(x);
+  nn_free(nn);
+  printf("\n");
+}
+
+#ifdef NN_X86_SIMD
+__attribute__((target("avx,f16c"))) uint16_t f32_to_f16_f16c(float f) {
+  return _mm_extract_epi16(
+      _mm_cvtps_ph(_mm_set1_ps(f), _MM_FROUND_TO_NEAREST_INT), 0);
+}
+#endif // NN_X86_SIMD
+
+void test_f16_conversions() {
+  /* the scalar f16 conversions match F16C bit for bit: all 65536 halves
+     widened, and every widened value, its float neighbours and the
+     midpoints to the next half narrowed */
+  printf("------------------------------\n");
+  printf("f16 conversions vs F16C\n");
+#ifdef NN_X86_SIMD
+  if (!__builtin_cpu_supports("f16c") || !__builtin_cpu_supports("avx")) {
+    printf("no F16C, skipped\n\n");
+    return;
+  }
+  const size_t n = 1 << 16;
+  uint16_t *h = malloc(n * sizeof(*h));
+  float *f_scalar = malloc(n * sizeof(*f_scalar));
+  float *f_f16c = malloc(n * sizeof(*f_f16c));
+  NN_ASSERT(h && f_scalar && f_f16c);
+  for (size_t i = 0; i < n; ++i) {
+    h[i] = i;
+  }
+  nn__f16_to_f32_array_scalar(f_scalar, h, n);
+  nn__f16_to_f32_array_f16c(f_f16c, h, n);
+  NN_ASSERT(memcmp(f_scalar, f_f16c, n * sizeof(float)) == 0);
+
+  size_t n_narrowed = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const float f = f_scalar[i];
+    float next = i + 1 < n ? f_scalar[i + 1] : f;
+    const float mid = f + (next - f) / 2;
+    const float probes[] = {f, nextafterf(f, -INFINITY),
+                            nextafterf(f, INFINITY), mid};
+    for (size_t j = 0; j < ARRAY_LEN(probes); ++j) {
+      NN_ASSERT(nn__f32_to_f16(probes[j]) == f32_to_f16_f16c(probes[j]));
+      n_narrowed++;
+    }
+  }
+  printf("65536 widened, %zu narrowed, all equal\n", n_narrowed);
+  free(f_f16c);
+  free(f_scalar);
+  free(h);
+#else
+  printf("no x86 SIMD, skipped\n");
+#endif // NN_X86_SIMD
+  printf("\n");
+}
+
+#define TELEMETRY_SNAPSHOTS 200000
+
+typedef struct {
+  NN nn;
+  NN_Telemetry t;
+} TelemetryPublisher;
+
+void *telemetry_publish_all(void *arg) {
+  // snapshot i has i in every param, as its epoch and as its loss
+  TelemetryPublisher *p = arg;
+  for (size_t i = 1; i <= TELEMETRY_SNAPSHOTS; ++i) {
+    for (size_t j = 0; j < p->nn.n_params; ++j) {
+      p->nn.params[j] = i;
+    }
+    nn_telemetry_publish(p->t, p->nn, i, i);
+  }
+  nn_telemetry_close(p->t);
+  return NULL;
+}
+
+void test_nn_telemetry() {
+  /* a reader polls while the trainer publishes as fast as it can; every
+     snapshot read has to be one whole snapshot, never a mix of two */
+  printf("------------------------------\n");
+  printf("Telemetry %d snapshots 16-32-8\n", TELEMETRY_SNAPSHOTS);
+  size_t dims[] = {16, 32, 8};
+  NN nn = nn_create(dims, 3, RELU, SIGMOID);
+  TelemetryPublisher publisher = {
+      .nn = nn, .t = nn_telemetry_create("/nn_test_telemetry", nn)};
+  NN_ASSERT(publisher.t.shm != NULL);
+  NN_Telemetry t = nn_telemetry_open("/nn_test_telemetry");
+  NN_ASSERT(t.shm != NULL && t.n_layers == 3);
+  NN view = nn_create_layers(t.layers, t.n_layers);
+  pthread_t thread;
+  pthread_create(&thread, NULL, telemetry_publish_all, &publisher);
+
+  uint64_t seq = 0;
+  size_t epoch = 0, last_epoch = 0, n_read = 0;
+  float loss;
+  // the last snapshot stays readable after the publisher closed
+  while (last_epoch < TELEMETRY_SNAPSHOTS) {
+    if (!nn_telemetry_read(t, view, &seq, &epoch, &loss)) {
+      continue;
+    }
+    NN_ASSERT(epoch > last_epoch && loss == (float)epoch);
+    for (size_t j = 0; j < view.n_params; ++j) {
+      NN_ASSERT(view.params[j] == (float)epoch && "torn snapshot");
+    }
+    last_epoch = epoch;
+    n_read++;
+  }
+  pthread_join(thread, NULL);
+  printf("%zu snapshots read, none torn\n", n_read);
+  NN_ASSERT(nn_telemetry_closed(t));
+
+  nn_telemetry_close(t);
+  nn_free(view);
+  nn_free(nn);
+  printf("\n");
+}
+
+void train_test_targets(Matrix x, Matrix y) {
+  // two learnable functions of x for the training tests
+  for (size_t r = 0; r < x.num_rows; ++r) {
+    MAT_AT(y, r, 0) = MAT_AT(x, r, 0) * MAT_AT(x, r, 1) > 0;
+    MAT_AT(y, r, 1) = MAT_AT(x, r, 2) > MAT_AT(x, r, 3);
+  }
+}
+
+NN train_test_net(const float *init_params) {
+  // a 6-8-2 network starting from init_params, or random ones if NULL
+  size_t dims[] = {6, 8, 2};
+  NN nn = nn_create(dims, 3, SIGMOID, SIGMOID);
+  nn_rand(nn, -1, 1);
+  if (init_params) {
+    memcpy(nn.params, init_params, nn.n_params * sizeof(*nn.params));
+  }
+  return nn;
+}
+
+NN load_test_checkpoint(const char *file_path) {
+  // the checkpoint of the 6-8-2 Adam run on 64 samples below
+  NN nn = train_test_net(NULL);
+  size_t sample_map[64];
+  NN_Checkpoint c = {.opt = nn_opt_create(nn, nn_opt_defaults(OPT_ADAM)),
+                     .sample_map = sample_map,
+                     .n_samples = 64};
+  NN_ASSERT(nn_checkpoint_load(file_path, nn, &c) == 0);
+  nn_opt_free(c.opt);
+  return nn;
+}
+
+void test_nn_checkpoint_resume() {
+  /* 10 epochs in one run vs 6 epochs, a checkpoint and a resumed run up
+     to 10 epochs: the final params have to be the same bits. A checkpoint
+     with corrupted optimizer state is rejected */
+  printf("------------------------------\n");
+  printf("Checkpoint and resume 6-8-2\n");
+  const char *file_path = "test_nn_mat.ckpt";
+  Matrix x = mat_alloc(64, 6);
+  Matrix y = mat_alloc(64, 2);
+  mat_rand(x, -1, 1);
+  train_test_targets(x, y);
+  NN nn = train_test_net(NULL);
+  NN resumed = train_test_net(nn.params);
+  TrainParams p = {.lr = 0.05,
+                   .epochs = 10,
+                   .batch_size = 8,
+                   .gd_type = BGD,
+                   .opt = nn_opt_defaults(OPT_ADAM),
+                   .seed = 7};
+  nn_train_loop(nn, x, y, p);
+
+  remove(file_path);
+  p.checkpoint = file_path;
+  p.checkpoint_every = 2;
+  p.epochs = 6;
+  nn_train_loop(resumed, x, y, p);
+  nn_rand(resumed, -1, 1); // the checkpoint has to bring the params back
+  p.epochs = 10;
+  p.resume = 1;
+  nn_train_loop(resumed, x, y, p);
+  NN_ASSERT(nn_params_equal(nn, resumed));
+  printf("resumed params equal\n");
+
+  // the sign bits of the Adam moments m[1] and m[3]
+  NN_ASSERT(!load_aborts(load_test_checkpoint, file_path));
+  const NN_ModelHeader header = read_model_header(file_path);
+  const size_t m_offset = header.data_offset + header.data_size +
+                          sizeof(NN__CheckpointHeader);
+  flip_bits(file_path, m_offset + 1 * sizeof(float) + 3, 0x80);
+  flip_bits(file_path, m_offset + 3 * sizeof(float) + 3, 0x80);
+  NN_ASSERT(load_aborts(load_test_checkpoint, file_path));
+  printf("corrupted checkpoint rejected\n");
+
+  remove(file_path);
+  mat_free(x);
+  mat_free(y);
+  nn_free(resumed);
+  nn_free(nn);
+  printf("\n");
+}
+
+void test_nn_train_threads() {
+  /* data-parallel training on 3 threads vs 1: the same seeded run, only
+     the order of the gradient sums differs */
+  printf("------------------------------\n");
+  printf("Training 1 vs 3 threads 6-8-2\n");
+  Matrix x = mat_alloc(64, 6);
+  Matrix y = mat_alloc(64, 2);
+  mat_rand(x, -1, 1);
+  train_test_targets(x, y);
+  const GD_Type gd_types[] = {BGD, EGD};
+  for (size_t i = 0; i < ARRAY_LEN(gd_types); ++i) {
+    NN nn_1 = train_test_net(NULL);
+    NN nn_3 = train_test_net(nn_1.params);
+    TrainParams p = {.lr = 0.05,
+                     .epochs = 20,
+                     .batch_size = 16, // 6 + 5 + 5 rows per thread
+                     .gd_type = gd_types[i],
+                     .opt = nn_opt_defaults(OPT_ADAM),
+                     .seed = 7,
+                     .n_threads = 1};
+    nn_train_loop(nn_1, x, y, p);
+    p.n_threads = 3;
+    nn_train_loop(nn_3, x, y, p);
+    float max_err = 0.f;
+    for (size_t j = 0; j < nn_1.n_params; ++j) {
+      float err = fabsf(nn_1.params[j] - nn_3.params[j]);
+      max_err = err > max_err ? err : max_err;
+    }
+    printf("%s: max_err=%g\n", gd_types[i] == BGD ? "BGD" : "EGD", max_err);
+    NN_ASSERT(max_err < 1e-5f);
+    nn_free(nn_3);
+    nn_free(nn_1);
+  }
+  mat_free(x);
+  mat_free(y);
+  printf("\n");
+}
+
+void test_nn_early_stop() {
+  /* validating against the inverted targets gets worse as training goes
+     on, so training stops after patience evaluations without improvement
+     and ends with the params of the best one */
+  printf("------------------------------\n");
+  printf("Early stop 6-8-2, patience 3\n");
+  const char *file_path = "test_nn_mat.ckpt";
+  Matrix x = mat_alloc(64, 6);
+  Matrix y = mat_alloc(64, 2);
+  Matrix val_y = mat_alloc(64, 2);
+  mat_rand(x, -1, 1);
+  train_test_targets(x, y);
+  for (size_t r = 0; r < y.num_rows; ++r) {
+    for (size_t j = 0; j < y.num_cols; ++j) {
+      MAT_AT(val_y, r, j) = 1.f - MAT_AT(y, r, j);
+    }
+  }
+  NN nn = train_test_net(NULL);
+  TrainParams p = {.lr = 0.05,
+                   .epochs = 50,
+                   .batch_size = 8,
+                   .gd_type = BGD,
+                   .opt = nn_opt_defaults(OPT_ADAM),
+                   .seed = 7,
+                   .checkpoint = file_path,
+                   .val_x = x,
+                   .val_y = val_y,
+                   .patience = 3,
+                   .keep_best = 1};
+  remove(file_path);
+  nn_train_loop(nn, x, y, p);
+
+  // the checkpoint at the stop has the early stopping state
+  NN loaded = train_test_net(NULL);
+  NN_Checkpoint c = {.opt = nn_opt_create(loaded, p.opt),
+                     .sample_map = malloc(x.num_rows * sizeof(size_t)),
+                     .n_samples = x.num_rows,
+                     .best_params = malloc(nn.n_params * sizeof(float))};
+  NN_ASSERT(nn_checkpoint_load(file_path, loaded, &c) == 0);
+  printf("stopped after %zu epochs, best after %zu\n", c.epoch,
+         c.best_epoch);
+  NN_ASSERT(c.epoch < p.epochs);
+  NN_ASSERT(c.n_worse == p.patience);
+  NN_ASSERT(c.epoch == c.best_epoch + p.patience);
+  NN_ASSERT(memcmp(nn.params, c.best_params,
+                   nn.n_params * sizeof(float)) == 0);
+
+  remove(file_path);
+  free(c.best_params);
+  free(c.sample_map);
+  nn_opt_free(c.opt);
+  mat_free(val_y);
+  mat_free(x);
+  mat_free(y);
+  nn_free(loaded);
+  nn_free(nn);
+  printf("\n");
+}
+
+int floats_close(float a, float ref) {
+  // equal NaN-ness and infinities, else within a few ulp of float exp
+  if (isnan(ref) || isinf(ref)) {
+    return isnan(ref) ? isnan(a) : a == ref;
+  }
+  return fabsf(a - ref) <= 1e-6f + 1e-5f * fabsf(ref);
+}
+
+void test_sigma_kernels() {
+  /* every activation kernel variant the CPU runs vs the scalar sigma and
+     sigma_derivative, on random inputs with NaN, infinities and values past
+     the exp range both in the vector body and the scalar tail */
+  printf("------------------------------\n");
+  printf("Activation kernels vs scalar\n");
+  struct {
+    const char *name;
+    const NN_ActKernel *sigma;
+    const NN_ActKernel *sigma_derivative;
+    int supported;
+  } variants[] = {
+    {"scalar", nn__sigma_kernels_scalar, nn__sigma_derivative_kernels_scalar,
+     1},
+#ifdef NN_X86_SIMD
+    {"sse2", nn__sigma_kernels_sse2, nn__sigma_derivative_kernels_sse2, 1},
+    {"avx2", nn__sigma_kernels_avx2, nn__sigma_derivative_kernels_avx2,
+     __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")},
+    {"avx512", nn__sigma_kernels_avx512, nn__sigma_derivative_kernels_avx512,
+     __builtin_cpu_supports("avx512f")},
+#endif // NN_X86_SIMD
+  };
+  const float specials[] = {NAN,   INFINITY, -INFINITY, 100.f, -100.f,
+                            88.5f, -88.5f,   87.5f,     -87.5f, 0.f};
+  enum { N = 103 }; // not a multiple of any vector width
+  float z[N], e[N], a[N], a_ref[N];
+  for (size_t i = 0; i < N; ++i) {
+    z[i] = rand_float() * 40.f - 20.f;
+    e[i] = rand_float() * 2.f - 1.f;
+  }
+  for (size_t i = 0; i < ARRAY_LEN(specials); ++i) {
+    z[3 * i] = specials[i];
+    z[N - 1 - i] = specials[i];
+  }
+
+  for (size_t v = 0; v < ARRAY_LEN(variants); ++v) {
+    if (!variants[v].supported) {
+      printf("%-7s skipped\n", variants[v].name);
+      continue;
+    }
+    for (Sigma f = IDENTITY; f < SOFTMAX; ++f) {
+      variants[v].sigma[f](a, z, N);
+      for (size_t i = 0; i < N; ++i) {
+        NN_ASSERT(floats_close(a[i], sigma(z[i], f)));
+      }
+      memcpy(a, e, sizeof(a));
+      variants[v].sigma_derivative[f](a, z, N);
+      for (size_t i = 0; i < N; ++i) {
+        NN_ASSERT(floats_close(a[i], e[i] * sigma_derivative(z[i], f)));
+      }
+    }
+
+    // softmax rows: plain, logits near 1000, one -inf and one NaN logit
+    for (size_t row = 0; row < 4; ++row) {
+      float zs[N];
+      for (size_t i = 0; i < N; ++i) {
+        zs[i] = rand_float() * 40.f - 20.f + (row == 1 ? 1000.f : 0.f);
+      }
+      zs[5] = row == 2 ? -INFINITY : row == 3 ? NAN : zs[5];
+      nn__sigma_kernels_scalar[SOFTMAX](a_ref, zs, N);
+      variants[v].sigma[SOFTMAX](a, zs, N);
+      for (size_t i = 0; i < N; ++i) {
+        NN_ASSERT(floats_close(a[i], a_ref[i]));
+      }
+      NN_ASSERT(row != 2 || a[5] == 0.f);
+    }
+    printf("%-7s matches\n", variants[v].name);
+  }
+  printf("\n");
+}
+
+float nn_gradient_max_err(NN nn, Matrix x, Matrix y) {
+  // largest |backprop - central difference| of dLoss/dparam, relative to
+  // the gradient where that is larger than 1, where Loss is the summed
+  // loss of all rows of x that nn_backprop_batch differentiates
+  const size_t n = x.num_rows;
+  const float eps = 1e-3f;
+  memset(nn.grads, 0, nn.n_params * sizeof(*nn.grads));
+  nn_forward_batch(nn, x, y, NULL, n);
+  nn_backprop_batch(nn, y, NULL, n);
+  float max_err = 0.f;
+  for (size_t i = 0; i < nn.n_params; ++i) {
+    const float p = nn.params[i];
+    nn.params[i] = p + eps;
+    const double loss_plus = nn_evaluate(nn, x, y) * n;
+    nn.params[i] = p - eps;
+    const double loss_minus = nn_evaluate(nn, x, y) * n;
+    nn.params[i] = p;
+    const float fd = (loss_plus - loss_minus) / (2 * eps);
+    const float g = nn.grads[i];
+    float err = fabsf(g - fd) / (fabsf(g) > 1.f ? fabsf(g) : 1.f);
+    max_err = err > max_err ? err : max_err;
+  }
+  return max_err;
+}
+
+void test_nn_backprop_gradient() {
+  /* batched backprop vs finite differences, for squared error through
+     sigmoid and identity outputs and cross-entropy through softmax, with
+     mixed hidden activations and a batch of 5 rows */
+  printf("------------------------------\n");
+  printf("Backprop vs finite differences 4-6-5-3, batch 5\n");
+  const Sigma outputs[] = {SIGMOID, IDENTITY, SOFTMAX};
+  const char *names[] = {"sigmoid", "identity", "softmax"};
+  Matrix x = mat_alloc(5, 4);
+  Matrix y = mat_alloc(5, 3);
+  mat_rand(x, -1, 1);
+  for (size_t r = 0; r < y.num_rows; ++r) {
+    for (size_t j = 0; j < y.num_cols; ++j) {
+      MAT_AT(y, r, j) = r % y.num_cols == j; // one-hot, fits softmax too
+    }
+  }
+  for (size_t i = 0; i < ARRAY_LEN(outputs); ++i) {
+    NN_Layer layers[] = {{.dim = 4},
+                         {.dim = 6, .act = SIGMOID},
+                         {.dim = 5, .act = LEAKY_RELU},
+                         {.dim = 3, .act = outputs[i]}};
+    NN nn = nn_create_layers(layers, ARRAY_LEN(layers));
+    nn_rand(nn, -1, 1);
+    nn_reserve_batch(nn, x.num_rows);
+    float max_err = nn_gradient_max_err(nn, x, y);
+    printf("%-8s output: max_err=%f\n", names[i], max_err);
+    NN_ASSERT(max_err < 2e-3);
+    nn_free(nn);
+  }
+  mat_free(x);
+  mat_free(y);
+  printf("\n");
+}
+
+NN create_hidden_softmax(const char *unused) {
+  // for load_aborts: softmax on a hidden layer
+  (void)unused;
+  size_t dims[] = {3, 4, 2};
+  return nn_create(dims, 3, SOFTMAX, SIGMOID);
+}
+
+void test_nn_softmax() {
+  /* softmax of z = [1 2 3] through an identity layer with target [0 0 1]:
+       p = e^z / (e + e^2 + e^3) = [0.0900306 0.2447285 0.6652410]
+       cross-entropy = -log p_3 = 0.4076059, error p - y
+     the same shifted by 1000 (softmax and loss must not overflow), and
+     [1000 0 -1000] with target [0 1 0]: p = [1 0 0], loss 1000 */
+  printf("------------------------------\n");
+  printf("Softmax and cross-entropy\n");
+  size_t dims[] = {3, 3};
+  NN nn = nn_create(dims, 2, IDENTITY, SOFTMAX);
+  mat_fill(nn.weights[1], 0);
+  for (size_t i = 0; i < 3; ++i) {
+    MAT_AT(nn.weights[1], i, i) = 1.f;
+  }
+  mat_fill(nn.biases[1], 0);
+  float x_data[3][3] = {{1, 2, 3}, {1001, 1002, 1003}, {1000, 0, -1000}};
+  float y_data[3][3] = {{0, 0, 1}, {0, 0, 1}, {0, 1, 0}};
+  const float p_expected[3][3] = {{0.0900306f, 0.2447285f, 0.6652410f},
+                                  {0.0900306f, 0.2447285f, 0.6652410f},
+                                  {1.f, 0.f, 0.f}};
+  const float loss_expected[3] = {0.4076059f, 0.4076059f, 1000.f};
+  for (size_t r = 0; r < 3; ++r) {
+    Matrix x = {.num_rows = 1, .num_cols = 3, .stride = 3,
+                .p_data = x_data[r]};
+    Matrix y = {.num_rows = 1, .num_cols = 3, .stride = 3,
+                .p_data = y_data[r]};
+    const float loss = nn_evaluate(nn, x, y);
+    nn_set_error_at_output_layer(nn, y, 0);
+    printf("z=[%g %g %g] p=[%f %f %f] loss=%f\n", x_data[r][0], x_data[r][1],
+           x_data[r][2], MAT_AT(NN_Y_OUT(nn), 0, 0),
+           MAT_AT(NN_Y_OUT(nn), 0, 1), MAT_AT(NN_Y_OUT(nn), 0, 2), loss);
+    NN_ASSERT(fabsf(loss - loss_expected[r]) < 1e-5f * loss_expected[r]);
+    for (size_t j = 0; j < 3; ++j) {
+      const float p = MAT_AT(NN_Y_OUT(nn), 0, j);
+      NN_ASSERT(fabsf(p - p_expected[r][j]) < 1e-6f);
+      NN_ASSERT(MAT_AT(nn.errors[1], 0, j) == p - y_data[r][j]);
+    }
+  }
+  nn_free(nn);
+
+  // softmax is only allowed on the output layer, also in model files
+  NN_ASSERT(load_aborts(create_hidden_softmax, NULL));
+  const char *file_path = "test_nn_mat.model";
+  size_t dims_3[] = {3, 4, 2};
+  nn = nn_create(dims_3, 3, RELU, SOFTMAX);
+  nn_save(nn, file_path);
+  NN_ASSERT(!load_aborts(nn_load, file_path));
+  const size_t sigma_1 =
+      sizeof(NN_ModelHeader) + 3 * sizeof(uint64_t) + 1 * sizeof(uint32_t);
+  flip_bits(file_path, sigma_1, RELU ^ SOFTMAX);
+  NN_ASSERT(load_aborts(nn_load, file_path));
+  printf("softmax on a hidden layer rejected\n");
+  remove(file_path);
+  nn_free(nn);
+  printf("\n");
+}
+
+void test_nn_rng() {
+  printf("------------------------------\n");
+  printf("PRNG streams\n");
+  // splitmix64 of seed 0 fills the state
+  NN_Rng a = nn_rng_seed(0);
+  NN_ASSERT(a.s[0] == 0xe220a8397b1dcdafu && a.s[1] == 0x6e789e6aa1b965f4u &&
+            a.s[2] == 0x06c45d188009454fu && a.s[3] == 0xf88bb8a8724c81ecu);
+
+  // the same seed repeats, another seed does not
+  a = nn_rng_seed(42);
+  NN_Rng b = nn_rng_seed(42);
+  NN_Rng c = nn_rng_seed(43);
+  size_t n_same = 0;
+  for (size_t i = 0; i < 1000; ++i) {
+    uint64_t r = nn_rng_next(&a);
+    NN_ASSERT(r == nn_rng_next(&b));
+    n_same += r == nn_rng_next(&c);
+  }
+  NN_ASSERT(n_same == 0);
+
+  // jumped streams: the jump commutes with a step, and the first draws of
+  // streams 0, 1 and 2 have nothing in common
+  a = nn_rng_seed(42);
+  nn_rng_next(&a);
+  nn_rng_jump(&a);
+  b = nn_rng_stream(42, 1);
+  nn_rng_next(&b);
+  NN_ASSERT(memcmp(a.s, b.s, sizeof(a.s)) == 0);
+  NN_Rng streams[3];
+  uint64_t draws[3][256];
+  for (size_t k = 0; k < 3; ++k) {
+    streams[k] = nn_rng_stream(42, k);
+    for (size_t i = 0; i < 256; ++i) {
+      draws[k][i] = nn_rng_next(&streams[k]);
+    }
+  }
+  for (size_t i = 0; i < 256; ++i) {
+    for (size_t j = 0; j < 256; ++j) {
+      NN_ASSERT(draws[0][i] != draws[1][j] && draws[0][i] != draws[2][j] &&
+                draws[1][i] != draws[2][j]);
+    }
+  }
+
+  // nn_rng_below stays in [0, n) and is about uniform
+  a = nn_rng_seed(7);
+  size_t counts[6] = {0};
+  for (size_t i = 0; i < 60000; ++i) {
+    size_t r = nn_rng_below(&a, 6);
+    NN_ASSERT(r < 6);
+    ++counts[r];
+    NN_ASSERT(nn_rng_below(&a, 1) == 0);
+    float f = nn_rng_float(&a);
+    NN_ASSERT(f >= 0.f && f < 1.f);
+  }
+  for (size_t k = 0; k < 6; ++k) {
+    printf("below(6) == %zu: %zu of 60000\n", k, counts[k]);
+    NN_ASSERT(counts[k] > 9500 && counts[k] < 10500);
+  }
+
+  // for n = 2^63 + 1 the lowest 2^63 - 1 draws are rejected, about every
+  // other one; mirror the draws on a copy to count them
+  const size_t n = ((size_t)1 << 63) + 1;
+  a = nn_rng_seed(7);
+  b = a;
+  size_t n_draws = 0;
+  for (size_t i = 0; i < 1000; ++i) {
+    size_t r = nn_rng_below(&a, n);
+    NN_ASSERT(r < n);
+    uint64_t d;
+    do {
+      d = nn_rng_next(&b);
+      ++n_draws;
+    } while (d < n - 2);
+    NN_ASSERT(r == d % n);
+  }
+  printf("below(2^63 + 1): %zu draws for 1000 values\n", n_draws);
+  NN_ASSERT(n_draws > 1800 && n_draws < 2200);
+  printf("\n");
+}
+
+// stream file_path over 3 epochs and check that each of the n_rows
+// records (value r * 4 + c) arrives once per epoch, in order
+void stream_check(const char *file_path, DS_Format format, size_t n_rows,
+                  size_t chunk_rows) {
+  DataStream *ds = ds_open(file_path, format, 3, 1, chunk_rows);
+  NN_ASSERT(ds != NULL);
+  for (size_t e = 0; e < 3; ++e) {
+    Matrix x, y;
+    size_t n, r = 0;
+    while ((n = ds_next_chunk(ds, &x, &y)) > 0) {
+      NN_ASSERT(n <= chunk_rows);
+      for (size_t i = 0; i < n; ++i, ++r) {
+        for (size_t c = 0; c < 3; ++c) {
+          NN_ASSERT(MAT_AT(x, i, c) == (float)(r * 4 + c));
+        }
+        NN_ASSERT(MAT_AT(y, i, 0) == (float)(r * 4 + 3));
+      }
+    }
+    NN_ASSERT(r == n_rows);
+    NN_ASSERT(ds_error(ds) == 0);
+    ds_rewind(ds);
+  }
+  ds_close(ds);
+}
+
+void test_ds_stream() {
+  printf("------------------------------\n");
+  printf("Streaming binary and CSV 3+1 cols\n");
+  const char *file_path = "test_nn_mat.data";
+  const size_t n_rows = 10;
+  const size_t chunks[] = {1, 3, 4, 10, 16};
+
+  FILE *fp = fopen(file_path, "wb");
+  NN_ASSERT(fp != NULL);
+  for (size_t i = 0; i < n_rows * 4; ++i) {
+    float v = i;
+    fwrite(&v, sizeof(v), 1, fp);
+  }
+  fclose(fp);
+  for (size_t k = 0; k < ARRAY_LEN(chunks); ++k) {
+    stream_check(file_path, DS_BINARY, n_rows, chunks[k]);
+  }
+
+  fp = fopen(file_path, "w");
+  NN_ASSERT(fp != NULL);
+  fprintf(fp, "x0,x1,x2,y\n");
+  for (size_t r = 0; r < n_rows; ++r) {
+    fprintf(fp, "%zu, %zu,%zu,%zu\n\n", r * 4, r * 4 + 1, r * 4 + 2,
+            r * 4 + 3);
+  }
+  fclose(fp);
+  for (size_t k = 0; k < ARRAY_LEN(chunks); ++k) {
+    stream_check(file_path, DS_CSV, n_rows, chunks[k]);
+  }
+  printf("%zu rows in chunks of 1, 3, 4, 10, 16: ok\n", n_rows);
+
+  // a short record ends the stream with its line, also after a rewind
+  fp = fopen(file_path, "w");
+  NN_ASSERT(fp != NULL);
+  fprintf(fp, "x0,x1,x2,y\n0,1,2,3\n4,5,6,7\n8,9,10,11\n12,13\n");
+  fprintf(fp, "16,17,18,19\n");
+  fclose(fp);
+  DataStream *ds = ds_open(file_path, DS_CSV, 3, 1, 2);
+  NN_ASSERT(ds != NULL);
+  Matrix x, y;
+  size_t n, rows = 0;
+  while ((n = ds_next_chunk(ds, &x, &y)) > 0) {
+    rows += n;
+  }
+  printf("bad record: %zu rows, ds_error=%zu\n", rows, ds_error(ds));
+  NN_ASSERT(rows == 3 && ds_error(ds) == 5);
+  ds_rewind(ds);
+  NN_ASSERT(ds_next_chunk(ds, &x, &y) == 0 && ds_error(ds) == 5);
+  ds_close(ds);
+
+  remove(file_path);
+  printf("\n");
+}
+
+// connect to the server socket, retrying while it starts up
+int serve_connect(const char *socket_path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strcpy(addr.sun_path, socket_path);
+  for (int tries = 0; tries < 500; ++tries) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    NN_ASSERT(fd >= 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      return fd;
+    }
+    close(fd);
+    usleep(10000);
+  }
+  NN_ASSERT(0 && "ERROR: serve_nn did not start");
+  return -1;
+}
+
+void send_all(int fd, const void *buf, size_t n) {
+  for (size_t k = 0; k < n;) {
+    ssize_t r = send(fd, (const char *)buf + k, n - k, MSG_NOSIGNAL);
+    NN_ASSERT(r > 0);
+    k += r;
+  }
+}
+
+void recv_all(int fd, void *buf, size_t n) {
+  for (size_t k = 0; k < n;) {
+    ssize_t r = recv(fd, (char *)buf + k, n - k, 0);
+    NN_ASSERT(r > 0);
+    k += r;
+  }
+}
+
+// receive the responses to y_ref.num_rows requests, max |y - y_ref|
+float recv_max_err(int fd, Matrix y_ref) {
+  Matrix y = mat_alloc(y_ref.num_rows, y_ref.num_cols);
+  recv_all(fd, y.p_data, y.num_rows * y.num_cols * sizeof(float));
+  float max_err = 0.f;
+  for (size_t r = 0; r < y.num_rows; ++r) {
+    for (size_t j = 0; j < y.num_cols; ++j) {
+      float err = fabsf(MAT_AT(y, r, j) - MAT_AT(y_ref, r, j));
+      max_err = err > max_err ? err : max_err;
+    }
+  }
+  mat_free(y);
+  return max_err;
+}
+
+void test_serve_nn() {
+  /* build/serve_nn (or $SERVE_NN) on a temp socket: two clients pipeline
+     requests while a third leaves with requests in the batch */
+  printf("------------------------------\n");
+  printf("serve_nn two clients 5-16-3\n");
+  const char *serve_path = getenv("SERVE_NN") ? getenv("SERVE_NN")
+                                              : "build/serve_nn";
+  NN_ASSERT(access(serve_path, X_OK) == 0 && "ERROR: build serve_nn first");
+  const char *model_path = "test_nn_mat.model";
+  char socket_path[64];
+  snprintf(socket_path, sizeof(socket_path), "/tmp/test_nn_mat.%d.sock",
+           (int)getpid());
+
+  size_t dims[] = {5, 16, 3};
+  NN nn = nn_create(dims, 3, RELU, SIGMOID);
+  nn_rand(nn, -1, 1);
+  nn_save(nn, model_path);
+  Matrix x_a = mat_alloc(200, 5);
+  Matrix x_b = mat_alloc(150, 5);
+  mat_rand(x_a, -1, 1);
+  mat_rand(x_b, -1, 1);
+  Matrix y_a = mat_alloc(200, 3);
+  Matrix y_b = mat_alloc(150, 3);
+  NN_Infer f = nn_infer_create(nn);
+  NN_InferCtx ctx = nn_infer_ctx_create(f, 200);
+  nn_predict(f, ctx, x_a, y_a);
+  nn_predict(f, ctx, x_b, y_b);
+
+  pid_t pid = fork();
+  NN_ASSERT(pid >= 0);
+  if (pid == 0) {
+    freopen("/dev/null", "w", stdout);
+    execl(serve_path, serve_path, model_path, "--socket", socket_path,
+          "--max-batch", "16", "--deadline-us", "20000", (char *)NULL);
+    _exit(127);
+  }
+
+  // dims handshake
+  int fds[3];
+  for (size_t k = 0; k < 3; ++k) {
+    fds[k] = serve_connect(socket_path);
+    uint32_t d[2];
+    recv_all(fds[k], d, sizeof(d));
+    NN_ASSERT(d[0] == 5 && d[1] == 3);
+  }
+
+  // client 2 sends 7.5 requests and leaves before the batch is due; the
+  // others pipeline theirs around it
+  const size_t row_size = 5 * sizeof(float);
+  send_all(fds[0], x_a.p_data, 100 * row_size);
+  send_all(fds[2], x_b.p_data, 7 * row_size + row_size / 2);
+  close(fds[2]);
+  send_all(fds[1], x_b.p_data, 150 * row_size);
+  send_all(fds[0], &MAT_AT(x_a, 100, 0), 100 * row_size);
+  float max_err_a = recv_max_err(fds[0], y_a);
+  float max_err_b = recv_max_err(fds[1], y_b);
+
+  // and one more round trip each
+  send_all(fds[0], &MAT_AT(x_a, 7, 0), row_size);
+  send_all(fds[1], &MAT_AT(x_b, 9, 0), row_size);
+  max_err_a = fmaxf(max_err_a, recv_max_err(fds[0], mat_rows(y_a, 7, 1)));
+  max_err_b = fmaxf(max_err_b, recv_max_err(fds[1], mat_rows(y_b, 9, 1)));
+  printf("max_err a=%g b=%g\n", max_err_a, max_err_b);
+  NN_ASSERT(max_err_a < 1e-5f && max_err_b < 1e-5f);
+
+  close(fds[0]);
+  close(fds[1]);
+  kill(pid, SIGTERM);
+  int status;
+  waitpid(pid, &status, 0);
+  NN_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  NN_ASSERT(access(socket_path, F_OK) != 0);
+
+  mat_free(x_a);
+  mat_free(x_b);
+  mat_free(y_a);
+  mat_free(y_b);
+  nn_infer_ctx_free(ctx);
+  nn_infer_free(f);
+  nn_free(nn);
+  remove(model_path);
+  printf("\n");
+}
+
 int main(void) {
 
-  srand(1);
+  nn_seed(1);
 
   // alloc 1x1;fill;print
   Matrix m_1_1 = mat_alloc(1, 1);
@@ -139,6 +1181,23 @@ int main(void) {
   test_mat_mul_mat_2();
   test_mat_mul_mat_3();
   test_mat_mul_mat_4();
+  test_mat_mul_mat_5();
+  test_mat_mul_mat_6();
+  test_nn_save_load();
+  test_nn_opt_step();
+  test_nn_predict_i8();
+  test_nn_predict_f16();
+  test_f16_conversions();
+  test_sigma_kernels();
+  test_nn_backprop_gradient();
+  test_nn_softmax();
+  test_nn_telemetry();
+  test_nn_checkpoint_resume();
+  test_nn_train_threads();
+  test_nn_early_stop();
+  test_ds_stream();
+  test_nn_rng();
+  test_serve_nn();
 
   printf("> finished all tests\n");
 
@@ -1,6 +1,7 @@
 #include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <sys/stat.h>
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL2_gfxPrimitives.h>
@@ -11,6 +12,40 @@
 #define WINDOW_WIDTH 800
 #define WINDOW_HEIGHT 600
 #define RENDER_RATE 100
+#define LOD_BINS 64        // most neurons drawn per layer, more are binned
+#define LOD_MAX_LINES 1024 // most lines per layer pair, more are a heatmap
+
+typedef struct {
+  // The model on screen and everything drawn from it. While a trainer
+  // publishes telemetry its snapshots are shown, otherwise the model file.
+  // The file is polled every frame but only reloaded when its mtime or size
+  // changed, and only redrawn when the reloaded weights differ. nn_save
+  // replaces the file with a rename, so a poll never sees a partial one.
+  NN nn;
+  int loaded;
+  NN_Telemetry telemetry; // open while a trainer publishes
+  uint64_t seq;           // snapshots of the telemetry seen
+  size_t epoch;           // of the last snapshot
+  float loss;             // of the last snapshot
+  struct timespec mtime;  // of the loaded model file
+  off_t size;             // of the loaded model file
+
+  // Level of detail: with lod set, layers of more than LOD_BINS neurons
+  // are drawn as LOD_BINS bins of neighboring neurons, and layer pairs of
+  // more than LOD_MAX_LINES bin pairs as a heatmap of the mean weight
+  // magnitudes, rendered into a texture once per weights.
+  int lod;
+  size_t *nodes;          // neurons per layer
+  size_t *bins;           // drawn nodes (neurons or bins) per layer
+  size_t max_bins;        // most bins of any layer
+  SDL_Color *edge_colors; // one per pair of bins, layer after layer
+  size_t *edge_offset;    // first edge color of each layer
+  SDL_Color *node_colors; // one per bin, layer after layer
+  size_t *node_offset;    // first node color of each layer
+  int *as_heatmap;        // per layer pair: drawn as a heatmap
+  SDL_Texture **heatmaps; // per layer pair: its heatmap, made when drawn
+  int dirty;              // the weights changed since the last frame
+} View;
 
 void hsv2rgb(int h, int s, int v, SDL_Color *rgb) {
   rgb->r = rgb->g = rgb->b = v;
@@ -75,6 +110,9 @@ void hsv2rgb(int h, int s, int v, SDL_Color *rgb) {
 float scaler_sigmoid(float x, float c) { return 2 * c / (1 + exp(-x)) - c; }
 
 float scaler_linear(float x, float xmin, float xmax, float tmin, float tmax) {
+  if (xmax == xmin) {
+    return tmin; // e.g. a network that got no snapshot yet
+  }
   return (x - xmin) / (xmax - xmin) * (tmax - tmin) + tmin;
 }
 
@@ -104,12 +142,17 @@ int init_sdl(SDL_Window **window, SDL_Renderer **renderer) {
   return true;
 }
 
-void handle_inputs(SDL_Event *event, int *quit, int *pause) {
+void handle_inputs(SDL_Event *event, int *quit, int *pause, int *redraw,
+                   int *lod) {
   while (SDL_PollEvent(event)) {
     switch (event->type) {
     case SDL_QUIT:
       *quit = true;
       break;
+    case SDL_WINDOWEVENT:
+      // exposed, resized, ...: the window content may be gone
+      *redraw = true;
+      break;
     case SDL_KEYUP:
       break;
     case SDL_KEYDOWN:
@@ -120,6 +163,9 @@ void handle_inputs(SDL_Event *event, int *quit, int *pause) {
       case SDLK_p:
         *pause = *pause == true ? false : true;
         break;
+      case SDLK_l:
+        *lod = *lod == true ? false : true;
+        break;
       default:
         break;
       }
@@ -129,11 +175,6 @@ void handle_inputs(SDL_Event *event, int *quit, int *pause) {
   }
 }
 
-void handle_state() {
-  // read current model weights
-  // TODO: ...
-}
-
 size_t array_max(size_t arr[], size_t len) {
   if (!arr || len < 1) {
     return 0;
@@ -178,19 +219,84 @@ float farray_min(float arr[], size_t len) {
   return result;
 }
 
-void handle_rendering(SDL_Renderer *renderer, int w, int h,
-                      const char *model_path) {
-  SDL_RenderClear(renderer);
+void view_free_cache(View *view) {
+  for (size_t i = 0; view->heatmaps && i < view->nn.n_layers - 1; ++i) {
+    if (view->heatmaps[i]) {
+      SDL_DestroyTexture(view->heatmaps[i]);
+    }
+  }
+  free(view->heatmaps);
+  free(view->as_heatmap);
+  free(view->nodes);
+  free(view->bins);
+  free(view->edge_colors);
+  free(view->edge_offset);
+  free(view->node_colors);
+  free(view->node_offset);
+  view->heatmaps = NULL;
+  view->as_heatmap = NULL;
+  view->nodes = NULL;
+  view->bins = NULL;
+  view->edge_colors = NULL;
+  view->edge_offset = NULL;
+  view->node_colors = NULL;
+  view->node_offset = NULL;
+}
 
-  // read model data
-  NN nn = nn_load(model_path);
-  size_t nodes[nn.n_layers];
-  nodes[0] = nn.weights[1].num_rows;
-  nodes[1] = nn.weights[1].num_cols;
-  for (size_t i = 2; i < nn.n_layers; ++i) {
-    nodes[i] = nn.weights[i].num_cols;
+void view_free_model(View *view) {
+  view_free_cache(view);
+  if (view->loaded) {
+    nn_free(view->nn);
   }
-  size_t max_nodes = array_max(nodes, nn.n_layers);
+  view->loaded = false;
+}
+
+// bin of neuron j of a layer of n neurons drawn as m bins
+size_t bin_of(size_t j, size_t n, size_t m) { return j * m / n; }
+
+// neurons of a layer of n neurons in bin b of m
+size_t bin_size(size_t b, size_t n, size_t m) {
+  return ((b + 1) * n + m - 1) / m - (b * n + m - 1) / m;
+}
+
+// compute the bins and the colors of all edges and nodes of view->nn
+void view_cache(View *view) {
+  NN nn = view->nn;
+  view->nodes = malloc(nn.n_layers * sizeof(*view->nodes));
+  view->bins = malloc(nn.n_layers * sizeof(*view->bins));
+  view->edge_offset = malloc(nn.n_layers * sizeof(*view->edge_offset));
+  view->node_offset = malloc(nn.n_layers * sizeof(*view->node_offset));
+  view->as_heatmap = calloc(nn.n_layers, sizeof(*view->as_heatmap));
+  view->heatmaps = calloc(nn.n_layers, sizeof(*view->heatmaps));
+  NN_ASSERT(view->nodes && view->bins && view->edge_offset &&
+            view->node_offset && view->as_heatmap && view->heatmaps);
+  view->nodes[0] = nn.weights[1].num_rows;
+  for (size_t i = 1; i < nn.n_layers; ++i) {
+    view->nodes[i] = nn.weights[i].num_cols;
+  }
+  for (size_t i = 0; i < nn.n_layers; ++i) {
+    view->bins[i] = view->lod && view->nodes[i] > LOD_BINS ? LOD_BINS
+                                                           : view->nodes[i];
+  }
+  view->max_bins = array_max(view->bins, nn.n_layers);
+
+  size_t n_edges = 0;
+  size_t n_nodes = 0;
+  for (size_t i = 0; i < nn.n_layers; ++i) {
+    view->edge_offset[i] = n_edges;
+    view->node_offset[i] = n_nodes;
+    if (i + 1 < nn.n_layers) {
+      n_edges += view->bins[i] * view->bins[i + 1];
+      view->as_heatmap[i] =
+          view->lod && view->bins[i] * view->bins[i + 1] > LOD_MAX_LINES;
+    }
+    n_nodes += view->bins[i];
+  }
+  view->edge_colors = malloc(n_edges * sizeof(*view->edge_colors));
+  view->node_colors = malloc(n_nodes * sizeof(*view->node_colors));
+  float *sums = malloc(n_edges * sizeof(*sums));
+  size_t *bin_k = malloc(array_max(view->nodes, nn.n_layers) * sizeof(*bin_k));
+  NN_ASSERT(view->edge_colors && view->node_colors && sums && bin_k);
 
   // get max/min values for color scaling
   float weight_max = 0.0;
@@ -202,30 +308,202 @@ void handle_rendering(SDL_Renderer *renderer, int w, int h,
       float b = MAT_AT(nn.biases[i], 0, j);
       bias_min = bias_min > b ? b : bias_min;
       bias_max = bias_max < b ? b : bias_max;
-      for (size_t k = 0; k < nn.weights[i].num_rows; ++k) {
+    }
+    // row by row, the order the weights are stored in
+    for (size_t k = 0; k < nn.weights[i].num_rows; ++k) {
+      for (size_t j = 0; j < nn.weights[i].num_cols; ++j) {
         float w = MAT_AT(nn.weights[i], k, j);
         weight_min = weight_min > w ? w : weight_min;
         weight_max = weight_max < w ? w : weight_max;
       }
     }
   }
-  // printf("%f, %f, %f, %f\n", weight_max, weight_min, bias_max, bias_min);
+
+  // connections from bin j of layer i to bin k of layer i + 1: lines show
+  // the mean weight, heatmaps the mean weight magnitude
+  for (size_t i = 0; i < nn.n_layers - 1; ++i) {
+    const size_t n_j = view->nodes[i], m_j = view->bins[i];
+    const size_t n_k = view->nodes[i + 1], m_k = view->bins[i + 1];
+    const int heat = view->as_heatmap[i];
+    float *sum = sums + view->edge_offset[i];
+    memset(sum, 0, m_j * m_k * sizeof(*sum));
+    for (size_t k = 0; k < n_k; ++k) {
+      bin_k[k] = bin_of(k, n_k, m_k);
+    }
+    for (size_t j = 0; j < n_j; ++j) {
+      float *sum_j = sum + bin_of(j, n_j, m_j) * m_k;
+      const float *w_j = &MAT_AT(nn.weights[i + 1], j, 0);
+      for (size_t k = 0; k < n_k; ++k) {
+        sum_j[bin_k[k]] += heat ? fabsf(w_j[k]) : w_j[k];
+      }
+    }
+    float mean_max = 0.0;
+    for (size_t j = 0; j < m_j; ++j) {
+      for (size_t k = 0; k < m_k; ++k) {
+        sum[j * m_k + k] /= bin_size(j, n_j, m_j) * bin_size(k, n_k, m_k);
+        mean_max = mean_max < sum[j * m_k + k] ? sum[j * m_k + k] : mean_max;
+      }
+    }
+    SDL_Color *colors = view->edge_colors + view->edge_offset[i];
+    for (size_t e = 0; e < m_j * m_k; ++e) {
+      float hue =
+          !heat ? scaler_linear(sum[e], weight_min, weight_max, 90, 360)
+          : mean_max > 0 ? scaler_linear(sum[e], 0, mean_max, 90, 360)
+                         : 90;
+      hsv2rgb(hue, 254, 254, &colors[e]);
+    }
+  }
+  free(sums);
+  free(bin_k);
+
+  // nodes, colored by their (mean) bias
+  for (size_t i = 0; i < nn.n_layers; ++i) {
+    const size_t n = view->nodes[i], m = view->bins[i];
+    SDL_Color *colors = view->node_colors + view->node_offset[i];
+    for (size_t b = 0; b < m; ++b) {
+      const size_t j0 = (b * n + m - 1) / m;
+      float bias = 0;
+      for (size_t j = j0; i > 0 && j < j0 + bin_size(b, n, m); ++j) {
+        bias += MAT_AT(nn.biases[i], 0, j);
+      }
+      bias /= bin_size(b, n, m);
+      hsv2rgb(scaler_linear(bias, bias_min, bias_max, 90, 360), 254, 254,
+              &colors[b]);
+    }
+  }
+}
+
+int same_time(struct timespec a, struct timespec b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// same layers and weights
+int same_model(NN a, NN b) {
+  if (a.n_layers != b.n_layers || a.n_params != b.n_params) {
+    return false;
+  }
+  for (size_t i = 0; i < a.n_layers; ++i) {
+    if (a.layers[i].dim != b.layers[i].dim) {
+      return false;
+    }
+  }
+  return memcmp(a.params, b.params, a.n_params * sizeof(*a.params)) == 0;
+}
+
+// read current model weights from the training telemetry, false if no
+// trainer publishes any
+int handle_telemetry(View *view, const char *telemetry) {
+  if (nn_telemetry_closed(view->telemetry)) {
+    nn_telemetry_close(view->telemetry);
+    view->telemetry = nn_telemetry_open(telemetry);
+    view->seq = 0;
+    if (view->telemetry.shm == NULL) {
+      return false;
+    }
+    // snapshots are read into a network of the published layers
+    view_free_model(view);
+    view->nn = nn_create_layers(view->telemetry.layers,
+                                view->telemetry.n_layers);
+    view->loaded = true;
+    // drawable (all zero) until the first snapshot arrives
+    view_cache(view);
+    view->dirty = true;
+    // the model file is loaded again once the trainer is done
+    view->mtime = (struct timespec){0};
+    view->size = -1;
+  }
+  if (nn_telemetry_read(view->telemetry, view->nn, &view->seq, &view->epoch,
+                        &view->loss)) {
+    view_free_cache(view);
+    view_cache(view);
+    view->dirty = true;
+  }
+  return true;
+}
+
+void handle_state(View *view, const char *model_path, const char *telemetry) {
+  if (handle_telemetry(view, telemetry)) {
+    return;
+  }
+
+  // read current model weights, if the model file changed
+  struct stat st;
+  if (stat(model_path, &st) != 0) {
+    return; // not written yet
+  }
+  if (view->loaded && same_time(st.st_mtim, view->mtime) &&
+      st.st_size == view->size) {
+    return;
+  }
+  NN nn = nn_load(model_path);
+  view->mtime = st.st_mtim;
+  view->size = st.st_size;
+  if (view->loaded && same_model(nn, view->nn)) {
+    nn_free(nn);
+    return;
+  }
+  view_free_model(view);
+  view->nn = nn;
+  view->loaded = true;
+  view_cache(view);
+  view->dirty = true;
+}
+
+// the heatmap of layer pair i as a texture: a row per bin of layer i, a
+// column per bin of layer i + 1; made once per weights and kept
+SDL_Texture *view_heatmap(View *view, SDL_Renderer *renderer, size_t i) {
+  if (view->heatmaps[i]) {
+    return view->heatmaps[i];
+  }
+  const size_t rows = view->bins[i], cols = view->bins[i + 1];
+  SDL_Texture *texture =
+      SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                        SDL_TEXTUREACCESS_STATIC, cols, rows);
+  if (!texture) {
+    fprintf(stderr, "ERROR: SDL_CreateTexture");
+    return NULL;
+  }
+  uint32_t *pixels = malloc(rows * cols * sizeof(*pixels));
+  NN_ASSERT(pixels);
+  const SDL_Color *colors = view->edge_colors + view->edge_offset[i];
+  for (size_t e = 0; e < rows * cols; ++e) {
+    pixels[e] = 0xFF000000u | colors[e].r << 16 | colors[e].g << 8 |
+                colors[e].b;
+  }
+  SDL_UpdateTexture(texture, NULL, pixels, cols * sizeof(*pixels));
+  free(pixels);
+  view->heatmaps[i] = texture;
+  return texture;
+}
+
+void handle_rendering(SDL_Renderer *renderer, int w, int h, View *view) {
+  SDL_RenderClear(renderer);
+  const NN nn = view->nn;
+  const size_t *bins = view->bins;
+  int r = (w > h ? w / nn.n_layers : h / view->max_bins) / 9;
+  r = r > 1 ? r : 1;
 
   // connections
-  SDL_Color rgb_c;
   int x1, y1, x2, y2;
-  float weight;
   for (size_t i = 0; i < nn.n_layers - 1; ++i) {
     x1 = w / (nn.n_layers + 1) * (i + 1);
     x2 = w / (nn.n_layers + 1) * (i + 2);
-    for (size_t j = 0; j < nodes[i]; ++j) {
-      y1 = h / (nodes[i] + 1) * (j + 1);
-      for (size_t k = 0; k < nodes[i + 1]; ++k) {
-        weight = MAT_AT(nn.weights[i + 1], j, k);
-        // printf("%zu, (%zu, %zu) W: %f\n", i, j, k, weight);
-        hsv2rgb(scaler_linear(weight, weight_min, weight_max, 90, 360), 254,
-                254, &rgb_c);
-        y2 = h / (nodes[i + 1] + 1) * (k + 1);
+    if (view->as_heatmap[i]) {
+      // too many lines to see: a heatmap between the two layers
+      SDL_Texture *texture = view_heatmap(view, renderer, i);
+      SDL_Rect rect = {x1 + 2 * r, h / (bins[i] + 1) / 2, x2 - x1 - 4 * r,
+                       h - h / (bins[i] + 1)};
+      if (texture) {
+        SDL_RenderCopy(renderer, texture, NULL, &rect);
+      }
+      continue;
+    }
+    const SDL_Color *colors = view->edge_colors + view->edge_offset[i];
+    for (size_t j = 0; j < bins[i]; ++j) {
+      y1 = h / (bins[i] + 1) * (j + 1);
+      for (size_t k = 0; k < bins[i + 1]; ++k) {
+        SDL_Color rgb_c = colors[j * bins[i + 1] + k];
+        y2 = h / (bins[i + 1] + 1) * (k + 1);
         // aalineRGBA(renderer, x1, y1, x2, y2, rgb_c.r, rgb_c.g, rgb_c.b,
         // 0x88);
         thickLineRGBA(renderer, x1, y1, x2, y2, 2, rgb_c.r, rgb_c.g, rgb_c.b,
@@ -234,23 +512,21 @@ void handle_rendering(SDL_Renderer *renderer, int w, int h,
     }
   }
 
-  // nodes
-  SDL_Color rgb_n;
-  int r = (w > h ? w / nn.n_layers : h / max_nodes) / 9;
+  // nodes, binned layers as one bar per bin
   int x, y;
-  float bias;
   for (size_t i = 0; i < nn.n_layers; ++i) {
+    const SDL_Color *colors = view->node_colors + view->node_offset[i];
+    const int binned = bins[i] < view->nodes[i];
+    const int half = h / (bins[i] + 1) / 2;
     x = w / (nn.n_layers + 1) * (i + 1);
-    for (size_t j = 0; j < nodes[i]; ++j) {
-      if (i > 0) {
-        bias = MAT_AT(nn.weights[i], 0, j);
-      } else {
-        bias = 0;
+    for (size_t j = 0; j < bins[i]; ++j) {
+      SDL_Color rgb_n = colors[j];
+      y = h / (bins[i] + 1) * (j + 1);
+      if (binned) {
+        boxRGBA(renderer, x - r, y - half, x + r, y + half - 1, rgb_n.r,
+                rgb_n.g, rgb_n.b, 0xFF);
+        continue;
       }
-      // printf("%zu, (0, %zu) B: %f\n", i, j, bias);
-      hsv2rgb(scaler_linear(bias, bias_min, bias_max, 90, 360), 254, 254,
-              &rgb_n);
-      y = h / (nodes[i] + 1) * (j + 1);
       aacircleRGBA(renderer, x, y, r, rgb_n.r, rgb_n.g, rgb_n.b, 0xFF);
       filledCircleRGBA(renderer, x, y, r - 1, rgb_n.r, rgb_n.g, rgb_n.b, 0xFF);
     }
@@ -260,7 +536,7 @@ void handle_rendering(SDL_Renderer *renderer, int w, int h,
   SDL_RenderPresent(renderer);
 }
 
-int visualize(const char *model_path) {
+int visualize(const char *model_path, const char *telemetry) {
   // Setup SDL
   SDL_Window *window = NULL;
   SDL_Renderer *renderer = NULL;
@@ -269,24 +545,49 @@ int visualize(const char *model_path) {
   }
 
   int w, h;
+  int last_w = 0, last_h = 0;
+  View view = {.lod = true};
+  int lod = view.lod;
 
   SDL_Event event;
   int quit = false;
   int pause = false;
+  int redraw = false;
   while (!quit) {
 
     // SDL_GetWindowSize(window, &w, &h);
     SDL_GetWindowSizeInPixels(window, &w, &h);
 
     // process inputs
-    handle_inputs(&event, &quit, &pause);
+    handle_inputs(&event, &quit, &pause, &redraw, &lod);
+    if (lod != view.lod) {
+      view.lod = lod;
+      if (view.loaded) {
+        view_free_cache(&view);
+        view_cache(&view);
+        view.dirty = true;
+      }
+    }
 
     if (!pause) {
       // update state
-      handle_state();
+      handle_state(&view, model_path, telemetry);
+    }
+
+    if (view.dirty && view.telemetry.shm) {
+      char title[64];
+      snprintf(title, sizeof(title), "epoch %zu, loss %f", view.epoch,
+               view.loss);
+      SDL_SetWindowTitle(window, title);
+    }
 
-      // render image
-      handle_rendering(renderer, w, h, model_path);
+    // render image, only if something changed
+    if (view.loaded && (view.dirty || redraw || w != last_w || h != last_h)) {
+      handle_rendering(renderer, w, h, &view);
+      view.dirty = false;
+      redraw = false;
+      last_w = w;
+      last_h = h;
     }
 
     // cap loop rate
@@ -294,10 +595,19 @@ int visualize(const char *model_path) {
   }
 
   // Cleanup SDL
+  view_free_model(&view);
+  nn_telemetry_close(view.telemetry);
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
   SDL_Quit();
   return 0;
 }
 
-int main() { return visualize("xor.model"); }
+// usage: train [MODEL [TELEMETRY]]
+// shows the snapshots a trainer publishes to the shared memory TELEMETRY
+// (TrainParams.telemetry, default /nn_train) and MODEL (default xor.model)
+// when there is none
+int main(int argc, char **argv) {
+  return visualize(argc > 1 ? argv[1] : "xor.model",
+                   argc > 2 ? argv[2] : "/nn_train");
+}